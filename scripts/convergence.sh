@@ -0,0 +1,35 @@
+#!/bin/sh
+# Time-to-error curves for a fixed set of scenes, see src/convergence.h.
+#
+#   scripts/convergence.sh [RENDERER] [SCENE.txt ...]
+#
+# A reference checkpoint with REFERENCE_SPP samples is rendered once per scene
+# into references/ and reused by later runs; delete it after changing the scene.
+# Every scene is then rendered against its reference, logging RMSE and relMSE
+# at the ERROR_AT render times to results/<scene>.convergence.csv. All rows
+# also go to results/convergence.csv for plotting. The renderer needs a display.
+set -e
+
+RENDERER=${1:-build/cis565_path_tracer}
+[ $# -gt 0 ] && shift
+SCENES=${*:-"scenes/cornell.txt scenes/sphere.txt scenes/motion.txt"}
+REFERENCE_SPP=${REFERENCE_SPP:-16384}
+ERROR_AT=${ERROR_AT:-1,2,5,10,30,60}
+
+mkdir -p references results
+echo "scene,target_s,render_s,iteration,rmse,relmse,efficiency" > results/convergence.csv
+
+for scene in $SCENES; do
+    name=$(basename "$scene" .txt)
+    reference=references/$name.ckpt
+    if [ ! -f "$reference" ]; then
+        # the renderer checkpoints to <FILE>.ckpt, FILE being the scene's output name
+        image=$(awk '$1 == "FILE" { print $2 }' "$scene")
+        echo "Rendering reference $reference ($REFERENCE_SPP samples)"
+        "$RENDERER" "$scene" --iterations "$REFERENCE_SPP" --checkpoint-every "$REFERENCE_SPP"
+        mv "$image.ckpt" "$reference"
+    fi
+    "$RENDERER" "$scene" --reference "$reference" --error-at "$ERROR_AT" \
+        --error-log "results/$name.convergence.csv"
+    tail -n +2 "results/$name.convergence.csv" >> results/convergence.csv
+done
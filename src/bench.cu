@@ -0,0 +1,418 @@
+// Microbenchmarks for the intersection routines in intersections.h and the
+// BVH traversal, on the CPU and the GPU.
+//
+//   bench [SCENEFILE.txt] [--rays N] [--repeat N] [--seed N] [--cpu | --gpu] [--csv FILE]
+//
+// Every test runs over four fixed-seed ray sets (coherent, incoherent,
+// hit-heavy, miss-heavy), so numbers from two builds are directly comparable.
+// The BVH rows need a scene with OBJ meshes. Results are CSV rows on stdout:
+//   test,rays,device,calls,ns_per_call,mrays_per_s,hit_rate
+
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <cuda.h>
+
+#include "sceneStructs.h"
+#include "scene.h"
+#include "glm/glm.hpp"
+#include "utilities.h"
+#include "intersections.h"
+
+#include "device_launch_parameters.h"
+
+#define BENCH_BLOCK_SIZE 128
+
+namespace {
+
+enum RaySet {
+	RAYS_COHERENT = 0,  // pinhole camera in scanline order, like the first bounce
+	RAYS_INCOHERENT,    // random origins around the target, random directions
+	RAYS_HIT,           // aimed at the inner half of the target bounds
+	RAYS_MISS,          // pass outside the target's bounding sphere
+	RAY_SET_COUNT
+};
+
+const char* raySetNames[] = { "coherent", "incoherent", "hit", "miss" };
+
+// mt19937 output is specified by the standard, unlike the std distributions,
+// so the ray sets are the same with every compiler
+struct BenchRng {
+	std::mt19937 engine;
+
+	explicit BenchRng(unsigned int seed) : engine(seed) {}
+
+	float uniform() {
+		return (engine() >> 8) * (1.f / 16777216.f);
+	}
+
+	glm::vec3 unitVector() {
+		float z = 2.f * uniform() - 1.f;
+		float phi = TWO_PI * uniform();
+		float r = sqrtf(fmaxf(0.f, 1.f - z * z));
+		return glm::vec3(r * cosf(phi), r * sinf(phi), z);
+	}
+};
+
+std::vector<Ray> makeRays(RaySet set, int count, glm::vec3 lo, glm::vec3 hi, unsigned int seed) {
+	BenchRng rng(seed * RAY_SET_COUNT + set);
+	glm::vec3 center = 0.5f * (lo + hi);
+	float radius = fmaxf(0.5f * glm::length(hi - lo), 1e-4f);
+	std::vector<Ray> rays(count);
+
+	int side = (int)ceilf(sqrtf((float)count));
+	for (int i = 0; i < count; i++) {
+		Ray& r = rays[i];
+		if (set == RAYS_COHERENT) {
+			// image plane through the center, covering the bounding sphere
+			float u = ((i % side) + 0.5f) / side * 2.f - 1.f;
+			float v = ((i / side) + 0.5f) / side * 2.f - 1.f;
+			r.origin = center + glm::vec3(0.f, 0.f, 3.f * radius);
+			r.direction = glm::normalize(center + radius * glm::vec3(u, v, 0.f) - r.origin);
+		}
+		else if (set == RAYS_INCOHERENT) {
+			r.origin = center + 2.f * radius * rng.uniform() * rng.unitVector();
+			r.direction = rng.unitVector();
+		}
+		else if (set == RAYS_HIT) {
+			glm::vec3 target = lo + (hi - lo) * glm::vec3(0.25f + 0.5f * rng.uniform(),
+				0.25f + 0.5f * rng.uniform(), 0.25f + 0.5f * rng.uniform());
+			r.origin = center + 3.f * radius * rng.unitVector();
+			r.direction = glm::normalize(target - r.origin);
+		}
+		else {
+			// aim beside the bounding sphere, so even the root box is missed
+			glm::vec3 out = rng.unitVector();
+			glm::vec3 side_dir = glm::normalize(glm::cross(out, rng.unitVector()));
+			r.origin = center + 3.f * radius * out;
+			r.direction = glm::normalize(center + (1.1f + rng.uniform()) * radius * side_dir - r.origin);
+		}
+	}
+	return rays;
+}
+
+// The tests return the ray parameter of the hit, negative on a miss. They
+// are plain structs so the same object runs on both sides.
+struct BoxTest {
+	Geom box;
+	__host__ __device__ float operator()(const Ray& r) const {
+		glm::vec3 p, n;
+		bool outside;
+		return boxIntersectionTest(box, r, p, n, outside);
+	}
+};
+
+struct SphereTest {
+	Geom sphere;
+	__host__ __device__ float operator()(const Ray& r) const {
+		glm::vec3 p, n;
+		bool outside;
+		return sphereIntersectionTest(sphere, r, p, n, outside);
+	}
+};
+
+struct GeomTriangleTest {
+	Geom triangle;
+	__host__ __device__ float operator()(const Ray& r) const {
+		glm::vec3 p, n;
+		glm::vec2 uv;
+		bool outside;
+		return triangleIntersectionTest(triangle, r, p, n, uv, outside);
+	}
+};
+
+struct TriTest {
+	Tri tri;
+	__host__ __device__ float operator()(const Ray& r) const {
+		glm::vec3 p, n;
+		glm::vec2 uv;
+		bool outside;
+		return triangleIntersectionTest(tri, r, p, n, uv, outside);
+	}
+};
+
+struct AabbTest {
+	AABB box;
+	__host__ __device__ float operator()(const Ray& r) const {
+		return box.IntersectP(r) ? 1.f : -1.f;
+	}
+};
+
+struct BvhTest {
+	const Tri* tris;
+	const BVHNode_GPU* nodes;
+	__host__ __device__ float operator()(const Ray& r) const {
+		float t = FLT_MAX;
+		glm::vec3 s;
+		int nodesVisited = 0;
+		int triangleTests = 0;
+		return bvhIntersect(r, tris, nodes, t, s, nodesVisited, triangleTests) != -1 ? fmaxf(t, 0.f) : -1.f;
+	}
+};
+
+template<typename Test>
+__global__ void runTest(Test test, int n, const Ray* rays, float* t) {
+	int index = blockIdx.x * blockDim.x + threadIdx.x;
+	if (index < n) {
+		t[index] = test(rays[index]);
+	}
+}
+
+struct Options {
+	const char* sceneFile = NULL;
+	int rays = 1 << 20;
+	int repeat = 4;
+	unsigned int seed = 1;
+	bool cpu = true;
+	bool gpu = true;
+	const char* csvPath = NULL;
+};
+
+struct Result {
+	long long calls;
+	double ns;
+	int hits;
+};
+
+FILE* csv = NULL;
+
+void report(const char* test, RaySet set, const char* device, int rays, const Result& result) {
+	double nsPerCall = result.ns / result.calls;
+	double mraysPerS = result.calls / result.ns * 1e3;
+	double hitRate = (double)result.hits / rays;
+	char line[256];
+	snprintf(line, sizeof(line), "%s,%s,%s,%lld,%.3f,%.3f,%.4f\n",
+		test, raySetNames[set], device, result.calls, nsPerCall, mraysPerS, hitRate);
+	fputs(line, stdout);
+	fflush(stdout);
+	if (csv) {
+		fputs(line, csv);
+	}
+}
+
+template<typename Test>
+Result timeCpu(const Test& test, const std::vector<Ray>& rays, int repeat) {
+	typedef std::chrono::steady_clock Clock;
+	Result result = { (long long)rays.size() * repeat, 0.0, 0 };
+	int hits = 0;
+	Clock::time_point start = Clock::now();
+	for (int k = 0; k < repeat; k++) {
+		hits = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			hits += test(rays[i]) >= 0.f;
+		}
+	}
+	result.ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	result.hits = hits;
+	return result;
+}
+
+template<typename Test>
+Result timeGpu(const Test& test, const Ray* dev_rays, float* dev_t, int n, int repeat) {
+	Result result = { (long long)n * repeat, 0.0, 0 };
+	dim3 blocks((n + BENCH_BLOCK_SIZE - 1) / BENCH_BLOCK_SIZE);
+
+	// warm up, the first launch of each instantiation pays for module loading
+	runTest<<<blocks, BENCH_BLOCK_SIZE>>>(test, n, dev_rays, dev_t);
+	cudaEvent_t start, stop;
+	cudaEventCreate(&start);
+	cudaEventCreate(&stop);
+	cudaEventRecord(start);
+	for (int k = 0; k < repeat; k++) {
+		runTest<<<blocks, BENCH_BLOCK_SIZE>>>(test, n, dev_rays, dev_t);
+	}
+	cudaEventRecord(stop);
+	cudaEventSynchronize(stop);
+	float ms = 0.f;
+	cudaEventElapsedTime(&ms, start, stop);
+	cudaEventDestroy(start);
+	cudaEventDestroy(stop);
+	result.ns = ms * 1e6;
+
+	std::vector<float> t(n);
+	cudaMemcpy(t.data(), dev_t, n * sizeof(float), cudaMemcpyDeviceToHost);
+	for (int i = 0; i < n; i++) {
+		result.hits += t[i] >= 0.f;
+	}
+	return result;
+}
+
+// runs one test over every ray set on the requested devices
+template<typename Test>
+void bench(const char* name, const Test& cpuTest, const Test& gpuTest, glm::vec3 lo, glm::vec3 hi, const Options& options) {
+	Ray* dev_rays = NULL;
+	float* dev_t = NULL;
+	if (options.gpu) {
+		cudaMalloc(&dev_rays, options.rays * sizeof(Ray));
+		cudaMalloc(&dev_t, options.rays * sizeof(float));
+	}
+	for (int set = 0; set < RAY_SET_COUNT; set++) {
+		std::vector<Ray> rays = makeRays((RaySet)set, options.rays, lo, hi, options.seed);
+		if (options.cpu) {
+			report(name, (RaySet)set, "cpu", options.rays, timeCpu(cpuTest, rays, options.repeat));
+		}
+		if (options.gpu) {
+			cudaMemcpy(dev_rays, rays.data(), options.rays * sizeof(Ray), cudaMemcpyHostToDevice);
+			report(name, (RaySet)set, "gpu", options.rays, timeGpu(gpuTest, dev_rays, dev_t, options.rays, options.repeat));
+			cudaError_t err = cudaGetLastError();
+			if (err != cudaSuccess) {
+				fprintf(stderr, "CUDA error in %s: %s\n", name, cudaGetErrorString(err));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	cudaFree(dev_rays);
+	cudaFree(dev_t);
+}
+
+Geom unitGeom(GeomType type) {
+	Geom g;
+	g.type = type;
+	g.materialid = 0;
+	g.translation = glm::vec3(0.f);
+	g.rotation = glm::vec3(0.f);
+	g.scale = glm::vec3(1.f);
+	g.transform = glm::mat4(1.f);
+	g.inverseTransform = glm::mat4(1.f);
+	g.invTranspose = glm::mat4(1.f);
+	return g;
+}
+
+void printUsage(const char* exe) {
+	printf("Usage: %s [SCENEFILE.txt] [--rays N] [--repeat N] [--seed N] [--cpu | --gpu] [--csv FILE]\n", exe);
+}
+
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--rays") == 0 && hasValue) {
+			options.rays = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--repeat") == 0 && hasValue) {
+			options.repeat = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+			options.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--csv") == 0 && hasValue) {
+			options.csvPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--cpu") == 0) {
+			options.gpu = false;
+		}
+		else if (strcmp(argv[i], "--gpu") == 0) {
+			options.cpu = false;
+		}
+		else if (strncmp(argv[i], "--", 2) != 0 && options.sceneFile == NULL) {
+			options.sceneFile = argv[i];
+		}
+		else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (options.rays <= 0 || options.repeat <= 0) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	int devices = 0;
+	if (options.gpu && (cudaGetDeviceCount(&devices) != cudaSuccess || devices == 0)) {
+		fprintf(stderr, "No CUDA device, running the CPU tests only\n");
+		options.gpu = false;
+		options.cpu = true;
+	}
+
+	// loaded before any output, the scene loader is chatty on stdout
+	Scene* scene = NULL;
+	if (options.sceneFile) {
+		scene = new Scene(options.sceneFile);
+		if (scene->mesh_tris_sorted.empty()) {
+			fprintf(stderr, "%s has no triangle meshes, skipping the BVH tests\n", options.sceneFile);
+		}
+	}
+
+	if (options.csvPath) {
+		csv = fopen(options.csvPath, "w");
+		if (csv == NULL) {
+			fprintf(stderr, "Could not write %s\n", options.csvPath);
+			return 1;
+		}
+	}
+	const char* header = "test,rays,device,calls,ns_per_call,mrays_per_s,hit_rate\n";
+	fputs(header, stdout);
+	if (csv) {
+		fputs(header, csv);
+	}
+
+	// the primitives in object space, which is where the tests spend their time
+	glm::vec3 lo(-0.5f), hi(0.5f);
+
+	BoxTest box = { unitGeom(CUBE) };
+	bench("box", box, box, lo, hi, options);
+
+	SphereTest sphere = { unitGeom(SPHERE) };
+	bench("sphere", sphere, sphere, lo, hi, options);
+
+	glm::vec3 p0(-0.5f, -0.5f, 0.f), p1(0.5f, -0.5f, 0.f), p2(0.f, 0.5f, 0.f);
+	glm::vec3 n(0.f, 0.f, 1.f);
+	GeomTriangleTest geomTriangle = { unitGeom(TRIANGLE) };
+	geomTriangle.triangle.pos[0] = p0;
+	geomTriangle.triangle.pos[1] = p1;
+	geomTriangle.triangle.pos[2] = p2;
+	for (int k = 0; k < 3; k++) {
+		geomTriangle.triangle.normal[k] = n;
+		geomTriangle.triangle.uv[k] = glm::vec2(0.f);
+	}
+	bench("triangle_geom", geomTriangle, geomTriangle, lo, hi, options);
+
+	TriTest tri;
+	memset(&tri, 0, sizeof(tri));
+	tri.tri.p0 = p0;
+	tri.tri.p1 = p1;
+	tri.tri.p2 = p2;
+	tri.tri.n0 = tri.tri.n1 = tri.tri.n2 = n;
+	tri.tri.transform = tri.tri.inverseTransform = tri.tri.invTranspose = glm::mat4(1.f);
+	tri.tri.plane_normal = glm::normalize(glm::cross(p1 - p0, p2 - p1));
+	tri.tri.S = glm::length(glm::cross(p1 - p0, p2 - p1));
+	bench("triangle_tri", tri, tri, lo, hi, options);
+
+	AabbTest aabb;
+	aabb.box.pMin = lo;
+	aabb.box.pMax = hi;
+	bench("aabb", aabb, aabb, lo, hi, options);
+
+	if (scene && !scene->mesh_tris_sorted.empty()) {
+		const std::vector<Tri>& tris = scene->mesh_tris_sorted;
+		const std::vector<BVHNode_GPU>& nodes = scene->bvh_nodes_gpu;
+		BvhTest cpuBvh = { tris.data(), nodes.data() };
+		BvhTest gpuBvh = { NULL, NULL };
+		Tri* dev_tris = NULL;
+		BVHNode_GPU* dev_nodes = NULL;
+		if (options.gpu) {
+			cudaMalloc(&dev_tris, tris.size() * sizeof(Tri));
+			cudaMemcpy(dev_tris, tris.data(), tris.size() * sizeof(Tri), cudaMemcpyHostToDevice);
+			cudaMalloc(&dev_nodes, nodes.size() * sizeof(BVHNode_GPU));
+			cudaMemcpy(dev_nodes, nodes.data(), nodes.size() * sizeof(BVHNode_GPU), cudaMemcpyHostToDevice);
+			gpuBvh.tris = dev_tris;
+			gpuBvh.nodes = dev_nodes;
+		}
+		// rays are generated around the root node's box
+		bench("bvh", cpuBvh, gpuBvh, nodes[0].AABB_min, nodes[0].AABB_max, options);
+		cudaFree(dev_tris);
+		cudaFree(dev_nodes);
+	}
+
+	if (csv) {
+		fclose(csv);
+	}
+	return 0;
+}
@@ -0,0 +1,150 @@
+#include <cstring>
+
+#include "blockCompression.h"
+
+namespace {
+
+unsigned int packRGB565(glm::vec3 c) {
+    glm::ivec3 q = glm::ivec3(glm::clamp(c, 0.f, 1.f) * glm::vec3(31.f, 63.f, 31.f) + 0.5f);
+    return (q.x << 11) | (q.y << 5) | q.z;
+}
+
+void writeBits(unsigned char* block, int& pos, unsigned int value, int count) {
+    for (int i = 0; i < count; i++, pos++) {
+        block[pos >> 3] |= ((value >> i) & 1) << (pos & 7);
+    }
+}
+
+}
+
+// endpoints from the colour bounding box, each texel snapped to the closest palette entry
+void encodeBC1Block(const unsigned char* rgba, unsigned char* out) {
+    glm::vec3 lo(1.f), hi(0.f);
+    for (int i = 0; i < 16; i++) {
+        glm::vec3 c = glm::vec3(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2]) / 255.f;
+        lo = glm::min(lo, c);
+        hi = glm::max(hi, c);
+    }
+    unsigned int c0 = packRGB565(hi);
+    unsigned int c1 = packRGB565(lo);
+
+    memset(out, 0, 8);
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    if (c0 == c1) {
+        return;  // flat block, every index 0
+    }
+
+    // c0 > c1 selects the four colour palette
+    glm::vec3 e0 = unpackRGB565(c0);
+    glm::vec3 e1 = unpackRGB565(c1);
+    glm::vec3 palette[4] = { e0, e1, (2.f * e0 + e1) / 3.f, (e0 + 2.f * e1) / 3.f };
+    unsigned int indices = 0;
+    for (int i = 0; i < 16; i++) {
+        glm::vec3 c = glm::vec3(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2]) / 255.f;
+        int best = 0;
+        float bestDist = 1e30f;
+        for (int p = 0; p < 4; p++) {
+            glm::vec3 d = c - palette[p];
+            float dist = glm::dot(d, d);
+            if (dist < bestDist) {
+                bestDist = dist;
+                best = p;
+            }
+        }
+        indices |= best << (2 * i);
+    }
+    out[4] = indices & 0xFF;
+    out[5] = (indices >> 8) & 0xFF;
+    out[6] = (indices >> 16) & 0xFF;
+    out[7] = indices >> 24;
+}
+
+void encodeBC4Block(const unsigned char* rgba, unsigned char* out) {
+    int lo = 255, hi = 0;
+    for (int i = 0; i < 16; i++) {
+        lo = glm::min(lo, (int)rgba[4 * i]);
+        hi = glm::max(hi, (int)rgba[4 * i]);
+    }
+    memset(out, 0, 8);
+    out[0] = hi;
+    out[1] = lo;
+    if (hi == lo) {
+        return;
+    }
+
+    // r0 > r1 selects the eight value palette
+    int palette[8];
+    palette[0] = hi;
+    palette[1] = lo;
+    for (int i = 2; i < 8; i++) {
+        palette[i] = ((8 - i) * hi + (i - 1) * lo) / 7;
+    }
+    int pos = 16;
+    for (int i = 0; i < 16; i++) {
+        int v = rgba[4 * i];
+        int best = 0;
+        for (int p = 1; p < 8; p++) {
+            if (glm::abs(v - palette[p]) < glm::abs(v - palette[best])) {
+                best = p;
+            }
+        }
+        writeBits(out, pos, best, 3);
+    }
+}
+
+// mode 6: endpoints from the RGBA bounding box, the low endpoint rounded down
+// (p-bit 0) and the high one rounded up (p-bit 1) so every texel lies between them
+void encodeBC7Block(const unsigned char* rgba, unsigned char* out) {
+    const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    glm::ivec4 lo(255), hi(0);
+    for (int i = 0; i < 16; i++) {
+        glm::ivec4 c(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2], rgba[4 * i + 3]);
+        lo = glm::min(lo, c);
+        hi = glm::max(hi, c);
+    }
+    glm::ivec4 q[2] = { lo >> 1, hi >> 1 };
+    int p[2] = { 0, 1 };
+    glm::vec4 e0 = glm::vec4((q[0] << 1) | p[0]);
+    glm::vec4 e1 = glm::vec4((q[1] << 1) | p[1]);
+    glm::vec4 axis = e1 - e0;
+    float axisLength2 = glm::dot(axis, axis);
+
+    int indices[16];
+    for (int i = 0; i < 16; i++) {
+        glm::vec4 c(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2], rgba[4 * i + 3]);
+        float t = axisLength2 > 0.f ? glm::clamp(glm::dot(c - e0, axis) / axisLength2, 0.f, 1.f) : 0.f;
+        int best = 0;
+        for (int w = 1; w < 16; w++) {
+            if (glm::abs(weights[w] - 64.f * t) < glm::abs(weights[best] - 64.f * t)) {
+                best = w;
+            }
+        }
+        indices[i] = best;
+    }
+
+    // the anchor index is stored without its high bit, so it must be < 8
+    if (indices[0] >= 8) {
+        glm::ivec4 tq = q[0]; q[0] = q[1]; q[1] = tq;
+        int tp = p[0]; p[0] = p[1]; p[1] = tp;
+        for (int i = 0; i < 16; i++) {
+            indices[i] = 15 - indices[i];
+        }
+    }
+
+    memset(out, 0, 16);
+    int pos = 0;
+    writeBits(out, pos, 1 << 6, 7);
+    for (int c = 0; c < 4; c++) {
+        writeBits(out, pos, q[0][c], 7);
+        writeBits(out, pos, q[1][c], 7);
+    }
+    writeBits(out, pos, p[0], 1);
+    writeBits(out, pos, p[1], 1);
+    for (int i = 0; i < 16; i++) {
+        writeBits(out, pos, indices[i], i == 0 ? 3 : 4);
+    }
+}
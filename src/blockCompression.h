@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+
+// Block-compressed texture formats. Every format stores 4x4 texel blocks:
+//  BC1  8 bytes/block  RGB, two RGB565 endpoints and 2-bit indices
+//  BC4  8 bytes/block  one channel, two 8-bit endpoints and 3-bit indices
+//  BC7 16 bytes/block  RGBA, encoded with mode 6 only (one subset, 7777.1 endpoints, 4-bit indices)
+enum TextureFormat {
+    TEX_RGBA8 = 0,
+    TEX_BC1,
+    TEX_BC4,
+    TEX_BC7
+};
+
+__host__ __device__ inline int blockBytes(int format) {
+    return format == TEX_BC7 ? 16 : 8;
+}
+
+// encode one 4x4 block of RGBA8 texels (64 bytes, row-major) into `out`
+void encodeBC1Block(const unsigned char* rgba, unsigned char* out);
+void encodeBC4Block(const unsigned char* rgba, unsigned char* out);  // compresses the red channel
+void encodeBC7Block(const unsigned char* rgba, unsigned char* out);
+
+__host__ __device__ inline glm::vec3 unpackRGB565(unsigned int c) {
+    return glm::vec3((c >> 11) & 31, (c >> 5) & 63, c & 31) / glm::vec3(31.f, 63.f, 31.f);
+}
+
+/**
+ * Decodes texel (x, y) of a BC1 block, returned in [0, 1].
+ */
+__host__ __device__ inline glm::vec4 decodeBC1Texel(const unsigned char* block, int x, int y) {
+    unsigned int c0 = block[0] | (block[1] << 8);
+    unsigned int c1 = block[2] | (block[3] << 8);
+    unsigned int indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((unsigned int)block[7] << 24);
+    unsigned int index = (indices >> (2 * (y * 4 + x))) & 3;
+
+    glm::vec3 e0 = unpackRGB565(c0);
+    glm::vec3 e1 = unpackRGB565(c1);
+    if (index == 0) return glm::vec4(e0, 1.f);
+    if (index == 1) return glm::vec4(e1, 1.f);
+    if (c0 > c1) {
+        return glm::vec4(index == 2 ? (2.f * e0 + e1) / 3.f : (e0 + 2.f * e1) / 3.f, 1.f);
+    }
+    return index == 2 ? glm::vec4((e0 + e1) * 0.5f, 1.f) : glm::vec4(0.f);
+}
+
+/**
+ * Decodes texel (x, y) of a BC4 block, returned as a grey texel in [0, 1].
+ */
+__host__ __device__ inline glm::vec4 decodeBC4Texel(const unsigned char* block, int x, int y) {
+    int r0 = block[0];
+    int r1 = block[1];
+    int bit = 3 * (y * 4 + x);
+    int byte = 2 + bit / 8;
+    unsigned int bits = block[byte] | (byte + 1 < 8 ? block[byte + 1] << 8 : 0);
+    int index = (bits >> (bit % 8)) & 7;
+
+    int value;
+    if (index == 0) {
+        value = r0;
+    } else if (index == 1) {
+        value = r1;
+    } else if (r0 > r1) {
+        value = ((8 - index) * r0 + (index - 1) * r1) / 7;
+    } else if (index < 6) {
+        value = ((6 - index) * r0 + (index - 1) * r1) / 5;
+    } else {
+        value = index == 6 ? 0 : 255;
+    }
+    float v = value / 255.f;
+    return glm::vec4(v, v, v, 1.f);
+}
+
+__host__ __device__ inline unsigned int readBits(const unsigned char* block, int& pos, int count) {
+    unsigned int value = 0;
+    for (int i = 0; i < count; i++, pos++) {
+        value |= ((block[pos >> 3] >> (pos & 7)) & 1) << i;
+    }
+    return value;
+}
+
+/**
+ * Decodes texel (x, y) of a BC7 block. Only mode 6 (what encodeBC7Block
+ * writes) is supported, other modes decode to magenta.
+ */
+__host__ __device__ inline glm::vec4 decodeBC7Texel(const unsigned char* block, int x, int y) {
+    if ((block[0] & 0x7F) != 0x40) {
+        return glm::vec4(1.f, 0.f, 1.f, 1.f);
+    }
+    int pos = 7;
+    int e[2][4];
+    for (int c = 0; c < 4; c++) {
+        e[0][c] = readBits(block, pos, 7);
+        e[1][c] = readBits(block, pos, 7);
+    }
+    int p0 = readBits(block, pos, 1);
+    int p1 = readBits(block, pos, 1);
+
+    // the anchor (texel 0) index is stored with its implicit high bit dropped
+    int texel = y * 4 + x;
+    pos += texel == 0 ? 0 : 4 * texel - 1;
+    int index = readBits(block, pos, texel == 0 ? 3 : 4);
+
+    const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+    int w = weights[index];
+    glm::vec4 result;
+    for (int c = 0; c < 4; c++) {
+        int a = (e[0][c] << 1) | p0;
+        int b = (e[1][c] << 1) | p1;
+        result[c] = (((64 - w) * a + w * b + 32) >> 6) / 255.f;
+    }
+    return result;
+}
@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "checkpoint.h"
+
+namespace {
+
+struct CheckpointHeader {
+    char magic[8];
+    int32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t traceDepth;
+    int32_t iteration;
+    int32_t viewSamples;
+    int32_t sampleOffset;
+    int32_t sampleShift;
+    int64_t nextJob;
+    int32_t hasAOVs;
+    float phi;
+    float theta;
+    float zoom;
+    float lookAt[3];
+    uint64_t payloadBytes;
+    uint64_t checksum;  // FNV-1a over the payload, catches truncated or torn files
+};
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// the buffers that follow the header, in file order
+struct Payload {
+    std::vector<std::pair<void*, size_t> > chunks;
+
+    Payload(const Checkpoint& cp) {
+        add(cp.image);
+        if (cp.hasAOVs) {
+            add(cp.aovs.albedo);
+            add(cp.aovs.normal);
+            add(cp.aovs.position);
+            add(cp.aovs.depth);
+            add(cp.aovs.sampleCount);
+            add(cp.aovs.hitCount);
+        }
+    }
+
+    template<typename T>
+    void add(const std::vector<T>& v) {
+        chunks.push_back(std::make_pair((void*)v.data(), v.size() * sizeof(T)));
+    }
+
+    uint64_t bytes() const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            total += chunks[i].second;
+        }
+        return total;
+    }
+};
+
+// payload bytes per pixel, matching Payload's chunks
+uint64_t pixelBytes(const Checkpoint& cp) {
+    uint64_t bytes = sizeof(cp.image[0]);
+    if (cp.hasAOVs) {
+        bytes += sizeof(cp.aovs.albedo[0]) + sizeof(cp.aovs.normal[0]) + sizeof(cp.aovs.position[0]) +
+            sizeof(cp.aovs.depth[0]) + sizeof(cp.aovs.sampleCount[0]) + sizeof(cp.aovs.hitCount[0]);
+    }
+    return bytes;
+}
+
+// -1 if it cannot be told
+long long fileSize(FILE* fp) {
+#ifdef _WIN32
+    struct _stat64 st;
+    return _fstat64(_fileno(fp), &st) == 0 ? st.st_size : -1;
+#else
+    struct stat st;
+    return fstat(fileno(fp), &st) == 0 ? st.st_size : -1;
+#endif
+}
+
+bool replaceFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+}
+
+bool checkpoint::write(const Checkpoint& cp, const std::string& path) {
+    Payload payload(cp);
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.width = cp.width;
+    header.height = cp.height;
+    header.traceDepth = cp.traceDepth;
+    header.iteration = cp.iteration;
+    header.viewSamples = cp.viewSamples;
+    header.sampleOffset = cp.sampleOffset;
+    header.sampleShift = cp.cursor.sampleShift;
+    header.nextJob = cp.cursor.nextJob;
+    header.hasAOVs = cp.hasAOVs;
+    header.phi = cp.phi;
+    header.theta = cp.theta;
+    header.zoom = cp.zoom;
+    memcpy(header.lookAt, &cp.lookAt[0], sizeof(header.lookAt));
+    header.payloadBytes = payload.bytes();
+    header.checksum = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < payload.chunks.size(); i++) {
+        header.checksum = fnv1a(header.checksum, payload.chunks[i].first, payload.chunks[i].second);
+    }
+
+    std::string tmpPath = path + ".tmp";
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (fp == NULL) {
+        printf("Could not write checkpoint %s\n", tmpPath.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (size_t i = 0; ok && i < payload.chunks.size(); i++) {
+        ok = fwrite(payload.chunks[i].first, 1, payload.chunks[i].second, fp) == payload.chunks[i].second;
+    }
+    // make sure the data is on disk before the rename makes it the checkpoint
+    ok = ok && fflush(fp) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(fp)) == 0;
+#else
+    ok = ok && fsync(fileno(fp)) == 0;
+#endif
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || !replaceFile(tmpPath, path)) {
+        printf("Could not write checkpoint %s\n", path.c_str());
+        remove(tmpPath.c_str());
+        return false;
+    }
+    printf("Checkpoint %s at %d iterations\n", path.c_str(), cp.iteration);
+    return true;
+}
+
+bool checkpoint::read(Checkpoint& cp, const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        printf("Could not open checkpoint %s\n", path.c_str());
+        return false;
+    }
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        printf("%s is not a checkpoint\n", path.c_str());
+        fclose(fp);
+        return false;
+    }
+    if (header.version != CHECKPOINT_VERSION) {
+        printf("Checkpoint %s is version %d, expected %d\n", path.c_str(), header.version, CHECKPOINT_VERSION);
+        fclose(fp);
+        return false;
+    }
+
+    // the sizes in the header are checked against each other and the file
+    // before anything is allocated from them
+    cp.hasAOVs = header.hasAOVs != 0;
+    const uint64_t perPixel = pixelBytes(cp);
+    const long long size = fileSize(fp);
+    if (header.width <= 0 || header.height <= 0 ||
+            (uint64_t)header.width * header.height > header.payloadBytes / perPixel ||
+            (uint64_t)header.width * header.height * perPixel != header.payloadBytes ||
+            size < (long long)sizeof(header) || header.payloadBytes > (uint64_t)(size - sizeof(header))) {
+        printf("Checkpoint %s is truncated or corrupt\n", path.c_str());
+        fclose(fp);
+        return false;
+    }
+
+    const size_t pixelcount = (size_t)header.width * header.height;
+    cp.width = header.width;
+    cp.height = header.height;
+    cp.traceDepth = header.traceDepth;
+    cp.iteration = header.iteration;
+    cp.viewSamples = header.viewSamples;
+    cp.sampleOffset = header.sampleOffset;
+    cp.cursor.sampleShift = header.sampleShift;
+    cp.cursor.nextJob = header.nextJob;
+    cp.phi = header.phi;
+    cp.theta = header.theta;
+    cp.zoom = header.zoom;
+    cp.lookAt = glm::vec3(header.lookAt[0], header.lookAt[1], header.lookAt[2]);
+    cp.image.resize(pixelcount);
+    if (cp.hasAOVs) {
+        cp.aovs.albedo.resize(pixelcount);
+        cp.aovs.normal.resize(pixelcount);
+        cp.aovs.position.resize(pixelcount);
+        cp.aovs.depth.resize(pixelcount);
+        cp.aovs.sampleCount.resize(pixelcount);
+        cp.aovs.hitCount.resize(pixelcount);
+    }
+
+    Payload payload(cp);
+    bool ok = payload.bytes() == header.payloadBytes;
+    uint64_t checksum = 0xCBF29CE484222325ull;
+    for (size_t i = 0; ok && i < payload.chunks.size(); i++) {
+        ok = fread(payload.chunks[i].first, 1, payload.chunks[i].second, fp) == payload.chunks[i].second;
+        checksum = fnv1a(checksum, payload.chunks[i].first, payload.chunks[i].second);
+    }
+    fclose(fp);
+    if (!ok || checksum != header.checksum) {
+        printf("Checkpoint %s is truncated or corrupt\n", path.c_str());
+        return false;
+    }
+    return true;
+}
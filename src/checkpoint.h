@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "pathtrace.h"
+
+#define CHECKPOINT_MAGIC     "CISCKPT"
+#define CHECKPOINT_VERSION   6
+#define CHECKPOINT_EXTENSION ".ckpt"
+
+// Everything needed to continue a render where it stopped. The samplers are
+// seeded from (sample, pixel, bounce, dimension) and the sample index follows
+// the iteration, so the iteration count and --sample-offset are the whole
+// sampler state (resume refuses a different offset); together with the raw float sums the
+// resumed render is bit-identical to one that never stopped. Path regeneration
+// is the exception: its paths in flight are lost and its splats are not
+// ordered, so the cursor only makes sure no sample is traced twice. The camera
+// is stored as the orbit parameters main.cpp derives it from, not as the
+// derived vectors.
+struct Checkpoint {
+    int width;
+    int height;
+    int traceDepth;
+    int iteration;
+    int viewSamples;  // of `iteration`, the ones traced since the camera last moved
+    int sampleOffset;  // index of the first sample
+    SampleCursor cursor;
+
+    float phi;
+    float theta;
+    float zoom;
+    glm::vec3 lookAt;
+
+    std::vector<glm::vec3> image;
+    bool hasAOVs;
+    AOVBuffers aovs;
+};
+
+namespace checkpoint {
+    // writes to <path>.tmp and renames over <path>, an interrupted write never
+    // replaces the previous checkpoint
+    bool write(const Checkpoint& cp, const std::string& path);
+    bool read(Checkpoint& cp, const std::string& path);
+}
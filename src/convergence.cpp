@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "convergence.h"
+#include "checkpoint.h"
+
+void convergence::resolve(const std::vector<glm::vec3>& sums, const std::vector<int>* sampleCount, int iteration,
+        std::vector<glm::vec3>& image) {
+    image.resize(sums.size());
+    for (size_t i = 0; i < sums.size(); i++) {
+        int n = sampleCount != NULL ? (*sampleCount)[i] : iteration;
+        image[i] = sums[i] / (float)std::max(n, 1);
+    }
+}
+
+convergence::Error convergence::measure(const std::vector<glm::vec3>& image, const std::vector<glm::vec3>& reference) {
+    // double sums, a 4k frame has ~25M terms
+    double se = 0.0;
+    double relSe = 0.0;
+    for (size_t i = 0; i < image.size(); i++) {
+        for (int c = 0; c < 3; c++) {
+            double r = reference[i][c];
+            double d = (double)image[i][c] - r;
+            se += d * d;
+            relSe += d * d / (r * r + 0.01);
+        }
+    }
+    double n = std::max((double)image.size() * 3.0, 1.0);
+    Error e = { std::sqrt(se / n), relSe / n };
+    return e;
+}
+
+bool convergence::parseTimes(const char* list, std::vector<double>& seconds) {
+    seconds.clear();
+    const char* p = list;
+    while (*p != '\0') {
+        char* end;
+        double s = strtod(p, &end);
+        if (end == p || s <= 0.0 || (*end != ',' && *end != '\0')) {
+            printf("Bad checkpoint time list %s\n", list);
+            return false;
+        }
+        seconds.push_back(s);
+        p = *end == ',' ? end + 1 : end;
+    }
+    std::sort(seconds.begin(), seconds.end());
+    return !seconds.empty();
+}
+
+convergence::Benchmark::Benchmark() : next(0), csv(NULL) {
+}
+
+convergence::Benchmark::~Benchmark() {
+    if (csv != NULL) {
+        fclose(csv);
+    }
+}
+
+bool convergence::Benchmark::init(const std::string& scene, const std::string& referencePath,
+        const std::string& csvPath, const std::vector<double>& seconds, int width, int height) {
+    Checkpoint ref;
+    if (!checkpoint::read(ref, referencePath)) {
+        return false;
+    }
+    if (ref.width != width || ref.height != height) {
+        printf("Reference %s is %dx%d, the render is %dx%d\n", referencePath.c_str(),
+            ref.width, ref.height, width, height);
+        return false;
+    }
+    resolve(ref.image, ref.hasAOVs ? &ref.aovs.sampleCount : NULL, ref.iteration, reference);
+
+    csv = fopen(csvPath.c_str(), "w");
+    if (csv == NULL) {
+        printf("Could not write %s\n", csvPath.c_str());
+        return false;
+    }
+    fprintf(csv, "scene,target_s,render_s,iteration,rmse,relmse,efficiency\n");
+    fflush(csv);
+
+    this->scene = scene;
+    this->seconds = seconds;
+    next = 0;
+    printf("Convergence benchmark against %s (%d samples), logging to %s\n",
+        referencePath.c_str(), ref.iteration, csvPath.c_str());
+    return true;
+}
+
+bool convergence::Benchmark::due(double renderSeconds) const {
+    return next < seconds.size() && renderSeconds >= seconds[next];
+}
+
+void convergence::Benchmark::record(double renderSeconds, int iteration, const std::vector<glm::vec3>& sums,
+        const std::vector<int>* sampleCount) {
+    std::vector<glm::vec3> image;
+    resolve(sums, sampleCount, iteration, image);
+    Error e = measure(image, reference);
+    double efficiency = e.relMSE > 0.0 ? 1.0 / (e.relMSE * renderSeconds) : 0.0;
+    // slow iterations can skip several checkpoints, they all get this measurement
+    while (due(renderSeconds)) {
+        fprintf(csv, "%s,%g,%.4f,%d,%.6g,%.6g,%.6g\n", scene.c_str(), seconds[next], renderSeconds,
+            iteration, e.rmse, e.relMSE, efficiency);
+        printf("Convergence at %gs: %d iterations, RMSE %.4g, relMSE %.4g\n", seconds[next], iteration,
+            e.rmse, e.relMSE);
+        next++;
+    }
+    fflush(csv);
+}
+
+bool convergence::Benchmark::finished() const {
+    return next >= seconds.size();
+}
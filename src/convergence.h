@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// Time-to-error benchmark: the render is compared against a high sample
+// count reference at fixed render times, giving one CSV row per checkpoint
+//   scene,target_s,render_s,iteration,rmse,relmse,efficiency
+// Samples per second alone hides variance changes from better sampling; the
+// efficiency column, 1 / (relMSE * seconds), is the number to compare.
+//
+// References are checkpoint files (see checkpoint.h) of the same scene, e.g.
+// from a long run with --iterations N --checkpoint-every N. A benchmark run
+// ignores the scene's iteration count and exits after the last checkpoint.
+namespace convergence {
+    struct Error {
+        double rmse;
+        double relMSE;  // mean of (x - ref)^2 / (ref^2 + 0.01) over pixels and channels
+    };
+
+    // per-pixel means of accumulated sums; sampleCount is NULL when every
+    // pixel has `iteration` samples
+    void resolve(const std::vector<glm::vec3>& sums, const std::vector<int>* sampleCount, int iteration,
+        std::vector<glm::vec3>& image);
+
+    Error measure(const std::vector<glm::vec3>& image, const std::vector<glm::vec3>& reference);
+
+    // comma separated seconds, e.g. "1,2,5,10"; sorted on return
+    bool parseTimes(const char* list, std::vector<double>& seconds);
+
+    class Benchmark {
+    public:
+        Benchmark();
+        ~Benchmark();
+
+        // loads the reference, which must match the render resolution, and starts the CSV
+        bool init(const std::string& scene, const std::string& referencePath, const std::string& csvPath,
+            const std::vector<double>& seconds, int width, int height);
+
+        // true once renderSeconds reaches the next checkpoint
+        bool due(double renderSeconds) const;
+        // measures the accumulated frame and logs a row for every checkpoint it passed
+        void record(double renderSeconds, int iteration, const std::vector<glm::vec3>& sums,
+            const std::vector<int>* sampleCount);
+        bool finished() const;
+
+    private:
+        std::string scene;
+        std::vector<glm::vec3> reference;
+        std::vector<double> seconds;
+        size_t next;
+        FILE* csv;
+    };
+}
@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "denoise.h"
+#include "parallel.h"
+
+#define ALBEDO_EPSILON 1e-3f
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// one contiguous float array per channel, so the filter's inner loops run over
+// plain floats and the compiler can vectorize them
+struct Planes {
+    std::vector<float> c[3];
+
+    void resize(size_t n) {
+        for (int k = 0; k < 3; k++) {
+            c[k].resize(n);
+        }
+    }
+
+    void load(const glm::vec3* src, size_t n) {
+        resize(n);
+        for (size_t i = 0; i < n; i++) {
+            c[0][i] = src[i].x;
+            c[1][i] = src[i].y;
+            c[2][i] = src[i].z;
+        }
+    }
+};
+
+// exp(x) for x <= 0, within 0.1% relative, which is plenty for filter weights.
+// Unlike expf it is inlined and branch free, so the tap loop below vectorizes.
+inline float expNegative(float x) {
+    x *= 1.44269504f;  // to base 2
+    x = x > -126.f ? x : -126.f;
+    int i = (int)x;  // truncates towards zero, 2^x = 2^(i - 1) * 2^g with g in (0, 1]
+    float g = x - (float)i + 1.f;
+    float p = 1.f + g * (0.69583356f + g * (0.22606716f + g * 0.07944023f));
+    int bits = (i + 126) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+struct LevelParams {
+    int step;
+    float invColorPhi;
+    float invNormalPhi;
+    float invPositionPhi;
+};
+
+// adds one kernel tap to the running sums of a row. Every pointer is already
+// offset so index x reads pixel x of the row (c, n, p, s) or its tap (q*).
+// Function parameters so __restrict is honoured and the loop vectorizes.
+void accumulateTap(int xs, int xe, float h, const LevelParams& lp,
+        const float* __restrict cR, const float* __restrict cG, const float* __restrict cB,
+        const float* __restrict nX, const float* __restrict nY, const float* __restrict nZ,
+        const float* __restrict pX, const float* __restrict pY, const float* __restrict pZ,
+        const float* __restrict qR, const float* __restrict qG, const float* __restrict qB,
+        const float* __restrict qnX, const float* __restrict qnY, const float* __restrict qnZ,
+        const float* __restrict qpX, const float* __restrict qpY, const float* __restrict qpZ,
+        float* __restrict sR, float* __restrict sG, float* __restrict sB, float* __restrict sW) {
+    const float invColor = lp.invColorPhi;
+    const float invNormal = lp.invNormalPhi;
+    const float invPosition = lp.invPositionPhi;
+    for (int x = xs; x < xe; x++) {
+        float dr = cR[x] - qR[x], dg = cG[x] - qG[x], db = cB[x] - qB[x];
+        float dnx = nX[x] - qnX[x], dny = nY[x] - qnY[x], dnz = nZ[x] - qnZ[x];
+        float dpx = pX[x] - qpX[x], dpy = pY[x] - qpY[x], dpz = pZ[x] - qpZ[x];
+        float e = (dr * dr + dg * dg + db * db) * invColor
+            + (dnx * dnx + dny * dny + dnz * dnz) * invNormal
+            + (dpx * dpx + dpy * dpy + dpz * dpz) * invPosition;
+        float w = h * expNegative(-e);
+        sR[x] += w * qR[x];
+        sG[x] += w * qG[x];
+        sB[x] += w * qB[x];
+        sW[x] += w;
+    }
+}
+
+// one a-trous level over rows [y0, y1). Taps falling outside the image are
+// dropped and the remaining weights renormalized.
+void filterRows(const Planes& in, Planes& out, const Planes& nor, const Planes& pos,
+        int width, int height, const LevelParams& lp, int y0, int y1) {
+    std::vector<float> sumR(width), sumG(width), sumB(width), sumW(width);
+
+    for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * width;
+        std::fill(sumR.begin(), sumR.end(), 0.f);
+        std::fill(sumG.begin(), sumG.end(), 0.f);
+        std::fill(sumB.begin(), sumB.end(), 0.f);
+        std::fill(sumW.begin(), sumW.end(), 0.f);
+
+        for (int ky = -2; ky <= 2; ky++) {
+            int yy = y + ky * lp.step;
+            if (yy < 0 || yy >= height) {
+                continue;
+            }
+            for (int kx = -2; kx <= 2; kx++) {
+                int ox = kx * lp.step;
+                int xs = std::max(0, -ox);
+                int xe = std::min(width, width - ox);
+                if (xs >= xe) {
+                    continue;
+                }
+                size_t tap = (size_t)yy * width;
+                accumulateTap(xs, xe, kernel[ky + 2] * kernel[kx + 2], lp,
+                    &in.c[0][row], &in.c[1][row], &in.c[2][row],
+                    &nor.c[0][row], &nor.c[1][row], &nor.c[2][row],
+                    &pos.c[0][row], &pos.c[1][row], &pos.c[2][row],
+                    &in.c[0][tap] + ox, &in.c[1][tap] + ox, &in.c[2][tap] + ox,
+                    &nor.c[0][tap] + ox, &nor.c[1][tap] + ox, &nor.c[2][tap] + ox,
+                    &pos.c[0][tap] + ox, &pos.c[1][tap] + ox, &pos.c[2][tap] + ox,
+                    sumR.data(), sumG.data(), sumB.data(), sumW.data());
+            }
+        }
+
+        // the centre tap always contributes, so sumW > 0
+        for (int x = 0; x < width; x++) {
+            float inv = 1.f / sumW[x];
+            out.c[0][row + x] = sumR[x] * inv;
+            out.c[1][row + x] = sumG[x] * inv;
+            out.c[2][row + x] = sumB[x] * inv;
+        }
+    }
+}
+
+}
+
+void denoiseATrous(const DenoiseSettings& settings, int width, int height,
+        const glm::vec3* color, const glm::vec3* albedo, const glm::vec3* normal, const glm::vec3* position,
+        glm::vec3* out, DenoiseTimings* timings) {
+    Clock::time_point start = Clock::now();
+    size_t pixelcount = (size_t)width * height;
+    int threads = resolveThreadCount(settings.threads);
+
+    Planes current, next, nor, pos, alb;
+    current.load(color, pixelcount);
+    nor.load(normal, pixelcount);
+    pos.load(position, pixelcount);
+    next.resize(pixelcount);
+    if (settings.demodulateAlbedo) {
+        // filter irradiance, pixels without albedo (misses, black surfaces) pass through as is
+        alb.load(albedo, pixelcount);
+        for (int k = 0; k < 3; k++) {
+            float* __restrict c = current.c[k].data();
+            const float* __restrict a = alb.c[k].data();
+            for (size_t i = 0; i < pixelcount; i++) {
+                c[i] = a[i] > ALBEDO_EPSILON ? c[i] / a[i] : c[i];
+            }
+        }
+    }
+    if (timings) {
+        timings->setupMs = msSince(start);
+        timings->levelMs.clear();
+    }
+
+    for (int level = 0; level < settings.levels; level++) {
+        Clock::time_point levelStart = Clock::now();
+        LevelParams lp;
+        lp.step = 1 << level;
+        lp.invColorPhi = 1.f / (settings.colorPhi * std::pow(2.f, (float)-level));
+        lp.invNormalPhi = 1.f / (settings.normalPhi * lp.step * lp.step);
+        lp.invPositionPhi = 1.f / settings.positionPhi;
+
+        parallelRows(height, threads, [&](int y0, int y1) {
+            filterRows(current, next, nor, pos, width, height, lp, y0, y1);
+        });
+        std::swap(current, next);
+        if (timings) {
+            timings->levelMs.push_back(msSince(levelStart));
+        }
+    }
+
+    for (size_t i = 0; i < pixelcount; i++) {
+        glm::vec3 c(current.c[0][i], current.c[1][i], current.c[2][i]);
+        if (settings.demodulateAlbedo) {
+            glm::vec3 a = albedo[i];
+            c.x = a.x > ALBEDO_EPSILON ? c.x * a.x : c.x;
+            c.y = a.y > ALBEDO_EPSILON ? c.y * a.y : c.y;
+            c.z = a.z > ALBEDO_EPSILON ? c.z * a.z : c.z;
+        }
+        out[i] = c;
+    }
+    if (timings) {
+        timings->totalMs = msSince(start);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each level
+// applies the 5x5 B3-spline kernel with its taps spread 2^level pixels apart,
+// weighted by how much colour, normal and position differ from the centre.
+// The colour weight tightens by half every level. Lighting is filtered with
+// the albedo divided out, so texture detail is not blurred.
+struct DenoiseSettings {
+    int levels = 5;
+    float colorPhi = 0.45f;
+    float normalPhi = 0.35f;
+    float positionPhi = 0.35f;
+    bool demodulateAlbedo = true;
+    int threads = 0;  // 0 uses every hardware thread
+};
+
+struct DenoiseTimings {
+    double setupMs;
+    std::vector<double> levelMs;
+    double totalMs;
+};
+
+// all buffers are width * height, already divided by the sample count
+void denoiseATrous(const DenoiseSettings& settings, int width, int height,
+    const glm::vec3* color, const glm::vec3* albedo, const glm::vec3* normal, const glm::vec3* position,
+    glm::vec3* out, DenoiseTimings* timings = NULL);
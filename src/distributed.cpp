@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "distributed.h"
+#include "net.h"
+
+using net::Socket;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds() {
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+// the buffers after a RESULT line, sized for width x height
+std::vector<std::pair<char*, size_t> > payloadChunks(Checkpoint& cp) {
+    std::vector<std::pair<char*, size_t> > chunks;
+    chunks.push_back(std::make_pair((char*)cp.image.data(), cp.image.size() * sizeof(glm::vec3)));
+    if (cp.hasAOVs) {
+        chunks.push_back(std::make_pair((char*)cp.aovs.albedo.data(), cp.aovs.albedo.size() * sizeof(glm::vec3)));
+        chunks.push_back(std::make_pair((char*)cp.aovs.normal.data(), cp.aovs.normal.size() * sizeof(glm::vec3)));
+        chunks.push_back(std::make_pair((char*)cp.aovs.position.data(), cp.aovs.position.size() * sizeof(glm::vec3)));
+        chunks.push_back(std::make_pair((char*)cp.aovs.depth.data(), cp.aovs.depth.size() * sizeof(float)));
+        chunks.push_back(std::make_pair((char*)cp.aovs.sampleCount.data(), cp.aovs.sampleCount.size() * sizeof(int)));
+        chunks.push_back(std::make_pair((char*)cp.aovs.hitCount.data(), cp.aovs.hitCount.size() * sizeof(int)));
+    }
+    return chunks;
+}
+
+size_t payloadBytes(const std::vector<std::pair<char*, size_t> >& chunks) {
+    size_t total = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        total += chunks[i].second;
+    }
+    return total;
+}
+
+void resizeFor(Checkpoint& cp, int width, int height) {
+    const size_t n = (size_t)width * height;
+    cp.width = width;
+    cp.height = height;
+    cp.image.resize(n);
+    if (cp.hasAOVs) {
+        cp.aovs.albedo.resize(n);
+        cp.aovs.normal.resize(n);
+        cp.aovs.position.resize(n);
+        cp.aovs.depth.resize(n);
+        cp.aovs.sampleCount.resize(n);
+        cp.aovs.hitCount.resize(n);
+    }
+}
+
+#ifdef _WIN32
+typedef intptr_t Process;  // the process handle _spawnvp returns
+#else
+typedef pid_t Process;
+#endif
+
+bool spawn(const std::vector<std::string>& args, Process& process) {
+    std::vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back((char*)args[i].c_str());
+    }
+    argv.push_back(NULL);
+#ifdef _WIN32
+    process = _spawnvp(_P_NOWAIT, argv[0], argv.data());
+    return process != -1;
+#else
+    fflush(stdout);  // or the child gets a copy of what is still buffered
+    process = fork();
+    if (process == 0) {
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+    return process > 0;
+#endif
+}
+
+// forgets the local workers that have exited, true once none is left
+bool allExited(std::vector<Process>& processes) {
+    for (size_t i = 0; i < processes.size(); i++) {
+#ifdef _WIN32
+        if (WaitForSingleObject((HANDLE)processes[i], 0) != WAIT_TIMEOUT) {
+            CloseHandle((HANDLE)processes[i]);
+            processes.erase(processes.begin() + i--);
+        }
+#else
+        if (waitpid(processes[i], NULL, WNOHANG) != 0) {
+            processes.erase(processes.begin() + i--);
+        }
+#endif
+    }
+    return processes.empty();
+}
+
+// Workers exit on DONE or once the coordinator's socket closes, a hung one
+// is terminated after a few seconds
+void reap(std::vector<Process>& processes) {
+    const double deadline = seconds() + 5.0;
+    for (size_t i = 0; i < processes.size(); i++) {
+#ifdef _WIN32
+        const HANDLE handle = (HANDLE)processes[i];
+        const double left = std::max(deadline - seconds(), 0.0);
+        if (WaitForSingleObject(handle, (DWORD)(left * 1000.0)) == WAIT_TIMEOUT) {
+            TerminateProcess(handle, 1);
+            WaitForSingleObject(handle, INFINITE);
+        }
+        CloseHandle(handle);
+#else
+        while (waitpid(processes[i], NULL, WNOHANG) == 0) {
+            if (seconds() > deadline) {
+                kill(processes[i], SIGTERM);
+                waitpid(processes[i], NULL, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+#endif
+    }
+    processes.clear();
+}
+
+struct Client {
+    Socket socket;
+    int piece;  // -1 when idle
+    double lastHeard;
+    bool readable;  // in this round of waitReadable
+};
+
+}
+
+bool distributed::merge(Checkpoint& total, const Checkpoint& piece) {
+    if (total.iteration == 0) {
+        total.width = piece.width;
+        total.height = piece.height;
+        total.iteration = piece.iteration;
+        total.image = piece.image;
+        total.hasAOVs = piece.hasAOVs;
+        total.aovs = piece.aovs;
+        return true;
+    }
+    if (piece.width != total.width || piece.height != total.height) {
+        return false;
+    }
+    for (size_t i = 0; i < total.image.size(); i++) {
+        total.image[i] += piece.image[i];
+    }
+    // without AOVs every pixel has `iteration` samples, so the counts are only dropped
+    if (total.hasAOVs && piece.hasAOVs) {
+        for (size_t i = 0; i < total.image.size(); i++) {
+            total.aovs.albedo[i] += piece.aovs.albedo[i];
+            total.aovs.normal[i] += piece.aovs.normal[i];
+            total.aovs.position[i] += piece.aovs.position[i];
+            total.aovs.depth[i] += piece.aovs.depth[i];
+            total.aovs.sampleCount[i] += piece.aovs.sampleCount[i];
+            total.aovs.hitCount[i] += piece.aovs.hitCount[i];
+        }
+    }
+    else {
+        total.hasAOVs = false;
+        total.aovs = AOVBuffers();
+    }
+    total.iteration += piece.iteration;
+    return true;
+}
+
+bool distributed::runCoordinator(const CoordinatorOptions& options, int width, int height, Checkpoint& result) {
+    if (options.samples <= 0) {
+        printf("Nothing to render\n");
+        return false;
+    }
+    net::start();
+
+    // equal sample ranges, the remainder spread over them
+    const int numPieces = std::max(std::min(options.pieces, options.samples), 1);
+    std::vector<Piece> pieces(numPieces);
+    for (int i = 0; i < numPieces; i++) {
+        const int begin = (int)((long long)options.samples * i / numPieces);
+        const int end = (int)((long long)options.samples * (i + 1) / numPieces);
+        Piece p = { i, options.sampleStart + begin, end - begin };
+        pieces[i] = p;
+    }
+    std::deque<int> queue;
+    for (int i = 0; i < numPieces; i++) {
+        queue.push_back(i);
+    }
+    std::vector<int> failures(numPieces, 0);
+    int remaining = numPieces;
+
+    Socket listener = net::listenOn(options.port, false);
+    if (listener == net::invalidSocket) {
+        printf("Could not listen on port %d\n", options.port);
+        return false;
+    }
+    printf("Coordinating %d samples in %d pieces on port %d\n", options.samples, numPieces, options.port);
+
+    std::vector<Process> processes;
+    for (size_t i = 0; i < options.localWorkers.size(); i++) {
+        std::vector<std::string> args = options.localWorkers[i];
+        std::ostringstream address;
+        address << "127.0.0.1:" << options.port;
+        args.push_back(address.str());
+        Process process;
+        if (spawn(args, process)) {
+            processes.push_back(process);
+        }
+        else {
+            printf("Could not start local worker %d\n", (int)i);
+        }
+    }
+
+    result.iteration = 0;
+    std::vector<Client> clients;
+    bool failed = false;
+    // closes the connection, its piece goes back into the queue
+    auto drop = [&](size_t c, const char* reason) {
+        const int piece = clients[c].piece;
+        net::closeSocket(clients[c].socket);
+        clients.erase(clients.begin() + c);
+        if (piece < 0) {
+            return;
+        }
+        printf("Worker lost (%s), piece %d queued again\n", reason, piece);
+        if (++failures[piece] >= DISTRIBUTED_MAX_ATTEMPTS) {
+            printf("Piece %d failed %d times, giving up\n", piece, failures[piece]);
+            failed = true;
+        }
+        queue.push_front(piece);
+    };
+
+    while (remaining > 0 && !failed) {
+        for (size_t c = 0; c < clients.size() && !queue.empty(); c++) {
+            if (clients[c].piece >= 0) {
+                continue;
+            }
+            const Piece& p = pieces[queue.front()];
+            std::ostringstream line;
+            line << "RENDER " << p.id << " " << p.sampleStart << " " << p.sampleCount;
+            if (net::sendLine(clients[c].socket, line.str())) {
+                clients[c].piece = p.id;
+                clients[c].lastHeard = seconds();
+                queue.pop_front();
+            }
+            else {
+                drop(c--, "send failed");
+            }
+        }
+
+        // the listener first, then one entry per client
+        std::vector<Socket> sockets(1, listener);
+        for (size_t c = 0; c < clients.size(); c++) {
+            sockets.push_back(clients[c].socket);
+        }
+        std::vector<bool> ready;
+        if (!net::waitReadable(sockets, 1000, ready)) {
+            printf("select failed\n");
+            failed = true;
+            break;
+        }
+        // dropping clients below shifts the indices, the readable ones are marked first
+        for (size_t c = 0; c < clients.size(); c++) {
+            clients[c].readable = ready[c + 1];
+        }
+
+        if (ready[0]) {
+            Socket s = net::acceptFrom(listener);
+            if (s != net::invalidSocket) {
+                net::setReceiveTimeout(s, options.timeoutSeconds);
+                Client client = { s, -1, seconds(), false };
+                clients.push_back(client);
+            }
+        }
+
+        for (size_t c = 0; c < clients.size(); c++) {
+            if (!clients[c].readable) {
+                continue;
+            }
+            std::string line;
+            if (!net::recvLine(clients[c].socket, line)) {
+                drop(c--, "disconnected");
+                continue;
+            }
+            clients[c].lastHeard = seconds();
+            std::istringstream in(line);
+            std::string message;
+            in >> message;
+            if (message == "HELLO" || message == "HEARTBEAT") {
+                continue;
+            }
+            int piece = -1, w = 0, h = 0, samples = 0, hasAOVs = 0;
+            unsigned long long bytes = 0;
+            in >> piece >> w >> h >> samples >> hasAOVs >> bytes;
+            if (message != "RESULT" || in.fail() || piece != clients[c].piece || w != width || h != height) {
+                printf("Unexpected message from worker: %s\n", line.c_str());
+                drop(c--, "protocol error");
+                continue;
+            }
+            // a short piece would leave a hole in the sample range, render it again
+            if (samples != pieces[piece].sampleCount) {
+                printf("Piece %d came back with %d of %d samples\n", piece, samples, pieces[piece].sampleCount);
+                drop(c--, "incomplete result");
+                continue;
+            }
+            Checkpoint partial;
+            partial.hasAOVs = hasAOVs != 0;
+            resizeFor(partial, w, h);
+            partial.iteration = samples;
+            std::vector<std::pair<char*, size_t> > chunks = payloadChunks(partial);
+            bool ok = bytes == payloadBytes(chunks);
+            for (size_t k = 0; k < chunks.size() && ok; k++) {
+                ok = net::recvAll(clients[c].socket, chunks[k].first, chunks[k].second);
+            }
+            if (!ok || !distributed::merge(result, partial)) {
+                drop(c--, "bad result");
+                continue;
+            }
+            clients[c].piece = -1;
+            remaining--;
+            printf("Piece %d done, %d of %d samples\n", piece, result.iteration, options.samples);
+        }
+
+        const double now = seconds();
+        for (size_t c = 0; c < clients.size(); c++) {
+            if (clients[c].piece >= 0 && now - clients[c].lastHeard > options.timeoutSeconds) {
+                drop(c--, "no heartbeat");
+            }
+        }
+        // remote workers may still connect when none were started here
+        if (!options.localWorkers.empty() && clients.empty() && allExited(processes)) {
+            printf("All local workers have exited\n");
+            failed = true;
+        }
+    }
+
+    for (size_t c = 0; c < clients.size(); c++) {
+        net::sendLine(clients[c].socket, "DONE");
+        net::closeSocket(clients[c].socket);
+    }
+    net::closeSocket(listener);
+    reap(processes);
+    return !failed;
+}
+
+bool distributed::runWorker(const std::string& address, const RenderFunction& render) {
+    net::start();
+    Socket s = net::connectTo(address, DISTRIBUTED_DEFAULT_PORT);
+    if (s == net::invalidSocket) {
+        printf("Could not connect to %s\n", address.c_str());
+        return false;
+    }
+    net::setNoDelay(s);
+    if (!net::sendLine(s, "HELLO")) {
+        net::closeSocket(s);
+        return false;
+    }
+
+    bool ok = true;
+    std::string line;
+    while (ok && net::recvLine(s, line)) {
+        std::istringstream in(line);
+        std::string message;
+        in >> message;
+        if (message == "DONE") {
+            break;
+        }
+        Piece piece;
+        in >> piece.id >> piece.sampleStart >> piece.sampleCount;
+        if (message != "RENDER" || in.fail()) {
+            printf("Unexpected message from coordinator: %s\n", line.c_str());
+            ok = false;
+            break;
+        }
+        printf("Rendering piece %d, samples %d to %d\n", piece.id, piece.sampleStart,
+            piece.sampleStart + piece.sampleCount - 1);
+
+        double lastBeat = seconds();
+        auto heartbeat = [&](int done) {
+            if (seconds() - lastBeat >= DISTRIBUTED_HEARTBEAT_SECONDS) {
+                std::ostringstream beat;
+                beat << "HEARTBEAT " << piece.id << " " << done;
+                net::sendLine(s, beat.str());
+                lastBeat = seconds();
+            }
+        };
+        Checkpoint partial;
+        if (!render(piece, partial, heartbeat)) {
+            printf("Piece %d failed\n", piece.id);
+            ok = false;
+            break;
+        }
+        std::vector<std::pair<char*, size_t> > chunks = payloadChunks(partial);
+        std::ostringstream result;
+        result << "RESULT " << piece.id << " " << partial.width << " " << partial.height << " "
+            << partial.iteration << " " << (partial.hasAOVs ? 1 : 0) << " " << payloadBytes(chunks);
+        ok = net::sendLine(s, result.str());
+        for (size_t k = 0; k < chunks.size() && ok; k++) {
+            ok = net::sendAll(s, chunks[k].first, chunks[k].second);
+        }
+    }
+    net::closeSocket(s);
+    return ok;
+}
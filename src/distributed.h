@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include "checkpoint.h"
+
+#define DISTRIBUTED_DEFAULT_PORT      7565
+#define DISTRIBUTED_HEARTBEAT_SECONDS 1
+#define DISTRIBUTED_TIMEOUT_SECONDS   30  // a busy worker silent for this long has failed
+#define DISTRIBUTED_MAX_ATTEMPTS      3   // per piece, the job fails after that
+
+// Multi-process rendering of one frame. The coordinator splits the frame's
+// sample range into pieces and hands them out over TCP to worker processes,
+// which render the whole image for their samples (see pathtraceSetSampleOffset)
+// and send back the raw sums. Sums and per-pixel sample counts of disjoint
+// sample ranges add up to the render of the whole range.
+//
+// One text line per message, a result line is followed by its payload:
+//   worker -> coordinator   HELLO
+//   coordinator -> worker   RENDER <piece> <first sample> <samples>   or   DONE
+//   worker -> coordinator   HEARTBEAT <piece> <samples done>
+//   worker -> coordinator   RESULT <piece> <width> <height> <samples> <has AOVs> <payload bytes>
+// The payload is the image sums, then the AOV buffers in checkpoint order.
+// A worker that disconnects or stays silent for the timeout while rendering
+// has its piece queued again for the next free worker.
+namespace distributed {
+    struct Piece {
+        int id;
+        int sampleStart;  // sample index of the piece's first iteration
+        int sampleCount;
+    };
+
+    // fills result.image, AOVs and iteration (the sample count); calls
+    // heartbeat(samplesDone) after every pathtrace call
+    typedef std::function<bool(const Piece& piece, Checkpoint& result,
+        const std::function<void(int)>& heartbeat)> RenderFunction;
+
+    struct CoordinatorOptions {
+        int port = DISTRIBUTED_DEFAULT_PORT;
+        int sampleStart = 0;
+        int samples = 0;  // the whole job
+        int pieces = 0;  // sample ranges the job is split into
+        int timeoutSeconds = DISTRIBUTED_TIMEOUT_SECONDS;
+        // command lines of worker processes started on this machine, the
+        // coordinator appends 127.0.0.1:<port>
+        std::vector<std::vector<std::string> > localWorkers;
+    };
+
+    // serves pieces until all are merged into result, whose camera fields are left alone
+    bool runCoordinator(const CoordinatorOptions& options, int width, int height, Checkpoint& result);
+    // renders pieces for the coordinator at host:port until it sends DONE
+    bool runWorker(const std::string& address, const RenderFunction& render);
+
+    // adds a piece's sums, AOVs and samples to total; the first piece initializes it
+    bool merge(Checkpoint& total, const Checkpoint& piece);
+}
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <stb_image_write.h>
+
+#include "exr.h"
+
+#define EXR_PIXEL_HALF  1
+#define EXR_PIXEL_FLOAT 2
+
+// stb_image_write's deflate, only declared inside its implementation section
+STBIWDEF unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+namespace {
+
+// round-to-nearest-even float -> half, overflow goes to inf, NaN stays NaN
+uint16_t floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exponent = (x >> 23) & 0xFF;
+    uint32_t mantissa = x & 0x7FFFFF;
+
+    if (exponent == 0xFF) {
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    }
+    int e = (int)exponent - 127 + 15;
+    if (e >= 31) {
+        return sign | 0x7C00;
+    }
+    if (e <= 0) {
+        // subnormal half (or zero)
+        if (e < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - e;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t)e << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;  // may carry into the exponent, which is still the right answer
+    }
+    return sign | half;
+}
+
+// everything in an EXR file is little-endian
+void putBytes(std::vector<unsigned char>& out, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    out.insert(out.end(), p, p + size);
+}
+
+void putInt(std::vector<unsigned char>& out, int32_t v) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back((v >> (8 * i)) & 0xFF);
+    }
+}
+
+void putUInt64(std::vector<unsigned char>& out, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        out.push_back((v >> (8 * i)) & 0xFF);
+    }
+}
+
+void putFloat(std::vector<unsigned char>& out, float f) {
+    int32_t v;
+    memcpy(&v, &f, 4);
+    putInt(out, v);
+}
+
+void putString(std::vector<unsigned char>& out, const std::string& s) {
+    putBytes(out, s.c_str(), s.size() + 1);
+}
+
+void putAttribute(std::vector<unsigned char>& out, const char* name, const char* type,
+        const std::vector<unsigned char>& value) {
+    putString(out, name);
+    putString(out, type);
+    putInt(out, value.size());
+    putBytes(out, value.data(), value.size());
+}
+
+// ZIP compression: split even/odd bytes, delta-encode, then deflate. Blocks
+// that don't shrink are stored raw, which readers detect from the chunk size.
+void compressZip(const std::vector<unsigned char>& raw, std::vector<unsigned char>& out) {
+    size_t n = raw.size();
+    std::vector<unsigned char> tmp(n);
+    size_t half = (n + 1) / 2;
+    for (size_t i = 0; i < n; i++) {
+        tmp[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+    }
+    for (size_t i = n; i-- > 1;) {  // from the back, n may be 0
+        tmp[i] = (unsigned char)(tmp[i] - tmp[i - 1] + 128);
+    }
+
+    int zipped = 0;
+    unsigned char* z = stbi_zlib_compress(tmp.data(), (int)n, &zipped, 6);
+    if (z != NULL && (size_t)zipped < n) {
+        out.assign(z, z + zipped);
+    } else {
+        out = raw;
+    }
+    free(z);
+}
+
+}
+
+bool exr::write(const std::string& filename, int width, int height,
+        std::vector<Channel> channels, int compression) {
+    if (compression != EXR_NO_COMPRESSION && compression != EXR_ZIP_COMPRESSION) {
+        printf("Unsupported EXR compression %d\n", compression);
+        return false;
+    }
+    // the channel list (and the pixel data) must be in alphabetical order
+    std::sort(channels.begin(), channels.end(),
+        [](const Channel& a, const Channel& b) { return a.name < b.name; });
+
+    std::vector<unsigned char> file;
+    putInt(file, 20000630);  // magic
+    putInt(file, 2);         // version 2, single-part scanline
+
+    std::vector<unsigned char> value;
+    for (size_t c = 0; c < channels.size(); c++) {
+        putString(value, channels[c].name);
+        putInt(value, channels[c].half ? EXR_PIXEL_HALF : EXR_PIXEL_FLOAT);
+        putInt(value, 0);  // pLinear + reserved
+        putInt(value, 1);  // x sampling
+        putInt(value, 1);  // y sampling
+    }
+    value.push_back(0);
+    putAttribute(file, "channels", "chlist", value);
+
+    value.assign(1, (unsigned char)compression);
+    putAttribute(file, "compression", "compression", value);
+
+    value.clear();
+    putInt(value, 0);
+    putInt(value, 0);
+    putInt(value, width - 1);
+    putInt(value, height - 1);
+    putAttribute(file, "dataWindow", "box2i", value);
+    putAttribute(file, "displayWindow", "box2i", value);
+
+    value.assign(1, 0);  // increasing y
+    putAttribute(file, "lineOrder", "lineOrder", value);
+
+    value.clear();
+    putFloat(value, 1.f);
+    putAttribute(file, "pixelAspectRatio", "float", value);
+
+    value.clear();
+    putFloat(value, 0.f);
+    putFloat(value, 0.f);
+    putAttribute(file, "screenWindowCenter", "v2f", value);
+
+    value.clear();
+    putFloat(value, 1.f);
+    putAttribute(file, "screenWindowWidth", "float", value);
+    file.push_back(0);  // end of header
+
+    // offset table, patched once the chunks are written
+    int linesPerBlock = compression == EXR_ZIP_COMPRESSION ? 16 : 1;
+    int blockCount = (height + linesPerBlock - 1) / linesPerBlock;
+    size_t tableStart = file.size();
+    file.resize(file.size() + blockCount * sizeof(uint64_t));
+
+    std::vector<unsigned char> raw;
+    std::vector<unsigned char> packed;
+    for (int block = 0; block < blockCount; block++) {
+        int y0 = block * linesPerBlock;
+        int y1 = std::min(y0 + linesPerBlock, height);
+
+        // each scanline holds every channel's values for that row, channel by channel
+        raw.clear();
+        for (int y = y0; y < y1; y++) {
+            for (size_t c = 0; c < channels.size(); c++) {
+                const Channel& ch = channels[c];
+                const float* row = ch.data + (size_t)y * width * ch.stride;
+                for (int x = 0; x < width; x++) {
+                    float v = row[(size_t)x * ch.stride];
+                    if (ch.half) {
+                        uint16_t h = floatToHalf(v);
+                        raw.push_back(h & 0xFF);
+                        raw.push_back(h >> 8);
+                    } else {
+                        putFloat(raw, v);
+                    }
+                }
+            }
+        }
+
+        if (compression == EXR_ZIP_COMPRESSION) {
+            compressZip(raw, packed);
+        } else {
+            packed.swap(raw);
+        }
+
+        std::vector<unsigned char> offset;
+        putUInt64(offset, file.size());
+        memcpy(&file[tableStart + block * sizeof(uint64_t)], offset.data(), sizeof(uint64_t));
+        putInt(file, y0);
+        putInt(file, packed.size());
+        putBytes(file, packed.data(), packed.size());
+    }
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (fp == NULL) {
+        printf("Could not write %s\n", filename.c_str());
+        return false;
+    }
+    bool ok = fwrite(file.data(), 1, file.size(), fp) == file.size();
+    ok = fclose(fp) == 0 && ok;
+    if (ok) {
+        printf("Saved %s.\n", filename.c_str());
+    }
+    return ok;
+}
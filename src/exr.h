@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Minimal OpenEXR writer: single-part scanline images with any number of
+// half or float channels. Layers follow the usual "layer.channel" naming, so
+// "albedo.R" and "normal.X" show up as separate layers in compositors.
+
+#define EXR_NO_COMPRESSION  0
+#define EXR_ZIP_COMPRESSION 3  // zlib over 16-scanline blocks, with the EXR predictor
+
+namespace exr {
+    struct Channel {
+        std::string name;
+        bool half;          // store as 16-bit half instead of 32-bit float
+        const float* data;  // first value of pixel (0, 0)
+        int stride;         // floats between consecutive pixels, rows are width * stride apart
+    };
+
+    bool write(const std::string& filename, int width, int height,
+        std::vector<Channel> channels, int compression = EXR_ZIP_COMPRESSION);
+}
@@ -0,0 +1,160 @@
+#include <stb_image_write.h>
+
+#include "imageWriter.h"
+#include "exr.h"
+
+ImageWriter::ImageWriter(int threadCount)
+    : maxPending(2 * threadCount), busy(0), stopping(false) {
+    for (int i = 0; i < threadCount; i++) {
+        workers.push_back(std::thread(&ImageWriter::workerLoop, this));
+    }
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void ImageWriter::submit(Frame&& frame) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return queue.size() < maxPending; });
+    queue.push_back(std::move(frame));
+    wake.notify_one();
+}
+
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return queue.empty() && busy == 0; });
+}
+
+void ImageWriter::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;  // stopping and drained
+        }
+        Frame frame = std::move(queue.front());
+        queue.pop_front();
+        busy++;
+        done.notify_all();
+
+        lock.unlock();
+        writeFrame(frame);
+        lock.lock();
+
+        busy--;
+        done.notify_all();
+    }
+}
+
+namespace {
+
+// pixels are display values, already in [0, 1]
+void writePNG(const std::string& baseFilename, int width, int height, const std::vector<glm::vec3>& pixels) {
+    std::vector<unsigned char> bytes(3 * pixels.size());
+    for (size_t i = 0; i < pixels.size(); i++) {
+        glm::vec3 ldr = pixels[i] * 255.f;
+        bytes[3 * i + 0] = (unsigned char)ldr.x;
+        bytes[3 * i + 1] = (unsigned char)ldr.y;
+        bytes[3 * i + 2] = (unsigned char)ldr.z;
+    }
+    std::string filename = baseFilename + ".png";
+    if (stbi_write_png(filename.c_str(), width, height, 3, bytes.data(), width * 3)) {
+        printf("Saved %s.\n", filename.c_str());
+    } else {
+        printf("Could not write %s\n", filename.c_str());
+    }
+}
+
+}
+
+// the window shows the image mirrored in x, files are written the way it looks on screen
+void writeFrame(const Frame& frame) {
+    int width = frame.width;
+    int height = frame.height;
+    int pixelcount = width * height;
+    bool aovs = frame.hasAOVs;
+
+    std::vector<glm::vec3> beauty(pixelcount), albedo, normal, position, denoised;
+    std::vector<float> depth, samples;
+    if (aovs) {
+        albedo.resize(pixelcount);
+        normal.resize(pixelcount);
+        position.resize(pixelcount);
+        depth.resize(pixelcount);
+        samples.resize(pixelcount);
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int src = x + (y * width);
+            int dst = (width - 1 - x) + (y * width);
+            float n = aovs ? glm::max(frame.aovs.sampleCount[src], 1) : (float)frame.iteration;
+            beauty[dst] = frame.image[src] / n;
+
+            if (aovs) {
+                // misses add nothing to the AOVs, so silhouettes average over their hits only
+                float hits = glm::max(frame.aovs.hitCount[src], 1);
+                albedo[dst] = frame.aovs.albedo[src] / hits;
+                glm::vec3 nor = frame.aovs.normal[src];
+                normal[dst] = glm::length(nor) > 0.f ? glm::normalize(nor) : nor;
+                position[dst] = frame.aovs.position[src] / hits;
+                depth[dst] = frame.aovs.depth[src] / hits;
+                samples[dst] = frame.aovs.sampleCount[src];
+            }
+        }
+    }
+
+    PostGraph graph(frame.post);
+    PostImage color = { width, height, beauty };
+    PostImage display;
+    PostTimings timings;
+    graph.run(color, aovs ? albedo.data() : NULL, aovs ? normal.data() : NULL, aovs ? position.data() : NULL,
+        display, &denoised, &timings);
+    writePNG(frame.baseFilename, display.width, display.height, display.pixels);
+
+    printf("Post %.2f ms:", timings.totalMs);
+    for (size_t i = 0; i < timings.stages.size(); i++) {
+        printf(" %s %.2f", timings.stages[i].c_str(), timings.stageMs[i]);
+    }
+    printf("\n");
+    if (!denoised.empty()) {
+        printf("Denoise setup %.2f ms, levels", timings.denoise.setupMs);
+        for (size_t i = 0; i < timings.denoise.levelMs.size(); i++) {
+            printf(" %.2f", timings.denoise.levelMs[i]);
+        }
+        printf(" ms\n");
+    }
+
+    std::vector<exr::Channel> channels = {
+        { "R", true, &beauty[0].x, 3 },
+        { "G", true, &beauty[0].y, 3 },
+        { "B", true, &beauty[0].z, 3 },
+    };
+    if (aovs) {
+        channels.push_back({ "albedo.R", true, &albedo[0].x, 3 });
+        channels.push_back({ "albedo.G", true, &albedo[0].y, 3 });
+        channels.push_back({ "albedo.B", true, &albedo[0].z, 3 });
+        channels.push_back({ "normal.X", true, &normal[0].x, 3 });
+        channels.push_back({ "normal.Y", true, &normal[0].y, 3 });
+        channels.push_back({ "normal.Z", true, &normal[0].z, 3 });
+        channels.push_back({ "position.X", false, &position[0].x, 3 });
+        channels.push_back({ "position.Y", false, &position[0].y, 3 });
+        channels.push_back({ "position.Z", false, &position[0].z, 3 });
+        channels.push_back({ "depth.Z", false, depth.data(), 1 });
+        channels.push_back({ "sampleCount.Y", false, samples.data(), 1 });
+    }
+    if (!denoised.empty()) {
+        channels.push_back({ "denoised.R", true, &denoised[0].x, 3 });
+        channels.push_back({ "denoised.G", true, &denoised[0].y, 3 });
+        channels.push_back({ "denoised.B", true, &denoised[0].z, 3 });
+    }
+    exr::write(frame.baseFilename + ".exr", width, height, channels);
+}
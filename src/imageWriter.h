@@ -0,0 +1,51 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "pathtrace.h"
+#include "postprocess.h"
+
+// Everything needed to write one output frame, captured on the render thread.
+// The radiance and AOVs are the raw accumulated sums straight from the device.
+struct Frame {
+    std::string baseFilename;
+    int width;
+    int height;
+    int iteration;
+    std::vector<glm::vec3> image;
+    bool hasAOVs;
+    AOVBuffers aovs;
+    PostSettings post;  // applied to the PNG, the EXR stays linear
+};
+
+// Small pool of threads that run the post-process graph and turn snapshots into
+// PNG + EXR files, so saving a frame costs the renderer only the device -> host
+// copy. Each frame owns its buffers, the render keeps accumulating meanwhile.
+class ImageWriter {
+public:
+    explicit ImageWriter(int threadCount);
+    ~ImageWriter();  // writes whatever is still queued
+
+    // blocks only when maxPending frames are already waiting
+    void submit(Frame&& frame);
+    // returns once every submitted frame is on disk
+    void flush();
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<Frame> queue;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    size_t maxPending;
+    int busy;
+    bool stopping;
+};
+
+void writeFrame(const Frame& frame);
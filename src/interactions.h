@@ -1,6 +1,7 @@
 #pragma once
 
 #include "intersections.h"
+#include "texture.h"
 
 // CHECKITOUT
 /**
@@ -179,29 +180,72 @@ float D_GGX(float roughness, glm::vec3 normal, glm::vec3 half)
     return rough2 / (pi * pow(dot2 * (rough2 - 1) + 1, 2));
 }
 
+// Shading pass a material goes to when paths are binned by material. Each
+// class gets its own instantiation of scatterRay with the other branches
+// compiled out; MATERIAL_ANY keeps the runtime tests and takes whatever the
+// other classes don't cover.
+enum MaterialClass {
+    MATERIAL_EMISSIVE,
+    MATERIAL_DIFFUSE,
+    MATERIAL_MIRROR,
+    MATERIAL_GLASS,
+    MATERIAL_MICROFACET,
+    MATERIAL_ANY,
+    MATERIAL_CLASS_COUNT
+};
+
+__host__ __device__ inline int materialClass(const Material& m) {
+    if (m.emittance > 0.0f) {
+        return MATERIAL_EMISSIVE;
+    }
+    if (m.microfacet) {
+        return MATERIAL_MICROFACET;
+    }
+    if (!m.hasReflective && !m.hasRefractive) {
+        return MATERIAL_DIFFUSE;
+    }
+    if (m.hasReflective) {
+        return m.hasRefractive ? MATERIAL_GLASS : MATERIAL_MIRROR;
+    }
+    return MATERIAL_ANY;
+}
+
+template<int Class = MATERIAL_ANY>
 __device__
 void scatterRay(
     PathSegment& pathSegment,
     ShadeableIntersection& intersection,
     const Material& m,
     thrust::default_random_engine& rng,
-    glm::vec3 camPos) {
+    glm::vec3 camPos,
+    const TextureDesc* textures,
+    const unsigned char* texturePixels,
+    float pixelSpread) {
     // TODO: implement this.
     // A basic implementation of pure-diffuse shading will just call the
     // calculateRandomDirectionInHemisphere defined above.
 
+    const bool any = Class == MATERIAL_ANY;
+    const bool microfacet = Class == MATERIAL_MICROFACET || (any && m.microfacet);
+    const bool diffuse = Class == MATERIAL_DIFFUSE || (any && !m.hasReflective && !m.hasRefractive);
+    const bool mirror = Class == MATERIAL_MIRROR || (any && m.hasReflective && !m.hasRefractive);
+    const bool glass = Class == MATERIAL_GLASS || (any && m.hasReflective && m.hasRefractive);
+
     glm::vec3 intersect = getPointOnRay(pathSegment.ray, intersection.t);
     glm::vec3 normal = intersection.surfaceNormal;
-    glm::vec2 uv = intersection.uv; 
-    bool hasTexture = true;
-    if (uv == glm::vec2(-1)) hasTexture = false;
-
-    //glm::vec2 act_uv = glm::vec2(m.texture_width * uv.x, m.texture_height * (1 - uv.y));
-    //int temp = act_uv.x * act_uv.y /** m.channels*/;
-    //auto data = m.img;
-    //glm::vec3 tex_color = glm::vec3(data[temp], data[temp+1], data[temp+2]);
+    // only the diffuse branch reads the texture
+    bool hasTexture = diffuse && intersection.textureId >= 0;
+
+    glm::vec3 tex_color = m.color;
+    if (hasTexture) {
+        const TextureDesc& tex = textures[intersection.textureId];
+        // footprint of one pixel at distance t, converted to texels of the finest level
+        float footprint = intersection.t * pixelSpread * intersection.texDensity * glm::max(tex.width, tex.height);
+        float lod = glm::log2(glm::max(footprint, 1e-8f));
+        tex_color = glm::vec3(sampleTexture(tex, texturePixels, intersection.uv, lod));
+    }
 
-    if (m.microfacet) {
+    if (microfacet) {
         float metalness = m.metalness;
         float roughness = m.roughness;
 
@@ -261,9 +305,8 @@ void scatterRay(
 
     }
     else {
-        glm::vec3 tex_color = glm::vec3(0.8, 0.8, 0.8);
         //pure diffuse
-        if (!m.hasReflective && !m.hasRefractive) {
+        if (diffuse) {
             auto direction = glm::normalize(calculateRandomDirectionInHemisphere(normal, rng));
             pathSegment.ray.direction = direction;
             pathSegment.ray.origin = intersect + 0.0001f * normal;
@@ -273,14 +316,14 @@ void scatterRay(
                 pathSegment.color *= m.color;
         }
         //perfect reflective
-        else if (m.hasReflective && !m.hasRefractive) {
+        else if (mirror) {
             glm::vec3 reflection = glm::reflect(pathSegment.ray.direction, normal);
             pathSegment.ray.direction = reflection;
             pathSegment.ray.origin = intersect + 0.0001f * normal;
             pathSegment.color *= m.color;
         }
         //both reflection and refraction
-        else if (m.hasReflective && m.hasRefractive) {
+        else if (glass) {
             glm::vec3 incident = pathSegment.ray.direction;
             float cos_theta = glm::dot(normal, -incident);
             float n1 = 0.f;
@@ -286,4 +286,85 @@ float triangleIntersectionTest(Tri triangle, Ray r,
     normal = glm::normalize(multiplyMV(triangle.invTranspose, glm::vec4(normal, 0.f)));
 
     return glm::length(r.origin - intersectionPoint);
-}
\ No newline at end of file
+}
+
+/**
+ * Closest hit of a ray against the flattened triangle BVH (depth-first, the
+ * first child follows its parent, the second is at offset_to_second_child).
+ * Hits behind tMax are ignored; on a hit tMax is lowered to it.
+ *
+ * @param barycentric   Output weights of p0, p1, p2 at the hit point.
+ * @param nodesVisited  Incremented per node fetched, for statistics.
+ * @param triangleTests Incremented per triangle tested.
+ * @return              Index of the hit triangle, -1 if nothing closer than tMax.
+ */
+__host__ __device__ inline int bvhIntersect(const Ray& r, const Tri* tris, const BVHNode_GPU* bvh_nodes,
+    float& tMax, glm::vec3& barycentric, int& nodesVisited, int& triangleTests)
+{
+    int hit = -1;
+    int stack_pointer = 0;
+    int cur_node_index = 0;
+    int node_stack[128];
+    glm::vec3 invDir = 1.f / r.direction;
+    while (true)
+    {
+        const BVHNode_GPU& cur_node = bvh_nodes[cur_node_index];
+        nodesVisited++;
+        // (ray-aabb test node)
+        float t1 = (cur_node.AABB_min.x - r.origin.x) * invDir.x;
+        float t2 = (cur_node.AABB_max.x - r.origin.x) * invDir.x;
+        float tmin = glm::min(t1, t2);
+        float tmax = glm::max(t1, t2);
+        t1 = (cur_node.AABB_min.y - r.origin.y) * invDir.y;
+        t2 = (cur_node.AABB_max.y - r.origin.y) * invDir.y;
+        tmin = glm::max(tmin, glm::min(t1, t2));
+        tmax = glm::min(tmax, glm::max(t1, t2));
+        t1 = (cur_node.AABB_min.z - r.origin.z) * invDir.z;
+        t2 = (cur_node.AABB_max.z - r.origin.z) * invDir.z;
+        tmin = glm::max(tmin, glm::min(t1, t2));
+        tmax = glm::min(tmax, glm::max(t1, t2));
+        if (tmax >= tmin) {
+            // we intersected AABB
+            if (cur_node.tri_index != -1) {
+                // leaf, plane hit then barycentric coords from the sub-triangle areas
+                const Tri& tri = tris[cur_node.tri_index];
+                triangleTests++;
+                float t = glm::dot(tri.plane_normal, (tri.p0 - r.origin)) / glm::dot(tri.plane_normal, r.direction);
+                if (t >= -0.0001f) {
+                    glm::vec3 P = r.origin + t * r.direction;
+                    glm::vec3 s = glm::vec3(glm::length(glm::cross(P - tri.p1, P - tri.p2)),
+                        glm::length(glm::cross(P - tri.p2, P - tri.p0)),
+                        glm::length(glm::cross(P - tri.p0, P - tri.p1))) / tri.S;
+
+                    if (s.x >= -0.0001f && s.x <= 1.0001f && s.y >= -0.0001f && s.y <= 1.0001f &&
+                        s.z >= -0.0001f && s.z <= 1.0001f && (s.x + s.y + s.z <= 1.0001f) && (s.x + s.y + s.z >= -0.0001f) && tMax > t) {
+                        tMax = t;
+                        hit = cur_node.tri_index;
+                        barycentric = s;
+                    }
+                }
+                // if last node in tree, we are done
+                if (stack_pointer == 0) {
+                    break;
+                }
+                // otherwise need to check rest of the things in the stack
+                stack_pointer--;
+                cur_node_index = node_stack[stack_pointer];
+            }
+            else {
+                node_stack[stack_pointer] = cur_node.offset_to_second_child;
+                stack_pointer++;
+                cur_node_index++;
+            }
+        }
+        else {
+            // didn't intersect AABB, remove from stack
+            if (stack_pointer == 0) {
+                break;
+            }
+            stack_pointer--;
+            cur_node_index = node_stack[stack_pointer];
+        }
+    }
+    return hit;
+}
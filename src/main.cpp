@@ -1,5 +1,12 @@
 #include "main.h"
 #include "preview.h"
+#include "sceneBundle.h"
+#include "imageWriter.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "convergence.h"
+#include "distributed.h"
+#include "renderService.h"
 #include <cstring>
 
 #include <chrono>
@@ -24,11 +31,38 @@ glm::vec3 ogLookAt; // for recentering the camera
 Scene* scene;
 GuiDataContainer* guiData;
 RenderState* renderState;
+ImageWriter* imageWriter;
+
+// checkpointing, see saveCheckpoint
+static std::string checkpointPath;
+static int checkpointInterval = 256;  // iterations, 0 disables periodic checkpoints
+static Checkpoint* resumeFrom = NULL;
+
+// stage timings, written as PREFIX.trace.json and PREFIX.csv on exit
+static std::string profilePrefix;
+
+// time-to-error benchmark against a reference checkpoint, see convergence.h
+static convergence::Benchmark* benchmark = NULL;
+static double renderSeconds = 0.0;  // summed iteration times, excludes the preview and the error measurements
+
+// post-processing of saved frames, the display part also applies to the preview
+static PostSettings postSettings;
+// --sample-offset, the index of the first sample; checkpoints record it
+static int sampleOffset = 0;
+// iteration numbers the samples for the sampler and keeps counting across
+// reprojected camera moves; viewSamples restarts at every move and is what the
+// scene's iteration count, the exit and the file names refer to
 int iteration;
+int viewSamples;
 
 int width;
 int height;
 
+static int distributedMain(int argc, char** argv);
+static int serveMain(int argc, char** argv);
+static void orbitFromCamera(const Camera& cam);
+static void cameraFromOrbit(Camera& cam);
+
 //-------------------------------
 //-------------MAIN--------------
 //-------------------------------
@@ -37,18 +71,179 @@ int main(int argc, char** argv) {
 	startTimeString = currentTimeString();
 
 	if (argc < 2) {
-		printf("Usage: %s SCENEFILE.txt\n", argv[0]);
+		printf("Usage: %s SCENEFILE.txt [--resume [FILE%s]] [--checkpoint-every N]\n", argv[0], CHECKPOINT_EXTENSION);
+		printf("           [--denoise] [--denoise-levels N] [--denoise-phi COLOR NORMAL POSITION]\n");
+		printf("           [--profile PREFIX] [--iterations N] [--sample-offset N] [--spp-per-call N]\n");
+		printf("           [--ray-sort none|material|direction]\n");
+		printf("           [--enable FEATURE,...] [--disable FEATURE,...]\n");
+		printf("           [--reference FILE%s [--error-at SECONDS,...] [--error-log FILE.csv]]\n", CHECKPOINT_EXTENSION);
+		printf("           [--exposure STOPS] [--tonemap clamp|reinhard|aces] [--srgb] [--firefly-clamp LUM] [--downsample N]\n");
+		printf("       %s compile SCENEFILE.txt OUTPUT%s\n", argv[0], SCENE_BUNDLE_EXTENSION);
+		printf("       %s coordinate SCENEFILE.txt [--port N] [--pieces N] [--local-workers N] [--iterations N]\n", argv[0]);
+		printf("           [--sample-offset N] [--timeout SECONDS] [--output FILE%s]\n", CHECKPOINT_EXTENSION);
+		printf("       %s worker SCENEFILE.txt HOST[:PORT] [--device N]\n", argv[0]);
+		printf("       %s serve [--port N] [--loaders N] [--scene-cache N]\n", argv[0]);
 		return 1;
 	}
 
+	// offline: parse the text scene, build the BVH and write a bundle for fast startup
+	if (strcmp(argv[1], "compile") == 0) {
+		if (argc < 4) {
+			printf("Usage: %s compile SCENEFILE.txt OUTPUT%s\n", argv[0], SCENE_BUNDLE_EXTENSION);
+			return 1;
+		}
+		Scene compiled(argv[2]);
+		return sceneBundle::write(compiled, argv[3]) ? 0 : 1;
+	}
+
+	// one frame split over worker processes, see distributed.h
+	if (strcmp(argv[1], "coordinate") == 0 || strcmp(argv[1], "worker") == 0) {
+		return distributedMain(argc, argv);
+	}
+
+	// render queue on localhost, see renderService.h
+	if (strcmp(argv[1], "serve") == 0) {
+		return serveMain(argc, argv);
+	}
+
 	const char* sceneFile = argv[1];
+	bool resume = false;
+	int iterationOverride = 0;
+	int samplesPerCall = 0;  // 0 keeps the scene's SAMPLES_PER_CALL
+	int raySort = -1;  // -1 keeps the scene's RAY_SORT
+	std::vector<std::pair<std::string, bool> > featureOverrides;  // applied over the scene's RENDER block
+	std::string referencePath;
+	std::string errorLogPath;
+	std::vector<double> errorTimes;
+	convergence::parseTimes("1,2,5,10,30,60", errorTimes);
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--resume") == 0) {
+			resume = true;
+			if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+				checkpointPath = argv[++i];
+			}
+		}
+		else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+			checkpointInterval = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--denoise") == 0) {
+			postSettings.denoise = true;
+		}
+		else if (strcmp(argv[i], "--denoise-levels") == 0 && i + 1 < argc) {
+			postSettings.denoise = true;
+			postSettings.denoiseSettings.levels = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--denoise-phi") == 0 && i + 3 < argc) {
+			postSettings.denoise = true;
+			postSettings.denoiseSettings.colorPhi = (float)atof(argv[++i]);
+			postSettings.denoiseSettings.normalPhi = (float)atof(argv[++i]);
+			postSettings.denoiseSettings.positionPhi = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			profilePrefix = argv[++i];
+			profiler::setEnabled(true);
+		}
+		else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterationOverride = atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--enable") == 0 || strcmp(argv[i], "--disable") == 0) && i + 1 < argc) {
+			bool enable = strcmp(argv[i], "--enable") == 0;
+			std::stringstream list(argv[++i]);
+			std::string name;
+			while (std::getline(list, name, ',')) {
+				RenderSettings probe;
+				if (!setRenderFeature(probe, name, enable)) {
+					printf("Unknown feature %s\n", name.c_str());
+					return 1;
+				}
+				featureOverrides.push_back(std::make_pair(name, enable));
+			}
+		}
+		else if (strcmp(argv[i], "--sample-offset") == 0 && i + 1 < argc) {
+			sampleOffset = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--spp-per-call") == 0 && i + 1 < argc) {
+			samplesPerCall = glm::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "--ray-sort") == 0 && i + 1 < argc) {
+			raySort = parseRaySort(argv[++i]);
+			if (raySort < 0) {
+				printf("Unknown ray sort %s, expected none, material or direction\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+			referencePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--error-at") == 0 && i + 1 < argc) {
+			if (!convergence::parseTimes(argv[++i], errorTimes)) {
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--error-log") == 0 && i + 1 < argc) {
+			errorLogPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+			postSettings.display.exposure = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--tonemap") == 0 && i + 1 < argc) {
+			const char* op = argv[++i];
+			if (strcmp(op, "clamp") == 0) {
+				postSettings.display.toneMap = TONEMAP_CLAMP;
+			}
+			else if (strcmp(op, "reinhard") == 0) {
+				postSettings.display.toneMap = TONEMAP_REINHARD;
+			}
+			else if (strcmp(op, "aces") == 0) {
+				postSettings.display.toneMap = TONEMAP_ACES;
+			}
+			else {
+				printf("Unknown tone map %s\n", op);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--srgb") == 0) {
+			postSettings.display.srgb = true;
+		}
+		else if (strcmp(argv[i], "--firefly-clamp") == 0 && i + 1 < argc) {
+			postSettings.fireflyClamp = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--downsample") == 0 && i + 1 < argc) {
+			postSettings.downsample = glm::max(atoi(argv[++i]), 1);
+		}
+		else {
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
 
 	// Load scene file
-	scene = new Scene(sceneFile);
+	{
+		profiler::HostScope scope("load scene");
+		scene = new Scene(sceneFile);
+	}
+	if (checkpointPath.empty()) {
+		checkpointPath = scene->state.imageName + CHECKPOINT_EXTENSION;
+	}
+	if (iterationOverride > 0) {
+		scene->state.iterations = iterationOverride;
+	}
+	for (size_t i = 0; i < featureOverrides.size(); i++) {
+		setRenderFeature(scene->state.settings, featureOverrides[i].first, featureOverrides[i].second);
+	}
+	if (samplesPerCall > 0) {
+		scene->state.settings.samplesPerCall = samplesPerCall;
+	}
+	if (raySort >= 0) {
+		scene->state.settings.raySort = raySort;
+	}
 
 	//Create Instance for ImGUIData
 	guiData = new GuiDataContainer();
 
+	// PNG/EXR encoding happens off the render thread
+	imageWriter = new ImageWriter(glm::clamp((int)std::thread::hardware_concurrency() / 2, 1, 4));
+
 	// Set up camera stuff from loaded path tracer settings
 	iteration = 0;
 	renderState = &scene->state;
@@ -58,7 +253,70 @@ int main(int argc, char** argv) {
 	Camera& cam = renderState->camera;
 	width = cam.resolution.x;
 	height = cam.resolution.y;
+	orbitFromCamera(cam);
+
+	if (!referencePath.empty()) {
+		if (errorLogPath.empty()) {
+			errorLogPath = renderState->imageName + ".convergence.csv";
+		}
+		std::string sceneName = sceneFile;
+		size_t slash = sceneName.find_last_of("/\\");
+		if (slash != std::string::npos) {
+			sceneName = sceneName.substr(slash + 1);
+		}
+		benchmark = new convergence::Benchmark();
+		if (!benchmark->init(sceneName, referencePath, errorLogPath, errorTimes, width, height)) {
+			return 1;
+		}
+	}
+
+	if (resume) {
+		resumeFrom = new Checkpoint();
+		if (!checkpoint::read(*resumeFrom, checkpointPath)) {
+			return 1;
+		}
+		if (resumeFrom->width != width || resumeFrom->height != height ||
+			resumeFrom->traceDepth != renderState->traceDepth) {
+			printf("Checkpoint %s was written for a different resolution or trace depth\n", checkpointPath.c_str());
+			return 1;
+		}
+		// the random streams continue from the checkpoint's first sample, another offset would mix them
+		if (resumeFrom->sampleOffset != sampleOffset) {
+			printf("Checkpoint %s starts at sample %d, resume it with --sample-offset %d\n", checkpointPath.c_str(),
+				resumeFrom->sampleOffset, resumeFrom->sampleOffset);
+			return 1;
+		}
+		// the first runCuda rebuilds the camera from these, exactly as before the checkpoint
+		phi = resumeFrom->phi;
+		theta = resumeFrom->theta;
+		zoom = resumeFrom->zoom;
+		cam.lookAt = resumeFrom->lookAt;
+		printf("Resuming %s at %d iterations\n", checkpointPath.c_str(), resumeFrom->iteration);
+	}
+
+	// Initialize CUDA and GL components
+	init();
+	pathtraceSetDisplay(postSettings.display);
+	pathtraceSetSampleOffset(sampleOffset);
+	printf("Features: %s\n", describeRenderSettings(scene->state.settings).c_str());
+	printf("Post-processing: %s\n", PostGraph(postSettings).describe().c_str());
+
+	// Initialize ImGui Data
+	InitImguiData(guiData);
+	InitDataContainer(guiData, scene->state.settings);
 
+	// GLFW main loop
+	mainLoop();
+
+	// finish any frames still being written
+	delete imageWriter;
+	saveProfile();
+
+	return 0;
+}
+
+// the orbit parameters runCuda rebuilds the camera from
+static void orbitFromCamera(const Camera& cam) {
 	glm::vec3 view = cam.view;
 	glm::vec3 up = cam.up;
 	glm::vec3 right = glm::cross(view, up);
@@ -74,62 +332,337 @@ int main(int argc, char** argv) {
 	theta = glm::acos(glm::dot(glm::normalize(viewZY), glm::vec3(0, 1, 0)));
 	ogLookAt = cam.lookAt;
 	zoom = glm::length(cam.position - ogLookAt);
+}
 
-	// Initialize CUDA and GL components
-	init();
+// what the preview renders, the scene's camera goes through the orbit first
+static void cameraFromOrbit(Camera& cam) {
+	cameraPosition.x = zoom * sin(phi) * sin(theta);
+	cameraPosition.y = zoom * cos(theta);
+	cameraPosition.z = zoom * cos(phi) * sin(theta);
+
+	cam.view = -glm::normalize(cameraPosition);
+	glm::vec3 v = cam.view;
+	glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
+	glm::vec3 r = glm::cross(v, u);
+	cam.up = glm::cross(r, v);
+	cam.right = r;
+
+	cam.position = cameraPosition;
+	cameraPosition += cam.lookAt;
+	cam.position = cameraPosition;
+}
 
-	// Initialize ImGui Data
-	InitImguiData(guiData);
-	InitDataContainer(guiData);
+// Renders samples [sampleStart, sampleStart + sampleCount) of the current scene
+// without a window, stopping early once progress(done) returns false. The sums
+// stay on the device for the caller to read back before pathtraceFree().
+// pathtrace() still writes a preview, so it gets a plain device buffer
+// instead of the GL one.
+static int renderHeadless(int sampleStart, int sampleCount, const std::function<bool(int)>& progress) {
+	pathtraceInit(scene);
+	pathtraceSetSampleOffset(sampleStart);
+	uchar4* display = NULL;
+	cudaMalloc(&display, width * height * sizeof(uchar4));
+
+	int done = 0;
+	while (done < sampleCount) {
+		int samples = glm::min(glm::max(renderState->settings.samplesPerCall, 1), sampleCount - done);
+		pathtrace(display, 0, done + 1, samples);
+		done += samples;
+		if (!progress(done)) {
+			break;
+		}
+	}
 
-	// GLFW main loop
-	mainLoop();
+	cudaFree(display);
+	return done;
+}
+
+// pathtraceFree() and report any CUDA error the render left behind
+static bool finishHeadless() {
+	pathtraceFree();
+	cudaError_t err = cudaGetLastError();
+	if (err != cudaSuccess) {
+		printf("CUDA error: %s\n", cudaGetErrorString(err));
+		return false;
+	}
+	return true;
+}
+
+static bool renderPiece(const distributed::Piece& piece, Checkpoint& result, const std::function<void(int)>& heartbeat) {
+	int done = renderHeadless(piece.sampleStart, piece.sampleCount, [&](int samples) {
+		heartbeat(samples);
+		return true;
+	});
+
+	result.width = width;
+	result.height = height;
+	result.traceDepth = renderState->traceDepth;
+	result.iteration = done;
+	result.phi = phi;
+	result.theta = theta;
+	result.zoom = zoom;
+	result.lookAt = renderState->camera.lookAt;
+	pathtraceSnapshot(result.image);
+	result.hasAOVs = pathtraceGetAOVs(result.aovs);
+	return finishHeadless();
+}
+
+// coordinate and worker subcommands. The coordinator only needs the scene for
+// the resolution and camera, the workers render it.
+static int distributedMain(int argc, char** argv) {
+	if (argc < 3) {
+		printf("Usage: %s coordinate|worker SCENEFILE.txt ...\n", argv[0]);
+		return 1;
+	}
+	const bool worker = strcmp(argv[1], "worker") == 0;
+	const char* sceneFile = argv[2];
+	distributed::CoordinatorOptions options;
+	int localWorkers = 0;
+	int iterationOverride = 0;
+	int device = -1;
+	std::string address;
+	std::string output;
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+			options.port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) {
+			options.pieces = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--local-workers") == 0 && i + 1 < argc) {
+			localWorkers = glm::max(atoi(argv[++i]), 0);
+		}
+		else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterationOverride = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--sample-offset") == 0 && i + 1 < argc) {
+			options.sampleStart = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+			options.timeoutSeconds = glm::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		}
+		else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+			device = atoi(argv[++i]);
+		}
+		else if (worker && strncmp(argv[i], "--", 2) != 0 && address.empty()) {
+			address = argv[i];
+		}
+		else {
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	scene = new Scene(sceneFile);
+	renderState = &scene->state;
+	width = renderState->camera.resolution.x;
+	height = renderState->camera.resolution.y;
+	orbitFromCamera(renderState->camera);
+
+	if (worker) {
+		if (address.empty()) {
+			printf("Usage: %s worker SCENEFILE.txt HOST[:PORT] [--device N]\n", argv[0]);
+			return 1;
+		}
+		if (device >= 0) {
+			cudaSetDevice(device);
+		}
+		// regenerated paths carry samples across iterations, the pieces would overlap
+		renderState->settings.regeneratePaths = false;
+		// the same camera as the preview, so the merged checkpoint resumes seamlessly
+		cameraFromOrbit(renderState->camera);
+		printf("Features: %s\n", describeRenderSettings(renderState->settings).c_str());
+		return distributed::runWorker(address, renderPiece) ? 0 : 1;
+	}
+
+	options.samples = iterationOverride > 0 ? iterationOverride : (int)renderState->iterations;
+	if (options.pieces <= 0) {
+		options.pieces = 4 * glm::max(localWorkers, 1);
+	}
+	// one worker per GPU, round robin when there are more workers than GPUs
+	int devices = 0;
+	if (cudaGetDeviceCount(&devices) != cudaSuccess) {
+		devices = 0;
+	}
+	for (int w = 0; w < localWorkers; w++) {
+		std::vector<std::string> args;
+		args.push_back(argv[0]);
+		args.push_back("worker");
+		args.push_back(sceneFile);
+		if (devices > 1) {
+			args.push_back("--device");
+			args.push_back(std::to_string(w % devices));
+		}
+		options.localWorkers.push_back(args);
+	}
 
+	Checkpoint merged;
+	merged.traceDepth = renderState->traceDepth;
+	merged.phi = phi;
+	merged.theta = theta;
+	merged.zoom = zoom;
+	merged.lookAt = renderState->camera.lookAt;
+	if (!distributed::runCoordinator(options, width, height, merged)) {
+		return 1;
+	}
+	if (output.empty()) {
+		output = renderState->imageName + CHECKPOINT_EXTENSION;
+	}
+	merged.viewSamples = merged.iteration;
+	merged.sampleOffset = options.sampleStart;
+	merged.cursor.nextJob = 0;
+	merged.cursor.sampleShift = 0;
+	if (!checkpoint::write(merged, output)) {
+		return 1;
+	}
+	printf("Merged %d samples into %s, open it with %s %s --resume %s --sample-offset %d\n", merged.iteration,
+		output.c_str(), argv[0], sceneFile, output.c_str(), options.sampleStart);
 	return 0;
 }
 
-void saveImage() {
-	float samples = iteration;
-	// output image file
-	image img(width, height);
+// One service job: the scene comes parsed from the service's cache with the
+// job's settings applied, and goes through the orbit camera like the preview.
+static bool renderJob(Scene& jobScene, Frame& frame, const std::function<bool(int)>& progress) {
+	scene = &jobScene;
+	renderState = &scene->state;
+	width = renderState->camera.resolution.x;
+	height = renderState->camera.resolution.y;
+	orbitFromCamera(renderState->camera);
+	cameraFromOrbit(renderState->camera);
+
+	frame.width = width;
+	frame.height = height;
+	frame.iteration = renderHeadless(0, renderState->iterations, progress);
+	pathtraceSnapshot(frame.image);
+	frame.hasAOVs = pathtraceGetAOVs(frame.aovs);
+	frame.post = postSettings;
+	scene = NULL;
+	renderState = NULL;
+	return finishHeadless();
+}
 
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			int index = x + (y * width);
-			glm::vec3 pix = renderState->image[index];
-			img.setPixel(width - 1 - x, y, glm::vec3(pix) / samples);
+static int serveMain(int argc, char** argv) {
+	renderService::Options options;
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+			options.port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--loaders") == 0 && i + 1 < argc) {
+			options.loaderThreads = glm::max(atoi(argv[++i]), 0);
+		}
+		else if (strcmp(argv[i], "--scene-cache") == 0 && i + 1 < argc) {
+			options.sceneCache = glm::max(atoi(argv[++i]), 0);
 		}
+		else {
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	return renderService::run(options, renderJob);
+}
+
+void saveProfile() {
+	if (profilePrefix.empty()) {
+		return;
 	}
+	profiler::writeChromeTrace(profilePrefix + ".trace.json");
+	profiler::writeSummaryCSV(profilePrefix + ".csv");
+	profiler::shutdown();
+}
+
+void saveImage() {
+	profiler::HostScope scope("save image");
+	// only the device readback happens here, conversion and encoding run on the writer threads
+	Frame frame;
+	frame.width = width;
+	frame.height = height;
+	frame.iteration = iteration;
+	pathtraceSnapshot(frame.image);
+	frame.hasAOVs = pathtraceGetAOVs(frame.aovs);
+	frame.post = postSettings;
 
-	std::string filename = renderState->imageName;
 	std::ostringstream ss;
-	ss << filename << "." << startTimeString << "." << samples << "samp";
-	filename = ss.str();
+	ss << renderState->imageName << "." << startTimeString << "." << viewSamples << "samp";
+	frame.baseFilename = ss.str();
+
+	imageWriter->submit(std::move(frame));
+}
+
+// raw float sums and sample counts, so a resumed render continues bit-exactly
+void saveCheckpoint() {
+	if (iteration == 0) {
+		return;
+	}
+	profiler::HostScope scope("checkpoint");
+	Checkpoint cp;
+	cp.width = width;
+	cp.height = height;
+	cp.traceDepth = renderState->traceDepth;
+	cp.iteration = iteration;
+	cp.viewSamples = viewSamples;
+	cp.sampleOffset = sampleOffset;
+	cp.cursor = pathtraceGetSampleCursor();
+	cp.phi = phi;
+	cp.theta = theta;
+	cp.zoom = zoom;
+	cp.lookAt = renderState->camera.lookAt;
+	pathtraceSnapshot(cp.image);
+	cp.hasAOVs = pathtraceGetAOVs(cp.aovs);
+	checkpoint::write(cp, checkpointPath);
+}
+
+// pushes this iteration's numbers into the scrolling plots of the analytics window
+static void updateDashboard(double iterationMs) {
+	guiData->IterationMs.push((float)iterationMs);
+	guiData->RaysPerSecond.push((float)(guiData->RaysTraced / (iterationMs * 1000.0)));
+	guiData->Convergence.push(glm::max(guiData->ConvergenceError, 0.f));
+
+	size_t freeBytes, totalBytes;
+	if (cudaMemGetInfo(&freeBytes, &totalBytes) == cudaSuccess) {
+		guiData->MemoryMB.push((float)((totalBytes - freeBytes) / (1024.0 * 1024.0)));
+	}
+
+	const std::vector<profiler::StageTime>& stages = profiler::lastIteration();
+	for (size_t i = 0; i < stages.size(); i++) {
+		size_t k = 0;
+		while (k < guiData->StageMs.size() && guiData->StageMs[k].first != stages[i].name) {
+			k++;
+		}
+		if (k == guiData->StageMs.size()) {
+			guiData->StageMs.push_back(std::make_pair(std::string(stages[i].name), PlotHistory()));
+		}
+		guiData->StageMs[k].second.push((float)stages[i].ms);
+	}
+}
 
-	// CHECKITOUT
-	img.savePNG(filename);
-	//img.saveHDR(filename);  // Save a Radiance HDR file
+// writes the final image and exits
+static void finishRender() {
+	saveImage();
+	delete imageWriter;
+	delete benchmark;
+	saveProfile();
+	pathtraceFree();
+	cudaDeviceReset();
+	exit(EXIT_SUCCESS);
 }
 
 void runCuda() {
 	if (camchanged) {
-		iteration = 0;
 		Camera& cam = renderState->camera;
-		cameraPosition.x = zoom * sin(phi) * sin(theta);
-		cameraPosition.y = zoom * cos(theta);
-		cameraPosition.z = zoom * cos(phi) * sin(theta);
-
-		cam.view = -glm::normalize(cameraPosition);
-		glm::vec3 v = cam.view;
-		glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
-		glm::vec3 r = glm::cross(v, u);
-		cam.up = glm::cross(r, v);
-		cam.right = r;
-
-		cam.position = cameraPosition;
-		cameraPosition += cam.lookAt;
-		cam.position = cameraPosition;
+		Camera previous = cam;
+		cameraFromOrbit(cam);
 		camchanged = false;
+
+		// reproject what has been accumulated so far, a fresh start needs the full reset below.
+		// Reprojected pixels carry at most a few samples of history, so the
+		// scene's count starts over for the new view.
+		if (iteration == 0 || !pathtraceReproject(previous)) {
+			iteration = 0;
+		}
+		viewSamples = 0;
 	}
 
 	// Map OpenGL buffer object for writing from CUDA on a single GPU
@@ -138,30 +671,79 @@ void runCuda() {
 	if (iteration == 0) {
 		pathtraceFree();
 		pathtraceInit(scene);
+		renderSeconds = 0.0;
+		viewSamples = 0;
+
+		if (resumeFrom != NULL) {
+			pathtraceRestore(resumeFrom->image, resumeFrom->hasAOVs ? &resumeFrom->aovs : NULL, resumeFrom->iteration);
+			pathtraceSetSampleCursor(resumeFrom->cursor);
+			iteration = resumeFrom->iteration;
+			viewSamples = resumeFrom->viewSamples;
+			delete resumeFrom;
+			resumeFrom = NULL;
+		}
 	}
 
 	auto start = std::chrono::steady_clock::now();
-	if (iteration < renderState->iterations) {
+	// a benchmark runs until its last checkpoint time, whatever the scene's iteration count
+	if (viewSamples < (int)renderState->iterations || benchmark != NULL) {
 
 		uchar4* pbo_dptr = NULL;
-		iteration++;
-		cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+		// a call traces several samples per pixel, the last one stops at the iteration count
+		int samples = glm::max(renderState->settings.samplesPerCall, 1);
+		if (benchmark == NULL) {
+			samples = glm::min(samples, (int)renderState->iterations - viewSamples);
+		}
+		iteration += samples;
+		viewSamples += samples;
+		{
+			profiler::HostScope scope("iteration");
+			profiler::setLive(guiData->StageTimings);
+			profiler::beginIteration(iteration);
+			cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+
+			// execute the kernel
+			int frame = 0;
+			auto iterationStart = std::chrono::steady_clock::now();
+			pathtrace(pbo_dptr, frame, iteration - samples + 1, samples);
+			if (benchmark != NULL) {
+				// count the whole iteration, not just the launches
+				cudaDeviceSynchronize();
+			}
+			std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - iterationStart;
+
+			RayStats rayStats;
+			if (pathtraceGetRayStats(rayStats)) {
+				printRayStats(rayStats, iteration, ms.count());
+			}
+
+			// unmap buffer object
+			cudaGLUnmapBufferObject(pbo);
+			profiler::endIteration();
+			updateDashboard(ms.count());
+			renderSeconds += ms.count() / 1000.0;
+		}
 
-		// execute the kernel
-		int frame = 0;
-		pathtrace(pbo_dptr, frame, iteration);
+		if (benchmark != NULL && benchmark->due(renderSeconds)) {
+			std::vector<glm::vec3> sums;
+			AOVBuffers aovs;
+			pathtraceSnapshot(sums);
+			bool hasAOVs = pathtraceGetAOVs(aovs);
+			benchmark->record(renderSeconds, iteration, sums, hasAOVs ? &aovs.sampleCount : NULL);
+			if (benchmark->finished()) {
+				finishRender();
+			}
+		}
 
-		// unmap buffer object
-		cudaGLUnmapBufferObject(pbo);
+		if (checkpointInterval > 0 && iteration / checkpointInterval != (iteration - samples) / checkpointInterval) {
+			saveCheckpoint();
+		}
 	}
 	else {
 		auto end = std::chrono::steady_clock::now();
 		std::chrono::duration<double> elapsed_seconds = end - start;
 		std::cout << "elapsed time to compute: " << elapsed_seconds.count() << "s\n";
-		saveImage();
-		pathtraceFree();
-		cudaDeviceReset();
-		exit(EXIT_SUCCESS);
+		finishRender();
 	}
 }
 
@@ -170,6 +752,7 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 		switch (key) {
 		case GLFW_KEY_ESCAPE:
 			saveImage();
+			saveCheckpoint();
 			glfwSetWindowShouldClose(window, GL_TRUE);
 			break;
 		case GLFW_KEY_S:
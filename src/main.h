@@ -28,11 +28,13 @@ using namespace std;
 
 extern Scene* scene;
 extern int iteration;
+extern int viewSamples;
 
 extern int width;
 extern int height;
 
 void runCuda();
+void saveProfile();
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
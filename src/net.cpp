@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "net.h"
+
+#ifdef _WIN32
+const net::Socket net::invalidSocket = (net::Socket)INVALID_SOCKET;
+#else
+const net::Socket net::invalidSocket = -1;
+#endif
+
+void net::start() {
+#ifdef _WIN32
+    static bool started = false;
+    if (!started) {
+        WSADATA data;
+        WSAStartup(MAKEWORD(2, 2), &data);
+        started = true;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+net::Socket net::listenOn(int port, bool loopbackOnly) {
+    Socket s = (Socket)socket(AF_INET, SOCK_STREAM, 0);
+    if (s == invalidSocket) {
+        return invalidSocket;
+    }
+    int yes = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 16) != 0) {
+        closeSocket(s);
+        return invalidSocket;
+    }
+    return s;
+}
+
+net::Socket net::acceptFrom(Socket listener) {
+    return (Socket)accept(listener, NULL, NULL);
+}
+
+net::Socket net::connectTo(const std::string& address, int defaultPort) {
+    std::string host = address;
+    std::string port = std::to_string(defaultPort);
+    size_t colon = address.find_last_of(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* info = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0 || info == NULL) {
+        return invalidSocket;
+    }
+    Socket s = invalidSocket;
+    for (int attempt = 0; attempt < 20 && s == invalidSocket; attempt++) {
+        s = (Socket)socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (s != invalidSocket && connect(s, info->ai_addr, (int)info->ai_addrlen) != 0) {
+            closeSocket(s);
+            s = invalidSocket;
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+    }
+    freeaddrinfo(info);
+    return s;
+}
+
+void net::closeSocket(Socket s) {
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+void net::setReceiveTimeout(Socket s, int timeoutSeconds) {
+#ifdef _WIN32
+    DWORD ms = timeoutSeconds * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+#else
+    struct timeval tv = { timeoutSeconds, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+#endif
+}
+
+void net::setNoDelay(Socket s) {
+    int yes = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+}
+
+bool net::sendAll(Socket s, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        int n = send(s, p, (int)std::min(size, (size_t)1 << 20), 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool net::recvAll(Socket s, void* data, size_t size) {
+    char* p = (char*)data;
+    while (size > 0) {
+        int n = recv(s, p, (int)std::min(size, (size_t)1 << 20), 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool net::sendLine(Socket s, const std::string& line) {
+    std::string l = line + "\n";
+    return sendAll(s, l.data(), l.size());
+}
+
+// lines are short and sent whole, reading them a byte at a time is fine
+bool net::recvLine(Socket s, std::string& line, size_t maxLength) {
+    line.clear();
+    char c;
+    while (line.size() < maxLength) {
+        if (recv(s, &c, 1, 0) != 1) {
+            return false;
+        }
+        if (c == '\n') {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+bool net::waitReadable(const std::vector<Socket>& sockets, int timeoutMs, std::vector<bool>& ready) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    Socket maxSocket = 0;
+    for (size_t i = 0; i < sockets.size(); i++) {
+        FD_SET(sockets[i], &readable);
+        maxSocket = std::max(maxSocket, sockets[i]);
+    }
+    struct timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+    if (select((int)maxSocket + 1, &readable, NULL, NULL, &tv) < 0) {
+        return false;
+    }
+    ready.assign(sockets.size(), false);
+    for (size_t i = 0; i < sockets.size(); i++) {
+        ready[i] = FD_ISSET(sockets[i], &readable) != 0;
+    }
+    return true;
+}
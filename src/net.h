@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Blocking TCP helpers shared by the distributed renderer and the render
+// service, over BSD sockets or Winsock.
+namespace net {
+#ifdef _WIN32
+    typedef uintptr_t Socket;
+#else
+    typedef int Socket;
+#endif
+    extern const Socket invalidSocket;
+
+    // WSAStartup on Windows; elsewhere a dead peer must fail send() instead of raising SIGPIPE
+    void start();
+
+    // loopbackOnly keeps the port off the network
+    Socket listenOn(int port, bool loopbackOnly);
+    Socket acceptFrom(Socket listener);
+    // "host[:port]", retries for a while since the other side may still be starting up
+    Socket connectTo(const std::string& address, int defaultPort);
+    void closeSocket(Socket s);
+
+    // blocking reads give up after this long, 0 waits forever
+    void setReceiveTimeout(Socket s, int timeoutSeconds);
+    void setNoDelay(Socket s);
+
+    bool sendAll(Socket s, const void* data, size_t size);
+    bool recvAll(Socket s, void* data, size_t size);
+    // without the '\n'; lines longer than maxLength fail
+    bool sendLine(Socket s, const std::string& line);
+    bool recvLine(Socket s, std::string& line, size_t maxLength = 256);
+
+    // ready[i] is set for the sockets with data or a pending connection,
+    // returns false if select fails
+    bool waitReadable(const std::vector<Socket>& sockets, int timeoutMs, std::vector<bool>& ready);
+}
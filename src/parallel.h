@@ -0,0 +1,23 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// runs fn(y0, y1) on contiguous bands of rows, one band per thread
+template<typename F>
+void parallelRows(int height, int threads, F fn) {
+    std::vector<std::thread> pool;
+    int band = (height + threads - 1) / threads;
+    for (int y0 = 0; y0 < height; y0 += band) {
+        pool.push_back(std::thread(fn, y0, std::min(y0 + band, height)));
+    }
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+}
+
+// 0 means every hardware thread
+inline int resolveThreadCount(int threads) {
+    return threads > 0 ? threads : std::max(1, (int)std::thread::hardware_concurrency());
+}
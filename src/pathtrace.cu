@@ -11,22 +11,40 @@
 #include "glm/gtx/norm.hpp"
 #include "utilities.h"
 #include "pathtrace.h"
+#include "profiler.h"
+#include "rayStats.h"
 #include "intersections.h"
 #include "interactions.h"
 
 #include "device_launch_parameters.h"
+#include <thrust/transform_reduce.h>
+#include <thrust/functional.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/sequence.h>
+#include <thrust/fill.h>
 #include <thrust/partition.h>
+#include <thrust/sort.h>
 
-#define DIRECT 0
-#define CACHE_FIRST_BOUNCE 0
-#define SORT_MATERIAL 1
-#define COMPACTION 1
-#define DEPTH_OF_FIELD 0
-#define ANTI_ALIASING 0
-#define BOUNDING_BOX 0
+// the feature switches are runtime now, see RenderSettings
+#define AOV_OUTPUT 1 // first-hit albedo/normal/position/depth and sample counts for EXR output and denoising
+#define TEMPORAL_REPROJECTION 1 // camera moves reproject the accumulated image instead of restarting, needs AOV_OUTPUT
+#define RAY_STATS 0 // per-iteration ray, BVH node and primitive test counters, printed every iteration
+#define CONVERGENCE_STATS 0 // per-pixel luminance second moments for the convergence plot, a reduction every CONVERGENCE_INTERVAL
+
+#define CONVERGENCE_INTERVAL 4 // iterations between convergence estimates
+
+#define TEMPORAL_MAX_HISTORY 32 // samples a reprojected pixel keeps, lower adapts faster to disocclusion errors
+#define TEMPORAL_DEPTH_TOLERANCE 0.05f // relative depth difference allowed between history and the new hit
+#define TEMPORAL_NORMAL_TOLERANCE 0.9f // min cosine between history and new normals
+
+#if TEMPORAL_REPROJECTION && !AOV_OUTPUT
+#error TEMPORAL_REPROJECTION needs the depth and normal AOVs
+#endif
 
 #define MAX_INTERSECT_DIST 10000.f
 
+#define MATERIAL_QUEUE_SHARED_BINS 4096 // up to this many materials are binned in shared memory, global atomics above
+
 #define ERRORCHECK 1
 
 #define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
@@ -51,26 +69,46 @@ void checkCUDAErrorFn(const char* msg, const char* file, int line) {
 #endif
 }
 
+// Each random decision of a path gets its own stream, so the draws of one
+// never shift those of another (e.g. lens and AA jitter no longer share numbers)
+enum RngDimension {
+	RNG_PIXEL_JITTER = 0,
+	RNG_LENS,
+	RNG_SCATTER
+};
+
+// Streams are keyed by what the sample is - pixel, sample index, bounce and
+// dimension - never by the path's slot in dev_paths. Compaction and material
+// sorting reorder the paths, so with slot keys the noise depended on them and
+// on the block size; now a render is bitwise reproducible whatever the settings.
+// The exception is REGENERATE_PATHS: its paths finish in no fixed order and
+// are splatted with float atomics, so the sums depend on the thread schedule.
 __host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth) {
-	int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
+thrust::default_random_engine makeSeededRandomEngine(int sample, int pixel, int bounce, int dimension) {
+	unsigned int h = utilhash((unsigned int)pixel);
+	h = utilhash(h ^ (unsigned int)sample);
+	h = utilhash(h ^ ((unsigned int)bounce << 8 | (unsigned int)dimension));
 	return thrust::default_random_engine(h);
 }
 
 //Kernel that writes the image to the OpenGL PBO directly.
 __global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution,
-	int iter, glm::vec3* image) {
+	int iter, glm::vec3* image, const int* sampleCount, DisplaySettings display) {
 	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
 	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
 	if (x < resolution.x && y < resolution.y) {
 		int index = x + (y * resolution.x);
 		glm::vec3 pix = image[index];
+		// reprojected pixels carry different sample counts
+		float samples = sampleCount != NULL ? glm::max(sampleCount[index], 1) : iter;
+
+		glm::vec3 ldr = displayTransform(pix / samples, display);
 
 		glm::ivec3 color;
-		color.x = glm::clamp((int)(pix.x / iter * 255.0), 0, 255);
-		color.y = glm::clamp((int)(pix.y / iter * 255.0), 0, 255);
-		color.z = glm::clamp((int)(pix.z / iter * 255.0), 0, 255);
+		color.x = glm::clamp((int)(ldr.x * 255.0), 0, 255);
+		color.y = glm::clamp((int)(ldr.y * 255.0), 0, 255);
+		color.z = glm::clamp((int)(ldr.z * 255.0), 0, 255);
 
 		// Each thread writes one pixel location in the texture (textel)
 		pbo[index].w = 0;
@@ -82,68 +120,345 @@ __global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution,
 
 static Scene* hst_scene = NULL;
 static GuiDataContainer* guiData = NULL;
+static DisplaySettings display_settings;
 static glm::vec3* dev_image = NULL;
 static Geom* dev_geoms = NULL;
 static Material* dev_materials = NULL;
-static PathSegment* dev_paths = NULL;
-static ShadeableIntersection* dev_intersections = NULL;
+static PathBuffers dev_paths = {};
+static HitBuffers dev_hits = {};
+static int* dev_active = NULL;  // slots of the live paths, compaction moves these instead of the paths
 
 //BVH
 static BVHNode_GPU* dev_bvh_nodes = NULL;
 static Tri* dev_tris = NULL;
 
-// TODO: static variables for device memory, any extra info you need, etc
-//for caching first bounce
-#if CACHE_FIRST_BOUNCE
-static ShadeableIntersection* dev_firstBounce = NULL;
-static PathSegment* dev_first_paths = NULL;
+//textures
+static TextureDesc* dev_textures = NULL;
+static unsigned char* dev_texture_pixels = NULL;
+
+//AOVs, summed over iterations like dev_image
+#if AOV_OUTPUT
+static glm::vec3* dev_albedo = NULL;
+static glm::vec3* dev_normal = NULL;
+static glm::vec3* dev_position = NULL;
+static float* dev_depth = NULL;
+static int* dev_sample_count = NULL;
+static int* dev_hit_count = NULL;  // camera rays that hit something, the other AOVs are summed over these
+#endif
+
+#if CONVERGENCE_STATS
+static float* dev_luminance_sq = NULL;  // sum of squared path luminance per pixel
+#endif
+
+#if RAY_STATS
+static RayStats* dev_ray_stats = NULL;
+static RayStats ray_stats;  // last completed iteration
+#endif
+
+//previous accumulation, read while reprojecting after a camera move
+#if TEMPORAL_REPROJECTION
+static glm::vec3* dev_history_image = NULL;
+static glm::vec3* dev_history_albedo = NULL;
+static glm::vec3* dev_history_normal = NULL;
+static glm::vec3* dev_history_position = NULL;
+static float* dev_history_depth = NULL;
+static int* dev_history_count = NULL;
+static int* dev_history_hits = NULL;
+static bool reproject_pending = false;
+static Camera reproject_camera;
 #endif
+
+// TODO: static variables for device memory, any extra info you need, etc
+//for caching first bounce, allocated the first time the cache is switched on.
+// Layer k holds the camera rays and hits of sample k for every pixel, global
+// sample s reuses layer s % cache_layers whatever the process's sample offset
+// is, so renders of disjoint sample ranges still sum to the single-process one
+static HitBuffers dev_first_hits = {};
+static PathBuffers dev_first_paths = {};
+static int cache_layers = 1;
+// a layer is filled the first time an iteration uses it after init, camera
+// moves and toggling the cache
+static std::vector<bool> first_bounce_cached;
+// sample index of iteration 1, see pathtraceSetSampleOffset
+static int sample_offset = 0;
+// path regeneration keeps paths in flight from one iteration to the next
+static bool wavefront_live = false;
+static int wavefront_paths = 0;  // live slots at the front of dev_active
+static long long next_job = 0;  // job j is sample j / pixelcount of pixel j % pixelcount
+// added to the plain wavefront's sample index. When regeneration stops, the
+// plain wavefront skips every sample it handed out; when it starts again it
+// continues from the plain wavefront's next sample. Neither traces a sample twice.
+static int sample_shift = 0;
+// sample layers the path buffers hold, slot b * pixelcount + p is sample b of pixel p
+static int batch_size = 1;
+// per-material work queues, see countMaterialBins. Bins are ordered by material
+// class so each class's queues are one contiguous range of dev_queue
+static int* dev_material_bin = NULL;  // material id -> bin
+static int* dev_bin_counts = NULL;  // counts, then write cursors
+static int* dev_queue = NULL;  // path slots grouped by bin
+static std::vector<int> bin_offsets;
+static int class_bins[MATERIAL_CLASS_COUNT + 1];  // first bin of each class
+// ray sort keys, see computeSortKeys
+static unsigned int* dev_sort_keys = NULL;  // one per live path, in dev_active order
+static int material_bits = 1;  // key bits taken by the material bin
+static glm::vec3 scene_min;  // Morton grid over the scene bounds
+static glm::vec3 scene_scale;
 //for tiny_obj
 //static Object* dev_objects = NULL;
 static Geom* dev_tinyobj = NULL;
 
-void InitDataContainer(GuiDataContainer* imGuiData)
+// device allocations booked per subsystem for the analytics window
+static std::vector<std::pair<std::string, size_t> > device_memory;
+
+template<typename T>
+static void trackedMalloc(T** ptr, size_t bytes, const char* subsystem) {
+	cudaMalloc(ptr, bytes);
+	for (size_t i = 0; i < device_memory.size(); i++) {
+		if (device_memory[i].first == subsystem) {
+			device_memory[i].second += bytes;
+			return;
+		}
+	}
+	device_memory.push_back(std::make_pair(std::string(subsystem), bytes));
+}
+
+static void allocPathBuffers(PathBuffers& b, int n, const char* subsystem) {
+	trackedMalloc(&b.origin, n * sizeof(glm::vec3), subsystem);
+	trackedMalloc(&b.direction, n * sizeof(glm::vec3), subsystem);
+	trackedMalloc(&b.color, n * sizeof(glm::vec3), subsystem);
+	trackedMalloc(&b.pixelIndex, n * sizeof(int), subsystem);
+	trackedMalloc(&b.remainingBounces, n * sizeof(int), subsystem);
+	trackedMalloc(&b.sample, n * sizeof(int), subsystem);
+}
+
+static void copyPathBuffers(const PathBuffers& dst, const PathBuffers& src, int n) {
+	cudaMemcpy(dst.origin, src.origin, n * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.direction, src.direction, n * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.color, src.color, n * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.pixelIndex, src.pixelIndex, n * sizeof(int), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.remainingBounces, src.remainingBounces, n * sizeof(int), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.sample, src.sample, n * sizeof(int), cudaMemcpyDeviceToDevice);
+}
+
+static void freePathBuffers(PathBuffers& b) {
+	cudaFree(b.origin);
+	cudaFree(b.direction);
+	cudaFree(b.color);
+	cudaFree(b.pixelIndex);
+	cudaFree(b.remainingBounces);
+	cudaFree(b.sample);
+	b = PathBuffers();
+}
+
+static void allocHitBuffers(HitBuffers& b, int n, const char* subsystem) {
+	trackedMalloc(&b.t, n * sizeof(float), subsystem);
+	trackedMalloc(&b.surfaceNormal, n * sizeof(glm::vec3), subsystem);
+	trackedMalloc(&b.materialId, n * sizeof(int), subsystem);
+	trackedMalloc(&b.uv, n * sizeof(glm::vec2), subsystem);
+	trackedMalloc(&b.textureId, n * sizeof(int), subsystem);
+	trackedMalloc(&b.texDensity, n * sizeof(float), subsystem);
+}
+
+static void copyHitBuffers(const HitBuffers& dst, const HitBuffers& src, int n) {
+	cudaMemcpy(dst.t, src.t, n * sizeof(float), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.surfaceNormal, src.surfaceNormal, n * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.materialId, src.materialId, n * sizeof(int), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.uv, src.uv, n * sizeof(glm::vec2), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.textureId, src.textureId, n * sizeof(int), cudaMemcpyDeviceToDevice);
+	cudaMemcpy(dst.texDensity, src.texDensity, n * sizeof(float), cudaMemcpyDeviceToDevice);
+}
+
+static void freeHitBuffers(HitBuffers& b) {
+	cudaFree(b.t);
+	cudaFree(b.surfaceNormal);
+	cudaFree(b.materialId);
+	cudaFree(b.uv);
+	cudaFree(b.textureId);
+	cudaFree(b.texDensity);
+	b = HitBuffers();
+}
+
+void InitDataContainer(GuiDataContainer* imGuiData, const RenderSettings& settings)
 {
 	guiData = imGuiData;
+	guiData->SortMaterial = settings.sortMaterial;
+	guiData->Compaction = settings.compaction;
+	guiData->CacheFirstBounce = settings.cacheFirstBounce;
+	guiData->RegeneratePaths = settings.regeneratePaths;
+	guiData->RaySort = settings.raySort;
+}
+
+// the analytics window can override these four, the scene settings otherwise
+static bool useSortMaterial() {
+	return guiData != NULL ? guiData->SortMaterial : hst_scene->state.settings.sortMaterial;
+}
+
+static bool useCompaction() {
+	return guiData != NULL ? guiData->Compaction : hst_scene->state.settings.compaction;
+}
+
+static int useRaySort() {
+	const int raySort = guiData != NULL ? guiData->RaySort : hst_scene->state.settings.raySort;
+	return raySort >= 0 && raySort < RAY_SORT_COUNT ? raySort : RAY_SORT_NONE;
+}
+
+// pixels end up with different sample counts, only the AOV build keeps those
+static bool useRegeneratePaths() {
+#if AOV_OUTPUT
+	return guiData != NULL ? guiData->RegeneratePaths : hst_scene->state.settings.regeneratePaths;
+#else
+	return false;
+#endif
+}
+
+// jittered camera rays hit something different every iteration, a single
+// cached layer would freeze the jitter, and regenerated paths start in any
+// slot at any bounce
+static bool useCacheFirstBounce() {
+	const RenderSettings& settings = hst_scene->state.settings;
+	const bool jittered = settings.antiAliasing || (settings.depthOfField && hst_scene->state.camera.lensRadius > 0);
+	if ((jittered && cache_layers < 2) || useRegeneratePaths()) {
+		return false;
+	}
+	return guiData != NULL ? guiData->CacheFirstBounce : settings.cacheFirstBounce;
+}
+
+// world bounds of the spheres, cubes and meshes, the ray sort quantizes hit
+// points within them
+static void sceneBounds(const Scene* scene, glm::vec3& lo, glm::vec3& hi) {
+	lo = glm::vec3(FLT_MAX);
+	hi = glm::vec3(-FLT_MAX);
+	for (size_t i = 0; i < scene->geoms.size(); i++) {
+		const Geom& geom = scene->geoms[i];
+		if (geom.type != SPHERE && geom.type != CUBE) {
+			continue;
+		}
+		// both are unit sized around the origin in object space
+		for (int c = 0; c < 8; c++) {
+			glm::vec4 corner(c & 1 ? 0.5f : -0.5f, c & 2 ? 0.5f : -0.5f, c & 4 ? 0.5f : -0.5f, 1.f);
+			glm::vec3 p = glm::vec3(geom.transform * corner);
+			lo = glm::min(lo, p);
+			hi = glm::max(hi, p);
+		}
+	}
+	if (!scene->bvh_nodes_gpu.empty()) {
+		lo = glm::min(lo, scene->bvh_nodes_gpu[0].AABB_min);
+		hi = glm::max(hi, scene->bvh_nodes_gpu[0].AABB_max);
+	}
+	if (lo.x > hi.x) {
+		lo = glm::vec3(0.f);
+		hi = glm::vec3(1.f);
+	}
 }
 
 void pathtraceInit(Scene* scene) {
+	profiler::HostScope scope("device upload");
 	hst_scene = scene;
+	device_memory.clear();
 
 	const Camera& cam = hst_scene->state.camera;
 	const int pixelcount = cam.resolution.x * cam.resolution.y;
 
-	cudaMalloc(&dev_image, pixelcount * sizeof(glm::vec3));
+	trackedMalloc(&dev_image, pixelcount * sizeof(glm::vec3), "image");
 	cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
 
-	cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
+	batch_size = glm::max(scene->state.settings.samplesPerCall, 1);
+	const int path_slots = pixelcount * batch_size;
+	allocPathBuffers(dev_paths, path_slots, "paths");
+	trackedMalloc(&dev_active, path_slots * sizeof(int), "paths");
 
-	cudaMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom));
+	trackedMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom), "scene");
 	cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
 
-	cudaMalloc(&dev_materials, scene->materials.size() * sizeof(Material));
+	trackedMalloc(&dev_materials, scene->materials.size() * sizeof(Material), "scene");
 	cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
 
-	cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
-	cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+	allocHitBuffers(dev_hits, path_slots, "paths");
+
+	const int num_materials = scene->materials.size();
+	std::vector<int> material_bin(num_materials);
+	int bin = 0;
+	for (int c = 0; c < MATERIAL_CLASS_COUNT; c++) {
+		class_bins[c] = bin;
+		for (int m = 0; m < num_materials; m++) {
+			if (materialClass(scene->materials[m]) == c) {
+				material_bin[m] = bin++;
+			}
+		}
+	}
+	class_bins[MATERIAL_CLASS_COUNT] = bin;
+	bin_offsets.resize(num_materials + 1);
+	trackedMalloc(&dev_material_bin, num_materials * sizeof(int), "material queues");
+	cudaMemcpy(dev_material_bin, material_bin.data(), num_materials * sizeof(int), cudaMemcpyHostToDevice);
+	trackedMalloc(&dev_bin_counts, num_materials * sizeof(int), "material queues");
+	trackedMalloc(&dev_queue, path_slots * sizeof(int), "material queues");
+
+	trackedMalloc(&dev_sort_keys, path_slots * sizeof(unsigned int), "ray sort");
+	material_bits = 1;
+	while (material_bits < 24 && (1 << material_bits) < num_materials) {
+		material_bits++;
+	}
+	glm::vec3 scene_max;
+	sceneBounds(scene, scene_min, scene_max);
+	scene_scale = 1.f / glm::max(scene_max - scene_min, glm::vec3(1e-6f));
 
 	// TODO: initialize any extra device memeory you need
-#if CACHE_FIRST_BOUNCE
-	cudaMalloc(&dev_firstBounce, pixelcount * sizeof(ShadeableIntersection));
-	cudaMemset(dev_firstBounce, 0, pixelcount * sizeof(ShadeableIntersection));
-	cudaMalloc(&dev_first_paths, pixelcount * sizeof(PathSegment));	
-#endif
-	cudaMalloc(&dev_tinyobj, scene->Obj_geoms.size() * sizeof(Geom));
+	cache_layers = glm::max(scene->state.settings.firstBounceSamples, 1);
+	first_bounce_cached.assign(cache_layers, false);
+	wavefront_live = false;
+	next_job = 0;
+	sample_shift = 0;
+	trackedMalloc(&dev_tinyobj, scene->Obj_geoms.size() * sizeof(Geom), "scene");
 	cudaMemcpy(dev_tinyobj, scene->Obj_geoms.data(), scene->Obj_geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
 
 
 	//BVH
-	cudaMalloc(&dev_tris, scene->num_tris * sizeof(Tri));
+	trackedMalloc(&dev_tris, scene->num_tris * sizeof(Tri), "bvh");
 	cudaMemcpy(dev_tris, scene->mesh_tris_sorted.data(), scene->num_tris * sizeof(Tri), cudaMemcpyHostToDevice);
 
-	cudaMalloc(&dev_bvh_nodes, scene->bvh_nodes_gpu.size() * sizeof(BVHNode_GPU));
+	trackedMalloc(&dev_bvh_nodes, scene->bvh_nodes_gpu.size() * sizeof(BVHNode_GPU), "bvh");
 	cudaMemcpy(dev_bvh_nodes, scene->bvh_nodes_gpu.data(), scene->bvh_nodes_gpu.size() * sizeof(BVHNode_GPU), cudaMemcpyHostToDevice);
 
+	//textures
+	trackedMalloc(&dev_textures, scene->textures.descs.size() * sizeof(TextureDesc), "textures");
+	cudaMemcpy(dev_textures, scene->textures.descs.data(), scene->textures.descs.size() * sizeof(TextureDesc), cudaMemcpyHostToDevice);
+
+	trackedMalloc(&dev_texture_pixels, scene->textures.pixels.size(), "textures");
+	cudaMemcpy(dev_texture_pixels, scene->textures.pixels.data(), scene->textures.pixels.size(), cudaMemcpyHostToDevice);
+
+#if AOV_OUTPUT
+	trackedMalloc(&dev_albedo, pixelcount * sizeof(glm::vec3), "aovs");
+	cudaMemset(dev_albedo, 0, pixelcount * sizeof(glm::vec3));
+	trackedMalloc(&dev_normal, pixelcount * sizeof(glm::vec3), "aovs");
+	cudaMemset(dev_normal, 0, pixelcount * sizeof(glm::vec3));
+	trackedMalloc(&dev_position, pixelcount * sizeof(glm::vec3), "aovs");
+	cudaMemset(dev_position, 0, pixelcount * sizeof(glm::vec3));
+	trackedMalloc(&dev_depth, pixelcount * sizeof(float), "aovs");
+	cudaMemset(dev_depth, 0, pixelcount * sizeof(float));
+	trackedMalloc(&dev_sample_count, pixelcount * sizeof(int), "aovs");
+	cudaMemset(dev_sample_count, 0, pixelcount * sizeof(int));
+	trackedMalloc(&dev_hit_count, pixelcount * sizeof(int), "aovs");
+	cudaMemset(dev_hit_count, 0, pixelcount * sizeof(int));
+#endif
+#if CONVERGENCE_STATS
+	trackedMalloc(&dev_luminance_sq, pixelcount * sizeof(float), "image");
+	cudaMemset(dev_luminance_sq, 0, pixelcount * sizeof(float));
+#endif
+#if RAY_STATS
+	trackedMalloc(&dev_ray_stats, sizeof(RayStats), "ray stats");
+	memset(&ray_stats, 0, sizeof(RayStats));
+#endif
+#if TEMPORAL_REPROJECTION
+	trackedMalloc(&dev_history_image, pixelcount * sizeof(glm::vec3), "history");
+	trackedMalloc(&dev_history_albedo, pixelcount * sizeof(glm::vec3), "history");
+	trackedMalloc(&dev_history_normal, pixelcount * sizeof(glm::vec3), "history");
+	trackedMalloc(&dev_history_position, pixelcount * sizeof(glm::vec3), "history");
+	trackedMalloc(&dev_history_depth, pixelcount * sizeof(float), "history");
+	trackedMalloc(&dev_history_count, pixelcount * sizeof(int), "history");
+	trackedMalloc(&dev_history_hits, pixelcount * sizeof(int), "history");
+	reproject_pending = false;
+#endif
+
 
 
 
@@ -152,15 +467,18 @@ void pathtraceInit(Scene* scene) {
 
 void pathtraceFree() {
 	cudaFree(dev_image);  // no-op if dev_image is null
-	cudaFree(dev_paths);
+	freePathBuffers(dev_paths);
+	cudaFree(dev_active);
 	cudaFree(dev_geoms);
 	cudaFree(dev_materials);
-	cudaFree(dev_intersections);
+	freeHitBuffers(dev_hits);
+	cudaFree(dev_material_bin);
+	cudaFree(dev_bin_counts);
+	cudaFree(dev_queue);
+	cudaFree(dev_sort_keys);
 	// TODO: clean up any extra device memory you created
-#if CACHE_FIRST_BOUNCE
-	cudaFree(dev_firstBounce);
-	cudaFree(dev_first_paths);
-#endif
+	freeHitBuffers(dev_first_hits);
+	freePathBuffers(dev_first_paths);
 	cudaFree(dev_tinyobj);
 
 
@@ -168,6 +486,34 @@ void pathtraceFree() {
 	cudaFree(dev_tris);
 	cudaFree(dev_bvh_nodes);
 
+	//textures
+	cudaFree(dev_textures);
+	cudaFree(dev_texture_pixels);
+
+#if AOV_OUTPUT
+	cudaFree(dev_albedo);
+	cudaFree(dev_normal);
+	cudaFree(dev_position);
+	cudaFree(dev_depth);
+	cudaFree(dev_sample_count);
+	cudaFree(dev_hit_count);
+#endif
+#if CONVERGENCE_STATS
+	cudaFree(dev_luminance_sq);
+#endif
+#if RAY_STATS
+	cudaFree(dev_ray_stats);
+#endif
+#if TEMPORAL_REPROJECTION
+	cudaFree(dev_history_image);
+	cudaFree(dev_history_albedo);
+	cudaFree(dev_history_normal);
+	cudaFree(dev_history_position);
+	cudaFree(dev_history_depth);
+	cudaFree(dev_history_count);
+	cudaFree(dev_history_hits);
+#endif
+
 	checkCUDAError("pathtraceFree");
 }
 
@@ -200,64 +546,127 @@ glm::vec2 ConcentricSampleDisk(const glm::vec2 &u)
 * motion blur - jitter rays "in time"
 * lens effect - jitter ray origin positions based on a lens
 */
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+template<bool AntiAliasing, bool DepthOfField>
+__device__ PathSegment cameraPath(const Camera& cam, int x, int y, int sample, int traceDepth)
 {
-	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+	int index = x + (y * cam.resolution.x);
+	PathSegment segment;
 
+	segment.ray.origin = cam.position;
+	segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
 
 	float jitter_x = 0.f, jitter_y = 0.f;
-#if ANTI_ALIASING
-	if (x < cam.resolution.x && y < cam.resolution.y) {
-		int index = x + (y * cam.resolution.x);
-		PathSegment& segment = pathSegments[index];
-
-		segment.ray.origin = cam.position;
-		segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
-		
-		thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, 0);
+	if (AntiAliasing) {
+		thrust::default_random_engine rng = makeSeededRandomEngine(sample, index, 0, RNG_PIXEL_JITTER);
 		thrust::uniform_real_distribution<float> u(-0.5, 0.5);
 		jitter_x = u(rng);
 		jitter_y = u(rng);
+	}
 
-		// TODO: implement antialiasing by jittering the ray
-		segment.ray.direction = glm::normalize(cam.view
-			- cam.right * cam.pixelLength.x * ((float)x + jitter_x - (float)cam.resolution.x * 0.5f)
-			- cam.up * cam.pixelLength.y * ((float)y + jitter_y - (float)cam.resolution.y * 0.5f)
-		);
-#else
-	if (x < cam.resolution.x && y < cam.resolution.y) {
-		int index = x + (y * cam.resolution.x);
-		PathSegment& segment = pathSegments[index];
+	segment.ray.direction = glm::normalize(cam.view
+		- cam.right * cam.pixelLength.x * ((float)x + jitter_x - (float)cam.resolution.x * 0.5f)
+		- cam.up * cam.pixelLength.y * ((float)y + jitter_y - (float)cam.resolution.y * 0.5f)
+	);
+
+	//adapted from pbrt
+	if (DepthOfField) {
+		thrust::default_random_engine rng = makeSeededRandomEngine(sample, index, 0, RNG_LENS);
+		thrust::uniform_real_distribution<float> u101(0, 1);
+		thrust::uniform_real_distribution<float> u201(0, 1);
+		glm::vec2 rand(u101(rng), u201(rng));
+		glm::vec2 pLens = cam.lensRadius * ConcentricSampleDisk(rand);
+		float ft = cam.focalDistance / -segment.ray.direction.z;
+		glm::vec3 pFocus = ft * segment.ray.direction;
+
+		segment.ray.origin += glm::vec3(pLens.x, pLens.y, 0);
+		segment.ray.direction = glm::normalize(pFocus - glm::vec3(pLens.x, pLens.y, 0));
+	}
+	segment.pixelIndex = index;
+	segment.remainingBounces = traceDepth;
+	segment.sample = sample;
+	return segment;
+}
 
-		segment.ray.origin = cam.position;
-		segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+// blockIdx.z is the sample layer of a batch, layer b traces sample + b
+template<bool AntiAliasing, bool DepthOfField>
+__global__ void generateRayFromCamera(Camera cam, int sample, int traceDepth, PathBuffers pathSegments)
+{
+	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+	int layer = blockIdx.z;
 
-		// TODO: implement antialiasing by jittering the ray
-		segment.ray.direction = glm::normalize(cam.view
-			- cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
-			- cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f)
-		);
-#endif
+	if (x < cam.resolution.x && y < cam.resolution.y) {
+		pathSegments.store(layer * cam.resolution.x * cam.resolution.y + x + (y * cam.resolution.x),
+			cameraPath<AntiAliasing, DepthOfField>(cam, x, y, sample + layer, traceDepth));
+	}
+}
 
-#if DEPTH_OF_FIELD
-		//adapted from pbrt
-		if (cam.lensRadius > 0) {
-			thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, 0);
-			thrust::uniform_real_distribution<float> u101(0, 1);
-			thrust::uniform_real_distribution<float> u201(0, 1);
-			glm::vec2 rand(u101(rng), u201(rng));
-			glm::vec2 pLens = cam.lensRadius * ConcentricSampleDisk(rand);
-			float ft = cam.focalDistance / -segment.ray.direction.z;
-			glm::vec3 pFocus = ft * segment.ray.direction;
+/**
+ * Starts camera paths in the free slots of a regenerating wavefront. Jobs are
+ * handed out in pixel order, so neighbouring slots get neighbouring pixels,
+ * and a pixel's next sample only starts after every other pixel got one.
+ */
+template<bool AntiAliasing, bool DepthOfField>
+__global__ void regeneratePaths(Camera cam, int count, const int* freeSlots, long long firstJob, int sampleOffset,
+	int traceDepth, PathBuffers pathSegments)
+{
+	int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (i < count) {
+		const int pixelcount = cam.resolution.x * cam.resolution.y;
+		const long long job = firstJob + i;
+		const int index = (int)(job % pixelcount);
+		const int sample = sampleOffset + (int)(job / pixelcount);
+		pathSegments.store(freeSlots[i],
+			cameraPath<AntiAliasing, DepthOfField>(cam, index % cam.resolution.x, index / cam.resolution.x, sample, traceDepth));
+	}
+}
 
-			segment.ray.origin += glm::vec3(pLens.x, pLens.y, 0);
-			segment.ray.direction = glm::normalize(pFocus - glm::vec3(pLens.x, pLens.y, 0));
+// picks the instantiation for the enabled camera features
+static void launchGenerateRays(const RenderSettings& settings, dim3 blocks, dim3 threads,
+	const Camera& cam, int sample, int traceDepth, const PathBuffers& paths)
+{
+	const bool lens = settings.depthOfField && cam.lensRadius > 0;
+	if (settings.antiAliasing) {
+		if (lens) {
+			generateRayFromCamera<true, true> << <blocks, threads >> > (cam, sample, traceDepth, paths);
+		}
+		else {
+			generateRayFromCamera<true, false> << <blocks, threads >> > (cam, sample, traceDepth, paths);
+		}
+	}
+	else {
+		if (lens) {
+			generateRayFromCamera<false, true> << <blocks, threads >> > (cam, sample, traceDepth, paths);
+		}
+		else {
+			generateRayFromCamera<false, false> << <blocks, threads >> > (cam, sample, traceDepth, paths);
+		}
+	}
+	checkCUDAError("generate camera ray");
+}
+
+static void launchRegeneratePaths(const RenderSettings& settings, int blockSize, const Camera& cam, int count,
+	const int* freeSlots, long long firstJob, int traceDepth, const PathBuffers& paths)
+{
+	const bool lens = settings.depthOfField && cam.lensRadius > 0;
+	dim3 blocks = (count + blockSize - 1) / blockSize;
+	if (settings.antiAliasing) {
+		if (lens) {
+			regeneratePaths<true, true> << <blocks, blockSize >> > (cam, count, freeSlots, firstJob, sample_offset, traceDepth, paths);
+		}
+		else {
+			regeneratePaths<true, false> << <blocks, blockSize >> > (cam, count, freeSlots, firstJob, sample_offset, traceDepth, paths);
+		}
+	}
+	else {
+		if (lens) {
+			regeneratePaths<false, true> << <blocks, blockSize >> > (cam, count, freeSlots, firstJob, sample_offset, traceDepth, paths);
+		}
+		else {
+			regeneratePaths<false, false> << <blocks, blockSize >> > (cam, count, freeSlots, firstJob, sample_offset, traceDepth, paths);
 		}
-#endif
-		segment.pixelIndex = index;
-		segment.remainingBounces = traceDepth;
 	}
+	checkCUDAError("regenerate paths");
 }
 
 // TODO:
@@ -267,20 +676,24 @@ __global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, Path
 __global__ void computeIntersections(
 	int depth,
 	int num_paths,
-	PathSegment* pathSegments,
+	const int* activePaths,
+	PathBuffers pathSegments,
 	Geom* geoms,
 	int geoms_size,
 	Geom* triangles,
 	int triangle_size,
-	ShadeableIntersection* intersections,
-	int iter
+	HitBuffers intersections,
+	int iter,
+	bool meshBoundingBox
 )
 {
-	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
 
-	if (path_index < num_paths)
+	if (idx < num_paths)
 	{
-		PathSegment pathSegment = pathSegments[path_index];
+		const int path_index = activePaths[idx];
+		PathSegment pathSegment;
+		pathSegment.ray = pathSegments.ray(path_index);
 
 		float t;
 		glm::vec3 intersect_point;
@@ -317,14 +730,8 @@ __global__ void computeIntersections(
 				t = triangleIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, tmp_uv, outside);
 			}
 			else if (geom.type == MESH) {
-#if BOUNDING_BOX
-				t = meshIntersectionTest(geom, pathSegment.ray, triangles, triangle_size, true,
-					tmp_intersect, tmp_normal, tmp_uv, outside);
-#else 
-				t = meshIntersectionTest(geom, pathSegment.ray, triangles, triangle_size, false,
+				t = meshIntersectionTest(geom, pathSegment.ray, triangles, triangle_size, meshBoundingBox,
 					tmp_intersect, tmp_normal, tmp_uv, outside);
-#endif 
-
 			}
 			// Compute the minimum t from the intersection tests to determine what
 			// scene geometry object was hit first.
@@ -342,38 +749,83 @@ __global__ void computeIntersections(
 
 		if (hit_geom_index == -1)
 		{
-			intersections[path_index].t = -1.0f;
+			intersections.t[path_index] = -1.0f;
 		}
 		else
 		{
 			//The ray hits something
-			intersections[path_index].t = t_min;
-			intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-			intersections[path_index].surfaceNormal = normal;
-			intersections[path_index].uv = uv;
+			intersections.t[path_index] = t_min;
+			intersections.materialId[path_index] = geoms[hit_geom_index].materialid;
+			intersections.surfaceNormal[path_index] = normal;
+			intersections.uv[path_index] = uv;
+			intersections.textureId[path_index] = -1;
+			intersections.texDensity[path_index] = 0.f;
 
 		}
 	}
 }
 
+#if RAY_STATS
+__device__ unsigned int warpSum(unsigned int v) {
+	for (int offset = 16; offset > 0; offset /= 2) {
+		v += __shfl_down_sync(0xffffffff, v, offset);
+	}
+	return v;
+}
+
+// floor(log2(v + 1)), so bin 0 holds zero visits
+__device__ int statsBin(int v) {
+	return min(31 - __clz(v + 1), RAY_STATS_BINS - 1);
+}
+
+/**
+ * Sums the per-ray counters over the warp so only lane 0 touches the global
+ * totals. Every lane of the warp has to call this, including those without a path.
+ */
+__device__ void recordRayStats(RayStats* stats, int depth, bool active, bool hit, int nodes, int triangles, int prims) {
+	unsigned int warpHits = warpSum(hit ? 1 : 0);
+	unsigned int warpNodes = warpSum(nodes);
+	unsigned int warpTriangles = warpSum(triangles);
+	unsigned int warpPrims = warpSum(prims);
+	if ((threadIdx.x & 31) == 0) {
+		atomicAdd(&stats->hits[min(depth, RAY_STATS_MAX_DEPTH - 1)], (unsigned long long)warpHits);
+		atomicAdd(&stats->nodesVisited, (unsigned long long)warpNodes);
+		atomicAdd(&stats->triangleTests, (unsigned long long)warpTriangles);
+		atomicAdd(&stats->primitiveTests, (unsigned long long)warpPrims);
+	}
+	if (active) {
+		atomicAdd(&stats->nodeHistogram[statsBin(nodes)], 1u);
+		atomicAdd(&stats->triangleHistogram[statsBin(triangles)], 1u);
+	}
+}
+#endif
+
 __global__ void computeIntersections(
 	int depth
 	, int num_paths
-	, PathSegment* pathSegments
+	, const int* activePaths
+	, PathBuffers pathSegments
 	, Geom* geoms
 	, int geoms_size
 	, Tri* tris
 	, int tris_size
-	, ShadeableIntersection* intersections
+	, HitBuffers intersections
 	, BVHNode_GPU* bvh_nodes
+	, RayStats* stats
 )
 {
-	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+#if RAY_STATS
+	int stat_nodes = 0;
+	int stat_triangles = 0;
+	int stat_prims = 0;
+	bool stat_hit = false;
+#endif
 
-	if (path_index < num_paths)
+	if (idx < num_paths)
 	{
-
-		Ray r = pathSegments[path_index].ray;
+		const int path_index = activePaths[idx];
+		Ray r = pathSegments.ray(path_index);
 
 		ShadeableIntersection isect;
 		isect.t = MAX_INTERSECT_DIST;
@@ -391,165 +843,112 @@ __global__ void computeIntersections(
 		glm::vec2 uv = glm::vec2(-1, -1);
 		float t_min = FLT_MAX;
 		int hit_geom_index = -1;
+		int hit_texture = -1;
+		float hit_tex_density = 0.f;
 
-		if (tris_size != 0) 
+		if (tris_size != 0)
 		{
-			int stack_pointer = 0;
-			int cur_node_index = 0;
-			int node_stack[128];
-			BVHNode_GPU cur_node;
-			glm::vec3 P;
 			glm::vec3 s;
-			float t1;
-			float t2;
-			float tmin;
-			float tmax;
-			while (true) 
-			{
-				cur_node = bvh_nodes[cur_node_index];
-				auto invDir = 1.f / r.direction;
-				// (ray-aabb test node)
-				t1 = (cur_node.AABB_min.x - r.origin.x) * invDir.x;
-				t2 = (cur_node.AABB_max.x - r.origin.x) * invDir.x;
-				tmin = glm::min(t1, t2);
-				tmax = glm::max(t1, t2);
-				t1 = (cur_node.AABB_min.y - r.origin.y) * invDir.y;
-				t2 = (cur_node.AABB_max.y - r.origin.y) * invDir.y;
-				tmin = glm::max(tmin, glm::min(t1, t2));
-				tmax = glm::min(tmax, glm::max(t1, t2));
-				t1 = (cur_node.AABB_min.z - r.origin.z) * invDir.z;
-				t2 = (cur_node.AABB_max.z - r.origin.z) * invDir.z;
-				tmin = glm::max(tmin, glm::min(t1, t2));
-				tmax = glm::min(tmax, glm::max(t1, t2));
-				if (tmax >= tmin) {
-					// we intersected AABB
-					if (cur_node.tri_index != -1) {
-						// this is leaf node
-						// triangle intersection test
-						Tri tri = tris[cur_node.tri_index];
-						
-						//t = triangleIntersectionTest(tri, r, tmp_intersect, tmp_normal, tmp_uv, outside);
-
-
-						t = glm::dot(tri.plane_normal, (tri.p0 - r.origin)) / glm::dot(tri.plane_normal, r.direction);
-						if (t >= -0.0001f) {
-							P = r.origin + t * r.direction;
-							// barycentric coords
-							s = glm::vec3(glm::length(glm::cross(P - tri.p1, P - tri.p2)),
-								glm::length(glm::cross(P - tri.p2, P - tri.p0)),
-								glm::length(glm::cross(P - tri.p0, P - tri.p1))) / tri.S;
-
-							if (s.x >= -0.0001f && s.x <= 1.0001f && s.y >= -0.0001f && s.y <= 1.0001f &&
-								s.z >= -0.0001f && s.z <= 1.0001f && (s.x + s.y + s.z <= 1.0001f) && (s.x + s.y + s.z >= -0.0001f) && t_min > t) {
-								t_min = t;
-								hit_geom_index = 2;
-								normal = glm::normalize(s.x * tri.n0 + s.y * tri.n1 + s.z * tri.n2);
-							}
-						}
+			int bvh_nodes_visited = 0;
+			int bvh_triangle_tests = 0;
+			int tri_index = bvhIntersect(r, tris, bvh_nodes, t_min, s, bvh_nodes_visited, bvh_triangle_tests);
+#if RAY_STATS
+			stat_nodes += bvh_nodes_visited;
+			stat_triangles += bvh_triangle_tests;
+#endif
+			if (tri_index != -1) {
+				const Tri& tri = tris[tri_index];
+				hit_geom_index = 2;
+				normal = glm::normalize(s.x * tri.n0 + s.y * tri.n1 + s.z * tri.n2);
+				uv = s.x * tri.t0 + s.y * tri.t1 + s.z * tri.t2;
+				hit_texture = tri.tex_ID;
+				hit_tex_density = tri.uv_density;
+			}
+		}
 
 
-						/*if (t > 0.0f && t_min > t)
-						{
-							t_min = t;
-							hit_geom_index = 0;
-							intersect_point = tmp_intersect;
-							normal = tmp_normal;
-							uv = tmp_uv;
-						}*/
+		for (int i = 0; i < geoms_size; ++i)
+		{
+			Geom& geom = geoms[i];
+#if RAY_STATS
+			stat_prims++;
+#endif
 
-						// if last node in tree, we are done
-						if (stack_pointer == 0) {
-							break;
-						}
-						// otherwise need to check rest of the things in the stack
-						stack_pointer--;
-						cur_node_index = node_stack[stack_pointer];
-					}
-					else {
-						node_stack[stack_pointer] = cur_node.offset_to_second_child;
-						stack_pointer++;
-						cur_node_index++;
-					}
-				}
-				else {
-					// didn't intersect AABB, remove from stack
-					if (stack_pointer == 0) {
-						break;
-					}
-					stack_pointer--;
-					cur_node_index = node_stack[stack_pointer];
-				}
+			if (geom.type == CUBE)
+			{
+				t = boxIntersectionTest(geom, r, tmp_intersect, tmp_normal, outside);
 			}
-
-
-			for (int i = 0; i < geoms_size; ++i)
+			else if (geom.type == SPHERE)
 			{
-				Geom& geom = geoms[i];
+				t = sphereIntersectionTest(geom, r, tmp_intersect, tmp_normal, outside);
 
-				if (geom.type == CUBE)
-				{
-					t = boxIntersectionTest(geom, r, tmp_intersect, tmp_normal, outside);
-				}
-				else if (geom.type == SPHERE)
-				{
-					t = sphereIntersectionTest(geom, r, tmp_intersect, tmp_normal, outside);
-
-				}
-				// TODO: add more intersection tests here... triangle? metaball? CSG?
-				//else if (geom.type == TRIANGLE) {
-				//	t = triangleIntersectionTest(geom, r, tmp_intersect, tmp_normal, tmp_uv, outside);
-				//}
+			}
+			// TODO: add more intersection tests here... triangle? metaball? CSG?
+			//else if (geom.type == TRIANGLE) {
+			//	t = triangleIntersectionTest(geom, r, tmp_intersect, tmp_normal, tmp_uv, outside);
+			//}
 
-				if (t > 0.0f && t_min > t)
-				{
-					t_min = t;
-					hit_geom_index = i;
-					intersect_point = tmp_intersect;
-					normal = tmp_normal;
+			if (t > 0.0f && t_min > t)
+			{
+				t_min = t;
+				hit_geom_index = i;
+				intersect_point = tmp_intersect;
+				normal = tmp_normal;
 
 
-					uv = tmp_uv;
-				}
+				uv = tmp_uv;
+				hit_texture = -1;
+			}
 
-				//if (depth == 0 && glm::dot(tmp_normal, r.direction) > 0.0) {
-				//	continue;
-				//}
-				//else if (t > 0.0f && isect.t > t) {
-				//	obj_ID = i;
-				//	isect.t = t;
-				//	isect.materialId = geom.materialid;
-				//	isect.surfaceNormal = tmp_normal;
-				//}
+			//if (depth == 0 && glm::dot(tmp_normal, r.direction) > 0.0) {
+			//	continue;
+			//}
+			//else if (t > 0.0f && isect.t > t) {
+			//	obj_ID = i;
+			//	isect.t = t;
+			//	isect.materialId = geom.materialid;
+			//	isect.surfaceNormal = tmp_normal;
+			//}
 
-			}
+		}
 
-			if (hit_geom_index == -1)
-			{
-				intersections[path_index].t = -1.0f;
-			}
+		if (hit_geom_index == -1)
+		{
+			intersections.t[path_index] = -1.0f;
+		}
+		else
+		{
+			//The ray hits something
+#if RAY_STATS
+			stat_hit = true;
+#endif
+			intersections.t[path_index] = t_min;
+			if (hit_geom_index >= geoms_size)
+				intersections.materialId[path_index] = 1;
 			else
-			{
-				//The ray hits something
-				intersections[path_index].t = t_min;
-				if (hit_geom_index >= geoms_size)
-					intersections[path_index].materialId = 1;
-				else
-					intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-				intersections[path_index].surfaceNormal = normal;
-				intersections[path_index].uv = uv;
+				intersections.materialId[path_index] = geoms[hit_geom_index].materialid;
+			intersections.surfaceNormal[path_index] = normal;
+			intersections.uv[path_index] = uv;
+			intersections.textureId[path_index] = hit_texture;
+			intersections.texDensity[path_index] = hit_tex_density;
 
-			}
+		}
 
 
-			//if (isect.t >= MAX_INTERSECT_DIST) {
-			//	// hits nothing
-			//	pathSegments[path_index].remainingBounces = 0;
-			//}
-			//else {
-			//	intersections[path_index] = isect;
-			//}
-		}
+		//if (isect.t >= MAX_INTERSECT_DIST) {
+		//	// hits nothing
+		//	pathSegments[path_index].remainingBounces = 0;
+		//}
+		//else {
+		//	intersections[path_index] = isect;
+		//}
 	}
+
+#if RAY_STATS
+	if (stats != NULL) {
+		recordRayStats(stats, depth, idx < num_paths, stat_hit, stat_nodes, stat_triangles, stat_prims);
+	}
+#endif
 }
 
 
@@ -567,20 +966,20 @@ __global__ void computeIntersections(
 __global__ void shadeFakeMaterial(
 	int iter
 	, int num_paths
-	, ShadeableIntersection* shadeableIntersections
-	, PathSegment* pathSegments
+	, HitBuffers shadeableIntersections
+	, PathBuffers pathSegments
 	, Material* materials
 )
 {
 	int idx = blockIdx.x * blockDim.x + threadIdx.x;
 	if (idx < num_paths)
 	{
-		ShadeableIntersection intersection = shadeableIntersections[idx];
+		ShadeableIntersection intersection = shadeableIntersections.load(idx);
 		if (intersection.t > 0.0f) { // if the intersection exists...
 		  // Set up the RNG
 		  // LOOK: this is how you use thrust's RNG! Please look at
 		  // makeSeededRandomEngine as well.
-			thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
+			thrust::default_random_engine rng = makeSeededRandomEngine(iter, pathSegments.pixelIndex[idx], 0, RNG_SCATTER);
 			thrust::uniform_real_distribution<float> u01(0, 1);
 
 			Material material = materials[intersection.materialId];
@@ -588,15 +987,15 @@ __global__ void shadeFakeMaterial(
 
 			// If the material indicates that the object was a light, "light" the ray
 			if (material.emittance > 0.0f) {
-				pathSegments[idx].color *= (materialColor * material.emittance);
+				pathSegments.color[idx] *= (materialColor * material.emittance);
 			}
 			// Otherwise, do some pseudo-lighting computation. This is actually more
 			// like what you would expect from shading in a rasterizer like OpenGL.
 			// TODO: replace this! you should be able to start with basically a one-liner
 			else {
 				float lightTerm = glm::dot(intersection.surfaceNormal, glm::vec3(0.0f, 1.0f, 0.0f));
-				pathSegments[idx].color *= (materialColor * lightTerm) * 0.3f + ((1.0f - intersection.t * 0.02f) * materialColor) * 0.7f;
-				pathSegments[idx].color *= u01(rng); // apply some noise because why not
+				pathSegments.color[idx] *= (materialColor * lightTerm) * 0.3f + ((1.0f - intersection.t * 0.02f) * materialColor) * 0.7f;
+				pathSegments.color[idx] *= u01(rng); // apply some noise because why not
 			}
 			// If there was no intersection, color the ray black.
 			// Lots of renderers use 4 channel color, RGBA, where A = alpha, often
@@ -604,7 +1003,7 @@ __global__ void shadeFakeMaterial(
 			// This can be useful for post-processing and image compositing.
 		}
 		else {
-			pathSegments[idx].color = glm::vec3(0.0f);
+			pathSegments.color[idx] = glm::vec3(0.0f);
 		}
 	}
 }
@@ -650,117 +1049,595 @@ __global__ void shadeFakeMaterial(
 //	}
 //}
 
+// Shades one path that hit something. Class is a MaterialClass, the queue
+// kernels pass the class of their material so the other branches compile out.
+template<int Class, bool DirectLighting>
+__device__ void shadeHit(
+	int traceDepth,
+	ShadeableIntersection& intersection,
+	PathSegment& ps,
+	const Material& material,
+	glm::vec3 camPos,
+	TextureDesc* textures,
+	unsigned char* texturePixels,
+	float pixelSpread)
+{
+	// paths of one wavefront can be at different bounces when they are regenerated,
+	// the count from 1 matches the depth loop in pathtrace()
+	const int bounce = traceDepth - ps.remainingBounces + 1;
+	thrust::default_random_engine rng = makeSeededRandomEngine(ps.sample, ps.pixelIndex, bounce, RNG_SCATTER);
+	thrust::uniform_real_distribution<float> u01(0, 1);
+
+	glm::vec3 materialColor = material.color;
+
+	if (Class == MATERIAL_EMISSIVE || (Class == MATERIAL_ANY && material.emittance > 0.0f)) {
+		ps.remainingBounces = 0;
+		ps.color *= (materialColor * material.emittance);
+	}
+
+	else {
+		if (DirectLighting && ps.remainingBounces == 1) {
+			//hardcode 2 lights, and randomly get 0/1
+			thrust::uniform_real_distribution<float> u02(0, 2);
+
+			thrust::uniform_real_distribution<float> u1(0, 3);
+			//thrust::uniform_real_distribution<float> u2(0, 3);
+			glm::vec3 lightPos = glm::vec3(0,10,0);
+			int whichlight = int(u02(rng));
+			if (whichlight == 0) {
+				float x = u1(rng);
+				float z = u1(rng);
+				lightPos.x = x;
+				lightPos.z = z;
+			}
+			else {
+				float y = u1(rng);
+				float z = u1(rng);
+				lightPos.x = 0;
+				lightPos.y = y;
+				lightPos.z = z;
+			}
+
+			glm::vec3 intersect = getPointOnRay(ps.ray, intersection.t);
+			Ray r;
+			r.origin = intersect;
+			r.direction = glm::normalize(lightPos - intersect);
+			ps.ray = r;
+			ps.color *= material.color;
+			ps.remainingBounces--;
+		}
+		else {
+			scatterRay<Class>(ps, intersection, material, rng, camPos, textures, texturePixels, pixelSpread);
+			ps.remainingBounces--;
+		}
+	}
+}
+
+template<bool DirectLighting>
 __global__ void kernSimpleShade(
-	int iter,
+	int traceDepth,
 	int num_paths,
-	int depth,
-	ShadeableIntersection* shadeableIntersections,
-	PathSegment* pathSegments,
+	const int* activePaths,
+	HitBuffers shadeableIntersections,
+	PathBuffers pathSegments,
 	Material* materials,
-	glm::vec3 camPos)
+	glm::vec3 camPos,
+	TextureDesc* textures,
+	unsigned char* texturePixels,
+	float pixelSpread)
 {
 	int idx = blockIdx.x * blockDim.x + threadIdx.x;
 	if (idx < num_paths)
 	{
-		ShadeableIntersection& intersection = shadeableIntersections[idx];
-		PathSegment& ps = pathSegments[idx];
-		if (ps.remainingBounces <= 0) return;
+		const int p = activePaths[idx];
+		if (pathSegments.remainingBounces[p] <= 0) return;
+
+		if (shadeableIntersections.t[p] > 0.0f) { // if the intersection exists...
+			ShadeableIntersection intersection = shadeableIntersections.load(p);
+			PathSegment ps = pathSegments.load(p);
+			shadeHit<MATERIAL_ANY, DirectLighting>(traceDepth, intersection, ps, materials[intersection.materialId],
+				camPos, textures, texturePixels, pixelSpread);
+			pathSegments.store(p, ps);
+		}
+		else {
+			pathSegments.remainingBounces[p] = 0;
+			pathSegments.color[p] = glm::vec3(0);
+		}
+	}
+}
 
-		if (intersection.t > 0.0f) { // if the intersection exists...
-			thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, depth);
-			thrust::uniform_real_distribution<float> u01(0, 1);
+/**
+ * First half of the material binning: misses are terminated here, like
+ * kernSimpleShade does, and every other live path is counted in the bin of
+ * its material. Counts go through shared memory unless there are more than
+ * MATERIAL_QUEUE_SHARED_BINS bins.
+ */
+__global__ void countMaterialBins(
+	int num_paths,
+	const int* activePaths,
+	HitBuffers intersections,
+	PathBuffers pathSegments,
+	const int* materialBin,
+	int numBins,
+	int* binCounts)
+{
+	extern __shared__ int blockCounts[];
+	const bool shared = numBins <= MATERIAL_QUEUE_SHARED_BINS;
+	if (shared) {
+		for (int b = threadIdx.x; b < numBins; b += blockDim.x) {
+			blockCounts[b] = 0;
+		}
+		__syncthreads();
+	}
 
-			Material& material = materials[intersection.materialId];
-			glm::vec3 materialColor = material.color;
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx < num_paths) {
+		const int p = activePaths[idx];
+		if (pathSegments.remainingBounces[p] > 0) {
+			if (intersections.t[p] > 0.0f) {
+				const int bin = materialBin[intersections.materialId[p]];
+				atomicAdd(shared ? &blockCounts[bin] : &binCounts[bin], 1);
+			}
+			else {
+				pathSegments.remainingBounces[p] = 0;
+				pathSegments.color[p] = glm::vec3(0);
+			}
+		}
+	}
 
-			if (material.emittance > 0.0f) {
-				ps.remainingBounces = 0;
-				ps.color *= (materialColor * material.emittance);
+	if (shared) {
+		__syncthreads();
+		for (int b = threadIdx.x; b < numBins; b += blockDim.x) {
+			if (blockCounts[b] > 0) {
+				atomicAdd(&binCounts[b], blockCounts[b]);
 			}
+		}
+	}
+}
 
-			else {
-				if (pathSegments->remainingBounces == 1) {
-#if DIRECT
-					//hardcode 2 lights, and randomly get 0/1
-					thrust::uniform_real_distribution<float> u02(0, 2);
-
-					thrust::uniform_real_distribution<float> u1(0, 3);
-					//thrust::uniform_real_distribution<float> u2(0, 3);
-					glm::vec3 lightPos = glm::vec3(0,10,0);
-					int whichlight = int(u02(rng));
-					if (whichlight == 0) {
-						float x = u1(rng);
-						float z = u1(rng);
-						lightPos.x = x;
-						lightPos.z = z;
-					}
-					else {
-						float y = u1(rng);
-						float z = u1(rng);
-						lightPos.x = 0;
-						lightPos.y = y;
-						lightPos.z = z;
-					}
+/**
+ * Second half: writes each live path's slot into its bin's queue.
+ * binCursor starts at the bins' offsets in the queue. The order inside a
+ * queue depends on atomic ordering, which is fine since the random streams
+ * are keyed by pixel and not by thread.
+ */
+__global__ void scatterToQueues(
+	int num_paths,
+	const int* activePaths,
+	HitBuffers intersections,
+	PathBuffers pathSegments,
+	const int* materialBin,
+	int numBins,
+	int* binCursor,
+	int* queue)
+{
+	extern __shared__ int blockCounts[];
+	const bool shared = numBins <= MATERIAL_QUEUE_SHARED_BINS;
+	if (shared) {
+		for (int b = threadIdx.x; b < numBins; b += blockDim.x) {
+			blockCounts[b] = 0;
+		}
+		__syncthreads();
+	}
 
-					glm::vec3 intersect = getPointOnRay(ps.ray, intersection.t);
-					glm::vec3 normal = intersection.surfaceNormal;
-					glm::vec2 uv = intersection.uv;
-					Ray r;
-					r.origin = intersect;
-					r.direction = glm::normalize(lightPos - intersect);
-					ps.ray = r;
-					ps.color *= material.color;
-					ps.remainingBounces--;
-#else
-					glm::vec3 intersect = getPointOnRay(ps.ray, intersection.t);
-					scatterRay(ps, intersection, material, rng, camPos);
-					//scatterRay(ps, intersect, intersection.surfaceNormal, material, rng);
-					ps.remainingBounces--;
-#endif 
-				}
-				else {
-					glm::vec3 intersect = getPointOnRay(ps.ray, intersection.t);
-					scatterRay(ps, intersection, material, rng, camPos);
-					//scatterRay(ps, intersect, intersection.surfaceNormal, material, rng);
-					ps.remainingBounces--;
-				}
-				//glm::vec3 intersect = getPointOnRay(ps.ray, intersection.t);
-				//scatterRay(ps, intersection, material, rng, camPos);
-				////scatterRay(ps, intersect, intersection.surfaceNormal, material, rng);
-				//ps.remainingBounces--;
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	int p = -1;
+	int bin = -1;
+	int slot = 0;
+	if (idx < num_paths) {
+		p = activePaths[idx];
+		if (pathSegments.remainingBounces[p] > 0) {
+			bin = materialBin[intersections.materialId[p]];
+			slot = atomicAdd(shared ? &blockCounts[bin] : &binCursor[bin], 1);
+		}
+	}
+
+	if (shared) {
+		__syncthreads();
+		// one reservation per bin and block, the block count becomes its base
+		for (int b = threadIdx.x; b < numBins; b += blockDim.x) {
+			if (blockCounts[b] > 0) {
+				blockCounts[b] = atomicAdd(&binCursor[b], blockCounts[b]);
 			}
 		}
-		else {
-			ps.remainingBounces = 0;
-			ps.color = glm::vec3(0);
+		__syncthreads();
+		if (bin >= 0) {
+			slot += blockCounts[bin];
 		}
 	}
+	if (bin >= 0) {
+		queue[slot] = p;
+	}
 }
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3* image, PathSegment* iterationPaths)
+// shades the paths of one material class, queue holds their slots
+template<int Class, bool DirectLighting>
+__global__ void kernShadeQueue(
+	int traceDepth,
+	int queueLength,
+	const int* queue,
+	HitBuffers shadeableIntersections,
+	PathBuffers pathSegments,
+	Material* materials,
+	glm::vec3 camPos,
+	TextureDesc* textures,
+	unsigned char* texturePixels,
+	float pixelSpread)
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	if (i < queueLength) {
+		const int p = queue[i];
+		ShadeableIntersection intersection = shadeableIntersections.load(p);
+		PathSegment ps = pathSegments.load(p);
+		shadeHit<Class, DirectLighting>(traceDepth, intersection, ps,
+			materials[intersection.materialId], camPos, textures, texturePixels, pixelSpread);
+		pathSegments.store(p, ps);
+	}
+}
+
+template<bool DirectLighting>
+static void launchShadeQueue(int shadeClass, int blockSize, int traceDepth, int queueLength,
+	const int* queue, glm::vec3 camPos, float pixelSpread)
+{
+	dim3 blocks = (queueLength + blockSize - 1) / blockSize;
+#define SHADE_QUEUE(Class) kernShadeQueue<Class, DirectLighting> << <blocks, blockSize >> > ( \
+		traceDepth, queueLength, queue, dev_hits, dev_paths, dev_materials, \
+		camPos, dev_textures, dev_texture_pixels, pixelSpread)
+	switch (shadeClass) {
+	case MATERIAL_EMISSIVE: SHADE_QUEUE(MATERIAL_EMISSIVE); break;
+	case MATERIAL_DIFFUSE: SHADE_QUEUE(MATERIAL_DIFFUSE); break;
+	case MATERIAL_MIRROR: SHADE_QUEUE(MATERIAL_MIRROR); break;
+	case MATERIAL_GLASS: SHADE_QUEUE(MATERIAL_GLASS); break;
+	case MATERIAL_MICROFACET: SHADE_QUEUE(MATERIAL_MICROFACET); break;
+	default: SHADE_QUEUE(MATERIAL_ANY); break;
+	}
+#undef SHADE_QUEUE
+	checkCUDAError("shade material queue");
+}
+
+// spreads the low 10 bits of v out to every third bit
+__device__ inline unsigned int expandBits(unsigned int v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// 30-bit Morton code of a point in the unit cube
+__device__ inline unsigned int mortonCode(const glm::vec3& p) {
+	glm::vec3 q = glm::clamp(p * 1024.f, glm::vec3(0.f), glm::vec3(1023.f));
+	return (expandBits((unsigned int)q.x) << 2) | (expandBits((unsigned int)q.y) << 1) | expandBits((unsigned int)q.z);
+}
+
+/**
+ * One 32-bit coherence key per live path, in dev_active order. The slots are
+ * radix sorted by it right after intersection, so shading and the next
+ * bounce's traversal both see neighbouring paths together. The material bin
+ * takes the top materialBits bits; with Direction the ray's octant and the
+ * Morton code of the hit point fill the rest. Misses and finished paths sort last.
+ */
+template<bool Direction>
+__global__ void computeSortKeys(
+	int num_paths,
+	const int* activePaths,
+	HitBuffers intersections,
+	PathBuffers pathSegments,
+	const int* materialBin,
+	int materialBits,
+	glm::vec3 sceneMin,
+	glm::vec3 sceneScale,
+	unsigned int* keys)
+{
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx >= num_paths) {
+		return;
+	}
+	const int p = activePaths[idx];
+	const float t = intersections.t[p];
+	if (pathSegments.remainingBounces[p] <= 0 || t <= 0.f) {
+		keys[idx] = 0xFFFFFFFFu;
+		return;
+	}
+	unsigned int key = (unsigned int)materialBin[intersections.materialId[p]] << (32 - materialBits);
+	if (Direction) {
+		const glm::vec3 d = pathSegments.direction[p];
+		const unsigned int octant = (d.x < 0.f ? 4u : 0u) | (d.y < 0.f ? 2u : 0u) | (d.z < 0.f ? 1u : 0u);
+		const glm::vec3 hit = pathSegments.origin[p] + t * d;
+		const int lowBits = 29 - materialBits;
+		key |= octant << lowBits;
+		key |= mortonCode((hit - sceneMin) * sceneScale) >> (30 - lowBits);
+	}
+	keys[idx] = key;
+}
+
+__host__ __device__ inline float luminance(const glm::vec3& c) {
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+__device__ inline void atomicAddVec3(glm::vec3* dst, const glm::vec3& v) {
+	atomicAdd(&dst->x, v.x);
+	atomicAdd(&dst->y, v.y);
+	atomicAdd(&dst->z, v.z);
+}
+
+// Add the current iteration's output to the overall image. One thread per
+// pixel sums the pixel's samples over the layers of the batch, so the
+// accumulation needs no atomics
+__global__ void finalGather(int nPixels, int samples, glm::vec3* image, PathBuffers iterationPaths, int* sampleCount,
+	float* luminanceSq)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < nPixels)
+	{
+		const int pixel = iterationPaths.pixelIndex[index];
+		glm::vec3 color(0.f);
+		float lumSq = 0.f;
+		for (int b = 0; b < samples; b++) {
+			const glm::vec3 c = iterationPaths.color[b * nPixels + index];
+			float l = luminance(c);
+			color += c;
+			lumSq += l * l;
+		}
+		image[pixel] += color;
+		if (sampleCount != NULL) {
+			sampleCount[pixel] += samples;
+		}
+		if (luminanceSq != NULL) {
+			luminanceSq[pixel] += lumSq;
+		}
+	}
+}
+
+/**
+ * finalGather for the paths that finished this bounce of a regenerating
+ * wavefront. Two samples of one pixel can finish together, hence the atomics.
+ */
+__global__ void splatPaths(int nPaths, const int* slots, glm::vec3* image, PathBuffers paths, int* sampleCount,
+	float* luminanceSq)
 {
 	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
 	if (index < nPaths)
 	{
-		PathSegment iterationPath = iterationPaths[index];
-		image[iterationPath.pixelIndex] += iterationPath.color;
+		const int slot = slots[index];
+		const int pixel = paths.pixelIndex[slot];
+		const glm::vec3 color = paths.color[slot];
+		atomicAddVec3(&image[pixel], color);
+		if (sampleCount != NULL) {
+			atomicAdd(&sampleCount[pixel], 1);
+		}
+		if (luminanceSq != NULL) {
+			float l = luminance(color);
+			atomicAdd(&luminanceSq[pixel], l * l);
+		}
+	}
+}
+
+/**
+ * Relative standard error of a pixel's mean luminance from its running sums,
+ * returned with a count of 1 so the reduction can average over the pixels that
+ * have one. Black pixels and pixels with fewer than two samples are skipped.
+ */
+struct RelativeError {
+	const glm::vec3* image;
+	const float* luminanceSq;
+	const int* sampleCount;  // NULL when every pixel has iter samples
+	int iter;
+
+	__host__ __device__ glm::vec2 operator()(int i) const {
+		int n = sampleCount != NULL ? sampleCount[i] : iter;
+		float mean = n > 0 ? luminance(image[i]) / n : 0.f;
+		if (n < 2 || mean <= 1e-4f) {
+			return glm::vec2(0.f);
+		}
+		float variance = fmaxf(luminanceSq[i] / n - mean * mean, 0.f) * n / (n - 1);
+		return glm::vec2(sqrtf(variance / n) / mean, 1.f);
 	}
+};
+
+/**
+ * Resets the second moments as if every sample so far had been the mean, for
+ * sums that did not come from finalGather (restored checkpoints). The error
+ * estimate reads low until enough new samples have been added.
+ */
+__global__ void seedLuminanceMoments(int nPixels, const glm::vec3* image, const int* sampleCount, int iter, float* luminanceSq)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index < nPixels) {
+		int n = sampleCount != NULL ? sampleCount[index] : iter;
+		float l = n > 0 ? luminance(image[index]) / n : 0.f;
+		luminanceSq[index] = n * l * l;
+	}
+}
+
+// the unlit surface colour, the base mip of the texture if there is one
+__device__ inline glm::vec3 surfaceAlbedo(const ShadeableIntersection& intersection, const Material* materials,
+	const TextureDesc* textures, const unsigned char* texturePixels)
+{
+	if (intersection.textureId >= 0) {
+		return glm::vec3(sampleTexture(textures[intersection.textureId], texturePixels, intersection.uv, 0.f));
+	}
+	return materials[intersection.materialId].color;
 }
 
+/**
+ * Adds the camera ray hits to the AOV buffers. Albedo is the unlit surface
+ * colour, normal and position are world space and depth is the distance along
+ * the camera ray. Misses add nothing and are not counted in hitCount, which the
+ * other AOVs are averaged over. Like finalGather, one thread per pixel sums the
+ * layers of the batch in order, so the sums do not depend on the schedule.
+ */
+__global__ void gatherAOVs(int nPixels, int samples, PathBuffers paths, HitBuffers intersections,
+	const Material* materials, const TextureDesc* textures, const unsigned char* texturePixels,
+	glm::vec3* albedo, glm::vec3* normal, glm::vec3* position, float* depth, int* hitCount)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= nPixels) {
+		return;
+	}
+	glm::vec3 sumAlbedo(0.f), sumNormal(0.f), sumPosition(0.f);
+	float sumDepth = 0.f;
+	int hits = 0;
+	for (int b = 0; b < samples; b++) {
+		const int slot = b * nPixels + index;
+		if (intersections.t[slot] <= 0.f) {
+			continue;
+		}
+		ShadeableIntersection intersection = intersections.load(slot);
+		sumAlbedo += surfaceAlbedo(intersection, materials, textures, texturePixels);
+		sumNormal += intersection.surfaceNormal;
+		sumPosition += getPointOnRay(paths.ray(slot), intersection.t);
+		sumDepth += intersection.t;
+		hits++;
+	}
+	const int pixel = paths.pixelIndex[index];
+	albedo[pixel] += sumAlbedo;
+	normal[pixel] += sumNormal;
+	position[pixel] += sumPosition;
+	depth[pixel] += sumDepth;
+	hitCount[pixel] += hits;
+}
+
+/**
+ * gatherAOVs for a regenerating wavefront, whose camera rays are the slots
+ * refilled this bounce, wherever they are. Two of them can belong to the same
+ * pixel, hence the atomics.
+ */
+__global__ void accumulateAOVs(int nPaths, const int* activePaths, int traceDepth, PathBuffers paths,
+	HitBuffers intersections, const Material* materials, const TextureDesc* textures, const unsigned char* texturePixels,
+	glm::vec3* albedo, glm::vec3* normal, glm::vec3* position, float* depth, int* hitCount)
+{
+	int idx = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (idx >= nPaths) {
+		return;
+	}
+	const int index = activePaths[idx];
+	if (paths.remainingBounces[index] != traceDepth || intersections.t[index] <= 0.f) {
+		return;
+	}
+	ShadeableIntersection intersection = intersections.load(index);
+	int pixel = paths.pixelIndex[index];
+	atomicAddVec3(&albedo[pixel], surfaceAlbedo(intersection, materials, textures, texturePixels));
+	atomicAddVec3(&normal[pixel], intersection.surfaceNormal);
+	atomicAddVec3(&position[pixel], getPointOnRay(paths.ray(index), intersection.t));
+	atomicAdd(&depth[pixel], intersection.t);
+	atomicAdd(&hitCount[pixel], 1);
+}
+
+#if TEMPORAL_REPROJECTION
+/**
+ * Replaces the accumulation of every pixel with its history from before the
+ * camera move. The new first hit is projected into the previous camera (the
+ * inverse of generateRayFromCamera) and the four surrounding history pixels are
+ * bilinearly blended, skipping any whose mean depth or normal disagree with the
+ * new hit (disocclusions). The carried sample count is capped so stale history
+ * fades out quickly. Runs on the depth 0 paths of the first sample layer, one
+ * per pixel, so every pixel is written.
+ */
+__global__ void reprojectHistory(int nPaths, PathBuffers paths, HitBuffers intersections, Camera prevCam,
+	const glm::vec3* histImage, const glm::vec3* histAlbedo, const glm::vec3* histNormal,
+	const glm::vec3* histPosition, const float* histDepth, const int* histCount, const int* histHits,
+	glm::vec3* image, glm::vec3* albedo, glm::vec3* normal, glm::vec3* position, float* depth, int* sampleCount,
+	int* hitCount, float* luminanceSq)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= nPaths) {
+		return;
+	}
+	int pixel = paths.pixelIndex[index];
+	ShadeableIntersection intersection = intersections.load(index);
+
+	glm::vec3 sumImage(0.f), sumAlbedo(0.f), sumNormal(0.f), sumPosition(0.f);
+	float sumCount = 0.f;
+	float sumW = 0.f;
+	if (intersection.t > 0.f) {
+		glm::vec3 p = getPointOnRay(paths.ray(index), intersection.t);
+		glm::vec3 d = p - prevCam.position;
+		float z = glm::dot(d, prevCam.view);
+		if (z > 0.f) {
+			float fx = prevCam.resolution.x * 0.5f
+				- glm::dot(d, prevCam.right) / (glm::length2(prevCam.right) * z * prevCam.pixelLength.x);
+			float fy = prevCam.resolution.y * 0.5f
+				- glm::dot(d, prevCam.up) / (glm::length2(prevCam.up) * z * prevCam.pixelLength.y);
+			int x0 = (int)floorf(fx);
+			int y0 = (int)floorf(fy);
+			float ax = fx - x0;
+			float ay = fy - y0;
+			float dist = glm::length(d);
+
+			for (int k = 0; k < 4; k++) {
+				int x = x0 + (k & 1);
+				int y = y0 + (k >> 1);
+				float w = ((k & 1) ? ax : 1.f - ax) * ((k >> 1) ? ay : 1.f - ay);
+				if (x < 0 || y < 0 || x >= prevCam.resolution.x || y >= prevCam.resolution.y || w <= 0.f) {
+					continue;
+				}
+				int q = x + y * prevCam.resolution.x;
+				int n = histCount[q];
+				int h = histHits[q];
+				glm::vec3 qNormal = histNormal[q];
+				if (n == 0 || h == 0 || glm::length2(qNormal) == 0.f) {
+					continue;
+				}
+				float qDepth = histDepth[q] / h;
+				if (fabsf(qDepth - dist) > TEMPORAL_DEPTH_TOLERANCE * dist ||
+					glm::dot(glm::normalize(qNormal), intersection.surfaceNormal) < TEMPORAL_NORMAL_TOLERANCE) {
+					continue;
+				}
+				float wn = w / n;
+				float wh = w / h;
+				sumImage += wn * histImage[q];
+				sumAlbedo += wh * histAlbedo[q];
+				sumNormal += wh * qNormal;
+				sumPosition += wh * histPosition[q];
+				sumCount += w * n;
+				sumW += w;
+			}
+		}
+	}
+
+	// back from blended means to sums over the carried sample count; history
+	// only survives on hits, so every carried sample counts as one
+	int n = 0;
+	float scale = 0.f;
+	if (sumW > 0.f) {
+		n = glm::clamp((int)(sumCount / sumW + 0.5f), 1, TEMPORAL_MAX_HISTORY);
+		scale = n / sumW;
+	}
+	image[pixel] = sumImage * scale;
+	albedo[pixel] = sumAlbedo * scale;
+	normal[pixel] = sumNormal * scale;
+	position[pixel] = sumPosition * scale;
+	depth[pixel] = intersection.t > 0.f ? intersection.t * n : 0.f;  // depth is relative to the new camera
+	sampleCount[pixel] = n;
+	hitCount[pixel] = n;
+	if (luminanceSq != NULL) {
+		// no per-sample history to carry over, as if the history had no variance
+		float l = luminance(sumImage * scale) / glm::max(n, 1);
+		luminanceSq[pixel] = n * l * l;
+	}
+}
+#endif
+
 //comparators
-struct isZero {
-	__host__ __device__ 
-		bool operator()(const PathSegment &ps) {
-		return ps.remainingBounces;
+// look up the slot's bounce count, compaction only moves the slot indices
+struct isTerminated {
+	const int* remainingBounces;
+
+	__host__ __device__
+		bool operator()(int slot) const {
+		return remainingBounces[slot] <= 0;
 	}
 };
 
-struct compareMaterial {
+struct isLive {
+	const int* remainingBounces;
+
 	__host__ __device__
-		bool operator()(const ShadeableIntersection &i1, const ShadeableIntersection& i2) {
-		return i1.materialId < i2.materialId;
+		bool operator()(int slot) const {
+		return remainingBounces[slot] > 0;
 	}
 };
 
@@ -768,16 +1645,21 @@ struct compareMaterial {
  * Wrapper for the __global__ call that sets up the kernel calls and does a ton
  * of memory management
  */
-void pathtrace(uchar4* pbo, int frame, int iter) {
+void pathtrace(uchar4* pbo, int frame, int iter, int samples) {
 	const int traceDepth = hst_scene->state.traceDepth;
 	const Camera& cam = hst_scene->state.camera;
 	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	// one sample per pixel and layer, the per-call overhead is shared by the batch
+	samples = glm::clamp(samples, 1, batch_size);
+	const int batch_paths = pixelcount * samples;
+	const int last_iter = iter + samples - 1;
 
 	// 2D block for generating ray from camera
 	const dim3 blockSize2d(8, 8);
 	const dim3 blocksPerGrid2d(
 		(cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
 		(cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+	const dim3 blocksPerBatch(blocksPerGrid2d.x, blocksPerGrid2d.y, samples);
 
 	// 1D block for path tracing
 	const int blockSize1d = 128;
@@ -812,99 +1694,268 @@ void pathtrace(uchar4* pbo, int frame, int iter) {
 	//   for you.
 
 	// TODO: perform one iteration of path tracing
-#if CACHE_FIRST_BOUNCE
-	if (iter == 1) {
-		generateRayFromCamera << <blocksPerGrid2d, blockSize2d >> > (cam, iter, traceDepth, dev_first_paths);
-		checkCUDAError("generate camera ray");
+#if TEMPORAL_REPROJECTION
+	// the accumulation is rebuilt from this copy once the new first hits are known
+	if (reproject_pending) {
+		profiler::GpuScope scope("history copy");
+		cudaMemcpy(dev_history_image, dev_image, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+		cudaMemcpy(dev_history_albedo, dev_albedo, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+		cudaMemcpy(dev_history_normal, dev_normal, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+		cudaMemcpy(dev_history_position, dev_position, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+		cudaMemcpy(dev_history_depth, dev_depth, pixelcount * sizeof(float), cudaMemcpyDeviceToDevice);
+		cudaMemcpy(dev_history_count, dev_sample_count, pixelcount * sizeof(int), cudaMemcpyDeviceToDevice);
+		cudaMemcpy(dev_history_hits, dev_hit_count, pixelcount * sizeof(int), cudaMemcpyDeviceToDevice);
+		first_bounce_cached.assign(cache_layers, false);
 	}
-	cudaMemcpy(dev_paths, dev_first_paths, pixelcount * sizeof(PathSegment), cudaMemcpyDeviceToDevice);
+#endif
+	const RenderSettings& settings = hst_scene->state.settings;
+	const bool sort_material = useSortMaterial();
+	const int ray_sort = useRaySort();
+	const bool compaction = useCompaction();
+	const bool cache_first_bounce = useCacheFirstBounce();
+	// Path regeneration refills finished slots with the next camera samples
+	// at the top of every bounce and splats paths as they finish, so late
+	// bounces stay as wide as the first, the pool is all pixelcount x batch
+	// slots. A call ends once a batch worth of paths has finished; the ones
+	// still going carry on into the next.
+#if TEMPORAL_REPROJECTION
+	// the reprojection needs every pixel's first hit within one iteration
+	const bool regenerate = useRegeneratePaths() && !reproject_pending;
 #else
-	generateRayFromCamera << <blocksPerGrid2d, blockSize2d >> > (cam, iter, traceDepth, dev_paths);
-	checkCUDAError("generate camera ray");
+	const bool regenerate = useRegeneratePaths();
 #endif
+	if (!regenerate && wavefront_live) {
+		// paths still in flight are dropped, their samples are skipped rather than traced again
+		const long long handed_out = (next_job + pixelcount - 1) / pixelcount;
+		sample_shift = (int)glm::max((long long)sample_shift, handed_out - (iter - 1));
+		wavefront_live = false;
+	}
+	// global sample index of the first layer, the random streams are keyed by it
+	const int sample = iter - 1 + sample_shift + sample_offset;
+#if AOV_OUTPUT
+	int* sample_count = dev_sample_count;
+#else
+	int* sample_count = NULL;
+#endif
+#if CONVERGENCE_STATS
+	float* luminance_sq = dev_luminance_sq;
+#else
+	float* luminance_sq = NULL;
+#endif
+	if (!cache_first_bounce) {
+		first_bounce_cached.assign(cache_layers, false);  // rebuilt when the cache is switched back on
+	}
+	else if (dev_first_hits.t == NULL) {
+		allocHitBuffers(dev_first_hits, pixelcount * cache_layers, "first bounce cache");
+		allocPathBuffers(dev_first_paths, pixelcount * cache_layers, "first bounce cache");
+	}
+	// the first bounce comes from the cache when every layer of the batch is in it
+	bool cached_hits = cache_first_bounce && !regenerate;
+	for (int b = 0; b < samples && cached_hits; b++) {
+		cached_hits = first_bounce_cached[(sample + b) % cache_layers];
+	}
+
+	{
+		profiler::GpuScope scope("generate rays");
+		if (regenerate) {
+			if (!wavefront_live) {
+				// every slot is free, the first refill below starts at the first sample not traced yet
+				thrust::sequence(thrust::device, dev_active, dev_active + pixelcount * batch_size);
+				wavefront_paths = 0;
+				next_job = glm::max(next_job, (long long)(iter - 1 + sample_shift) * pixelcount);
+				wavefront_live = true;
+			}
+		}
+		else {
+			if (cache_first_bounce) {
+				for (int b = 0; b < samples; b++) {
+					const int k = (sample + b) % cache_layers;
+					const PathBuffers layer = dev_paths.shifted(b * pixelcount);
+					if (first_bounce_cached[k]) {
+						copyPathBuffers(layer, dev_first_paths.shifted(k * pixelcount), pixelcount);
+					}
+					else {
+						launchGenerateRays(settings, blocksPerGrid2d, blockSize2d, cam, k, traceDepth, layer);
+					}
+					// the cached rays are sample k's, their bounces take this layer's numbers
+					thrust::fill(thrust::device, layer.sample, layer.sample + pixelcount, sample + b);
+				}
+			}
+			else {
+				launchGenerateRays(settings, blocksPerBatch, blockSize2d, cam, sample, traceDepth, dev_paths);
+			}
+			// one path per pixel and layer, nothing has moved yet
+			thrust::sequence(thrust::device, dev_active, dev_active + batch_paths);
+		}
+	}
 	int depth = 0;
-	PathSegment* dev_path_end = dev_paths + pixelcount;
-	int num_paths = dev_path_end - dev_paths;
+	int num_paths = regenerate ? wavefront_paths : batch_paths;
+	int finished_paths = 0;  // splatted so far when regenerating
+	std::vector<int> active_paths;
+#if RAY_STATS
+	// device counters are read back after the gather, the path counts are known here
+	unsigned long long rays[RAY_STATS_MAX_DEPTH] = { 0 };
+	unsigned long long live_paths[RAY_STATS_MAX_DEPTH] = { 0 };
+	cudaMemset(dev_ray_stats, 0, sizeof(RayStats));
+#endif
 
 	// --- PathSegment Tracing Stage ---
 	// Shoot ray into scene, bounce between objects, push shading chunks
 
 	bool iterationComplete = false;
 	while (!iterationComplete) {
+		const int bounce = depth;
+		if (regenerate && num_paths < pixelcount * batch_size) {
+			profiler::GpuScope scope("regenerate", bounce);
+			const int count = pixelcount * batch_size - num_paths;
+			launchRegeneratePaths(settings, blockSize1d, cam, count, dev_active + num_paths, next_job, traceDepth, dev_paths);
+			next_job += count;
+			num_paths = pixelcount * batch_size;
+		}
+		active_paths.push_back(num_paths);
+#if RAY_STATS
+		rays[glm::min(bounce, RAY_STATS_MAX_DEPTH - 1)] += num_paths;
+#endif
 
-		// clean shading chunks
-		cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+		// no clearing of the hit buffers, every traced slot gets its t written
 		//create blocks
 		dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
 		// tracing
-#if CACHE_FIRST_BOUNCE
-		//if first intersection in iteration 1, compute intersection to dev_firstBounce
-		//and then copy dev_firstBounce to dev_intersections
-		if (iter == 1 && depth == 0) {
-			computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
-				depth, 
-				num_paths, 
-				dev_paths, 
-				dev_geoms, 
-				hst_scene->geoms.size(), 
-				dev_tinyobj,
-				hst_scene->Obj_geoms.size(),
-				dev_firstBounce
+		{
+			profiler::GpuScope scope("intersect", bounce);
+			if (cached_hits && depth == 0) {
+				// the camera rays repeat every cache_layers samples, so do their hits
+				for (int b = 0; b < samples; b++) {
+					const int k = (sample + b) % cache_layers;
+					copyHitBuffers(dev_hits.shifted(b * pixelcount), dev_first_hits.shifted(k * pixelcount), pixelcount);
+				}
+			}
+			else {
+				computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
+					  depth
+					, num_paths
+					, dev_active
+					, dev_paths
+					, dev_geoms
+					, hst_scene->geoms.size()
+					, dev_tris
+					, hst_scene->num_tris
+					, dev_hits
+					, dev_bvh_nodes
+#if RAY_STATS
+					, dev_ray_stats
+#else
+					, NULL
+#endif
+					);
+				checkCUDAError("trace one bounce");
+				cudaDeviceSynchronize();
+				if (cache_first_bounce && depth == 0) {
+					// the paths are untouched until shading, store them with their hits
+					for (int b = 0; b < samples; b++) {
+						const int k = (sample + b) % cache_layers;
+						if (!first_bounce_cached[k]) {
+							copyPathBuffers(dev_first_paths.shifted(k * pixelcount), dev_paths.shifted(b * pixelcount), pixelcount);
+							copyHitBuffers(dev_first_hits.shifted(k * pixelcount), dev_hits.shifted(b * pixelcount), pixelcount);
+							first_bounce_cached[k] = true;
+						}
+					}
+				}
+			}
+		}
+
+#if TEMPORAL_REPROJECTION
+		if (depth == 0 && reproject_pending) {
+			profiler::GpuScope scope("reproject", bounce);
+			reprojectHistory << <(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d >> > (
+				pixelcount,
+				dev_paths,
+				dev_hits,
+				reproject_camera,
+				dev_history_image,
+				dev_history_albedo,
+				dev_history_normal,
+				dev_history_position,
+				dev_history_depth,
+				dev_history_count,
+				dev_history_hits,
+				dev_image,
+				dev_albedo,
+				dev_normal,
+				dev_position,
+				dev_depth,
+				dev_sample_count,
+				dev_hit_count,
+#if CONVERGENCE_STATS
+				dev_luminance_sq
+#else
+				NULL
+#endif
 				);
-			checkCUDAError("trace one bounce");
-			cudaDeviceSynchronize();
-			cudaMemcpy(dev_intersections, dev_firstBounce, num_paths * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
+			checkCUDAError("reproject history");
+			reproject_pending = false;
 		}
-		//if not first iteration but first bounce
-		//just copy to dev_intersections
-		else if (iter != 1 && depth == 0) {
-			cudaMemcpy(dev_intersections, dev_firstBounce, num_paths * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
+#endif
+
+#if AOV_OUTPUT
+		if (depth == 0 && !regenerate) {
+			profiler::GpuScope scope("aovs", bounce);
+			gatherAOVs << <(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d >> > (
+				pixelcount,
+				samples,
+				dev_paths,
+				dev_hits,
+				dev_materials,
+				dev_textures,
+				dev_texture_pixels,
+				dev_albedo,
+				dev_normal,
+				dev_position,
+				dev_depth,
+				dev_hit_count
+				);
+			checkCUDAError("gather AOVs");
 		}
-		else {
-			computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
-				depth,
+		else if (regenerate) {
+			profiler::GpuScope scope("aovs", bounce);
+			accumulateAOVs << <numblocksPathSegmentTracing, blockSize1d >> > (
 				num_paths,
+				dev_active,
+				traceDepth,
 				dev_paths,
-				dev_geoms,
-				hst_scene->geoms.size(),
-				dev_tinyobj,
-				hst_scene->Obj_geoms.size(),
-				dev_intersections,
-				iter
+				dev_hits,
+				dev_materials,
+				dev_textures,
+				dev_texture_pixels,
+				dev_albedo,
+				dev_normal,
+				dev_position,
+				dev_depth,
+				dev_hit_count
 				);
-			checkCUDAError("trace one bounce");
-			cudaDeviceSynchronize();
-		}
-#else 
-		//computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
-		//	depth,
-		//	num_paths,
-		//	dev_paths,
-		//	dev_geoms,
-		//	hst_scene->geoms.size(),
-		//	dev_tinyobj,
-		//	hst_scene->Obj_geoms.size(),
-		//	dev_intersections,
-		//	iter
-		//	);
-
-		computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
-			  depth
-			, num_paths
-			, dev_paths
-			, dev_geoms
-			, hst_scene->geoms.size()
-			, dev_tris
-			, hst_scene->num_tris
-			, dev_intersections
-			, dev_bvh_nodes
-			);
-		checkCUDAError("trace one bounce");
-		cudaDeviceSynchronize();
+			checkCUDAError("accumulate AOVs");
+		}
 #endif
 
 		depth++;
 
+		if (ray_sort != RAY_SORT_NONE && num_paths > 1) {
+			// thrust radix sorts the unsigned keys, the slots ride along as values
+			profiler::GpuScope scope("ray sort", bounce);
+			if (ray_sort == RAY_SORT_DIRECTION) {
+				computeSortKeys<true> << <numblocksPathSegmentTracing, blockSize1d >> > (
+					num_paths, dev_active, dev_hits, dev_paths, dev_material_bin, material_bits,
+					scene_min, scene_scale, dev_sort_keys);
+			}
+			else {
+				computeSortKeys<false> << <numblocksPathSegmentTracing, blockSize1d >> > (
+					num_paths, dev_active, dev_hits, dev_paths, dev_material_bin, material_bits,
+					scene_min, scene_scale, dev_sort_keys);
+			}
+			checkCUDAError("compute sort keys");
+			thrust::sort_by_key(thrust::device, dev_sort_keys, dev_sort_keys + num_paths, dev_active);
+		}
+
 		// TODO:
 		// --- Shading Stage ---
 		// Shade path segments based on intersections and generate new rays by
@@ -917,35 +1968,96 @@ void pathtrace(uchar4* pbo, int frame, int iter) {
 		/*shadeFakeMaterial <<<numblocksPathSegmentTracing, blockSize1d >>> (
 			iter,
 			num_paths,
-			dev_intersections,
+			dev_hits,
 			dev_paths,
 			dev_materials
 		);*/
-		auto pos = cam.position;
-		kernSimpleShade << <numblocksPathSegmentTracing, blockSize1d >> > (
-			iter,
-			num_paths,
-			depth,
-			dev_intersections,
-			dev_paths,
-			dev_materials,
-			pos
-		);
+		if (sort_material) {
+			// histogram over the material bins, a host side scan of the few
+			// counts, then the path slots are scattered into their queues
+			const int num_bins = bin_offsets.size() - 1;
+			const size_t shared_bytes = num_bins <= MATERIAL_QUEUE_SHARED_BINS ? num_bins * sizeof(int) : 0;
+			{
+				profiler::GpuScope scope("bin materials", bounce);
+				cudaMemset(dev_bin_counts, 0, num_bins * sizeof(int));
+				countMaterialBins << <numblocksPathSegmentTracing, blockSize1d, shared_bytes >> > (
+					num_paths, dev_active, dev_hits, dev_paths, dev_material_bin, num_bins, dev_bin_counts);
+				checkCUDAError("count material bins");
+				cudaMemcpy(bin_offsets.data() + 1, dev_bin_counts, num_bins * sizeof(int), cudaMemcpyDeviceToHost);
+				bin_offsets[0] = 0;
+				for (int b = 0; b < num_bins; b++) {
+					bin_offsets[b + 1] += bin_offsets[b];
+				}
+				cudaMemcpy(dev_bin_counts, bin_offsets.data(), num_bins * sizeof(int), cudaMemcpyHostToDevice);
+				scatterToQueues << <numblocksPathSegmentTracing, blockSize1d, shared_bytes >> > (
+					num_paths, dev_active, dev_hits, dev_paths, dev_material_bin, num_bins, dev_bin_counts, dev_queue);
+				checkCUDAError("scatter to material queues");
+			}
+			profiler::GpuScope scope("shade", bounce);
+			for (int c = 0; c < MATERIAL_CLASS_COUNT; c++) {
+				const int begin = bin_offsets[class_bins[c]];
+				const int length = bin_offsets[class_bins[c + 1]] - begin;
+				if (length == 0) {
+					continue;
+				}
+				if (settings.directLighting) {
+					launchShadeQueue<true>(c, blockSize1d, traceDepth, length, dev_queue + begin,
+						cam.position, cam.pixelLength.x);
+				}
+				else {
+					launchShadeQueue<false>(c, blockSize1d, traceDepth, length, dev_queue + begin,
+						cam.position, cam.pixelLength.x);
+				}
+			}
+		}
+		else {
+			profiler::GpuScope scope("shade", bounce);
+			auto pos = cam.position;
+			if (settings.directLighting) {
+				kernSimpleShade<true> << <numblocksPathSegmentTracing, blockSize1d >> > (
+					traceDepth, num_paths, dev_active, dev_hits, dev_paths, dev_materials,
+					pos, dev_textures, dev_texture_pixels, cam.pixelLength.x);
+			}
+			else {
+				kernSimpleShade<false> << <numblocksPathSegmentTracing, blockSize1d >> > (
+					traceDepth, num_paths, dev_active, dev_hits, dev_paths, dev_materials,
+					pos, dev_textures, dev_texture_pixels, cam.pixelLength.x);
+			}
+		}
 
 		//stream compaction
-#if COMPACTION
-		//referring to the first element of the second partition
-		dev_path_end = thrust::stable_partition(thrust::device, dev_paths, dev_path_end, isZero());
-		num_paths = dev_path_end - dev_paths;
-#endif
+		//drops the terminated slots, the paths stay where they are for the gather
+		if (regenerate) {
+			// finished slots move behind the live ones, are splatted now and
+			// refilled at the top of the next bounce
+			profiler::GpuScope scope("compaction", bounce);
+			isLive live = { dev_paths.remainingBounces };
+			const int live_paths = thrust::stable_partition(thrust::device, dev_active, dev_active + num_paths, live) - dev_active;
+			const int finished = num_paths - live_paths;
+			if (finished > 0) {
+				splatPaths << <(finished + blockSize1d - 1) / blockSize1d, blockSize1d >> > (
+					finished, dev_active + live_paths, dev_image, dev_paths, sample_count, luminance_sq);
+				checkCUDAError("splat finished paths");
+			}
+			finished_paths += finished;
+			num_paths = live_paths;
+		}
+		else if (compaction) {
+			profiler::GpuScope scope("compaction", bounce);
+			isTerminated terminated = { dev_paths.remainingBounces };
+			num_paths = thrust::remove_if(thrust::device, dev_active, dev_active + num_paths, terminated) - dev_active;
+		}
 
-#if SORT_MATERIAL
-		//sort dev_intersectoins and dev_paths based on materialId
-		thrust::stable_sort_by_key(thrust::device, dev_intersections, dev_intersections+ num_paths, dev_paths, compareMaterial());
+#if RAY_STATS
+		live_paths[glm::min(bounce, RAY_STATS_MAX_DEPTH - 1)] += num_paths;
 #endif
 
 
-		if(depth >= traceDepth || num_paths == 0)
+		if (regenerate) {
+			// a batch worth of samples, the wavefront never drains
+			iterationComplete = finished_paths >= batch_paths;
+		}
+		else if(depth >= traceDepth || num_paths == 0)
 			iterationComplete = true; // TODO: should be based off stream compaction results.
 
 
@@ -955,18 +2067,163 @@ void pathtrace(uchar4* pbo, int frame, int iter) {
 		}
 	}
 
-	// Assemble this iteration and apply it to the image
-	dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-	finalGather << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_image, dev_paths);
+	// Assemble this iteration and apply it to the image, regenerated paths
+	// have been splatted as they finished
+	if (regenerate) {
+		wavefront_paths = num_paths;
+	}
+	else {
+		profiler::GpuScope scope("final gather");
+		dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+		finalGather << <numBlocksPixels, blockSize1d >> > (pixelcount, samples, dev_image, dev_paths, sample_count, luminance_sq);
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 
 	// Send results to OpenGL buffer for rendering
-	sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, iter, dev_image);
-
-	// Retrieve image from GPU
-	cudaMemcpy(hst_scene->state.image.data(), dev_image,
-		pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+	{
+		profiler::GpuScope scope("send to pbo");
+#if AOV_OUTPUT
+		sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, last_iter, dev_image, dev_sample_count, display_settings);
+#else
+		sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, last_iter, dev_image, NULL, display_settings);
+#endif
+	}
 
 	checkCUDAError("pathtrace");
+
+	if (guiData != NULL) {
+		guiData->ActivePaths = active_paths;
+		guiData->RaysTraced = 0;
+		for (size_t i = 0; i < active_paths.size(); i++) {
+			guiData->RaysTraced += active_paths[i];
+		}
+		guiData->DeviceMemory = device_memory;
+#if CONVERGENCE_STATS
+		if (last_iter / CONVERGENCE_INTERVAL != (iter - 1) / CONVERGENCE_INTERVAL) {
+			profiler::GpuScope scope("convergence");
+			RelativeError op = { dev_image, dev_luminance_sq, NULL, last_iter };
+#if AOV_OUTPUT
+			op.sampleCount = dev_sample_count;
+#endif
+			glm::vec2 sum = thrust::transform_reduce(thrust::device, thrust::counting_iterator<int>(0),
+				thrust::counting_iterator<int>(pixelcount), op, glm::vec2(0.f), thrust::plus<glm::vec2>());
+			guiData->ConvergenceError = sum.y > 0.f ? sum.x / sum.y : -1.f;
+		}
+#endif
+	}
+
+#if RAY_STATS
+	cudaMemcpy(&ray_stats, dev_ray_stats, sizeof(RayStats), cudaMemcpyDeviceToHost);
+	memcpy(ray_stats.rays, rays, sizeof(rays));
+	memcpy(ray_stats.livePaths, live_paths, sizeof(live_paths));
+#endif
+}
+
+// the image stays on the device while rendering, it is only read back for saving
+void pathtraceSnapshot(std::vector<glm::vec3>& image) {
+	const Camera& cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+	image.resize(pixelcount);
+	cudaMemcpy(image.data(), dev_image, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+	checkCUDAError("pathtraceSnapshot");
+}
+
+// uploads accumulated buffers from a checkpoint, right after pathtraceInit
+void pathtraceRestore(const std::vector<glm::vec3>& image, const AOVBuffers* aovs, int iteration) {
+	const Camera& cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+	cudaMemcpy(dev_image, image.data(), pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+#if AOV_OUTPUT
+	if (aovs != NULL) {
+		cudaMemcpy(dev_albedo, aovs->albedo.data(), pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+		cudaMemcpy(dev_normal, aovs->normal.data(), pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+		cudaMemcpy(dev_position, aovs->position.data(), pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+		cudaMemcpy(dev_depth, aovs->depth.data(), pixelcount * sizeof(float), cudaMemcpyHostToDevice);
+		cudaMemcpy(dev_sample_count, aovs->sampleCount.data(), pixelcount * sizeof(int), cudaMemcpyHostToDevice);
+		cudaMemcpy(dev_hit_count, aovs->hitCount.data(), pixelcount * sizeof(int), cudaMemcpyHostToDevice);
+	}
+	else {
+		// every pixel gets one sample per iteration, the AOV sums restart from zero
+		printf("Checkpoint has no AOVs, albedo/normal/position/depth only cover the resumed iterations\n");
+		std::vector<int> counts(pixelcount, iteration);
+		cudaMemcpy(dev_sample_count, counts.data(), pixelcount * sizeof(int), cudaMemcpyHostToDevice);
+	}
+#endif
+#if CONVERGENCE_STATS
+#if AOV_OUTPUT
+	int* sample_count = dev_sample_count;
+#else
+	int* sample_count = NULL;
+#endif
+	seedLuminanceMoments << <(pixelcount + 127) / 128, 128 >> > (pixelcount, dev_image, sample_count, iteration, dev_luminance_sq);
+#endif
+	checkCUDAError("pathtraceRestore");
+}
+
+// only changes how the preview is drawn, the accumulation is untouched
+void pathtraceSetDisplay(const DisplaySettings& display) {
+	display_settings = display;
+}
+
+void pathtraceSetSampleOffset(int offset) {
+	sample_offset = offset;
+}
+
+SampleCursor pathtraceGetSampleCursor() {
+	SampleCursor cursor = { next_job, sample_shift };
+	return cursor;
+}
+
+// right after pathtraceInit, the paths that were in flight are not restored
+void pathtraceSetSampleCursor(const SampleCursor& cursor) {
+	next_job = cursor.nextJob;
+	sample_shift = cursor.sampleShift;
+}
+
+// keeps the accumulation across a camera move, the next pathtrace call reprojects
+// it from `previous` into the current camera
+bool pathtraceReproject(const Camera& previous) {
+#if TEMPORAL_REPROJECTION
+	reproject_camera = previous;
+	reproject_pending = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool pathtraceGetRayStats(RayStats& stats) {
+#if RAY_STATS
+	stats = ray_stats;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool pathtraceGetAOVs(AOVBuffers& aovs) {
+#if AOV_OUTPUT
+	const Camera& cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+	aovs.albedo.resize(pixelcount);
+	aovs.normal.resize(pixelcount);
+	aovs.position.resize(pixelcount);
+	aovs.depth.resize(pixelcount);
+	aovs.sampleCount.resize(pixelcount);
+	aovs.hitCount.resize(pixelcount);
+	cudaMemcpy(aovs.albedo.data(), dev_albedo, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+	cudaMemcpy(aovs.normal.data(), dev_normal, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+	cudaMemcpy(aovs.position.data(), dev_position, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+	cudaMemcpy(aovs.depth.data(), dev_depth, pixelcount * sizeof(float), cudaMemcpyDeviceToHost);
+	cudaMemcpy(aovs.sampleCount.data(), dev_sample_count, pixelcount * sizeof(int), cudaMemcpyDeviceToHost);
+	cudaMemcpy(aovs.hitCount.data(), dev_hit_count, pixelcount * sizeof(int), cudaMemcpyDeviceToHost);
+	checkCUDAError("pathtraceGetAOVs");
+	return true;
+#else
+	return false;
+#endif
 }
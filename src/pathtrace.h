@@ -2,8 +2,55 @@
 
 #include <vector>
 #include "scene.h"
+#include "postprocess.h"
+#include "rayStats.h"
 
-void InitDataContainer(GuiDataContainer* guiData);
+// the analytics window switches start from the scene settings
+void InitDataContainer(GuiDataContainer* guiData, const RenderSettings& settings);
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
-void pathtrace(uchar4 *pbo, int frame, int iteration);
+// traces iterations iteration to iteration + samples - 1 as one batch of
+// samples per pixel, samples is clamped to the scene's SAMPLES_PER_CALL
+void pathtrace(uchar4 *pbo, int frame, int iteration, int samples);
+// exposure, tone mapping and sRGB for the preview window
+void pathtraceSetDisplay(const DisplaySettings& display);
+// Iteration i draws the random numbers of sample i - 1 + offset. Renders with
+// disjoint sample ranges, e.g. on different machines, sum to exactly the
+// render of the whole range, also with the first-bounce cache, whose layers
+// are keyed by the global sample index. Not with path regeneration, whose
+// iterations end with paths of later samples still in flight.
+void pathtraceSetSampleOffset(int offset);
+
+// where path regeneration hands out its next sample and how far the plain
+// wavefront has skipped past samples it handed out; checkpoints keep it so a
+// resumed render never traces a sample twice
+struct SampleCursor {
+    long long nextJob;
+    int sampleShift;
+};
+SampleCursor pathtraceGetSampleCursor();
+void pathtraceSetSampleCursor(const SampleCursor& cursor);
+// returns false if reprojection is compiled out and the caller has to restart accumulation
+bool pathtraceReproject(const Camera& previous);
+// copies the accumulated (undivided) radiance back to the host
+void pathtraceSnapshot(std::vector<glm::vec3>& image);
+
+// first-hit AOVs summed over every iteration so far. Only camera rays that hit
+// something add to them, divide by hitCount for the mean; sampleCount is what
+// the radiance in the image is summed over.
+struct AOVBuffers {
+    std::vector<glm::vec3> albedo;
+    std::vector<glm::vec3> normal;
+    std::vector<glm::vec3> position;
+    std::vector<float> depth;
+    std::vector<int> sampleCount;
+    std::vector<int> hitCount;
+};
+
+// counters of the last iteration, returns false if RAY_STATS is off
+bool pathtraceGetRayStats(RayStats& stats);
+
+// returns false if the AOVs are compiled out (AOV_OUTPUT 0)
+bool pathtraceGetAOVs(AOVBuffers& aovs);
+// aovs may be NULL when the checkpoint was written without them
+void pathtraceRestore(const std::vector<glm::vec3>& image, const AOVBuffers* aovs, int iteration);
@@ -0,0 +1,154 @@
+#include <chrono>
+
+#include "postprocess.h"
+#include "parallel.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+inline float luminance(const glm::vec3& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+}
+
+PostGraph::PostGraph(const PostSettings& settings) : settings(settings) {
+    if (settings.fireflyClamp > 0.f) {
+        addPointwise("firefly", true, false);
+    }
+    if (settings.denoise) {
+        Stage s = { STAGE_DENOISE, "denoise", false, false };
+        stages.push_back(s);
+    }
+    if (settings.downsample > 1) {
+        Stage s = { STAGE_DOWNSAMPLE, "downsample", false, false };
+        stages.push_back(s);
+    }
+    // always present, the clamp to [0, 1] happens here even with nothing else enabled
+    const DisplaySettings& display = settings.display;
+    std::string name = "clamp";
+    if (display.exposure != 0.f || display.toneMap != TONEMAP_CLAMP || display.srgb) {
+        name.clear();
+        if (display.exposure != 0.f) {
+            name += "exposure";
+        }
+        if (display.toneMap != TONEMAP_CLAMP) {
+            name += name.empty() ? "tonemap" : "+tonemap";
+        }
+        if (display.srgb) {
+            name += name.empty() ? "srgb" : "+srgb";
+        }
+    }
+    addPointwise(name, false, true);
+}
+
+// merges into the previous stage when that one is per-pixel too
+void PostGraph::addPointwise(const std::string& name, bool clamp, bool display) {
+    if (!stages.empty() && stages.back().type == STAGE_POINTWISE) {
+        Stage& prev = stages.back();
+        prev.name += "+" + name;
+        prev.clamp = prev.clamp || clamp;
+        prev.display = prev.display || display;
+        return;
+    }
+    Stage s = { STAGE_POINTWISE, name, clamp, display };
+    stages.push_back(s);
+}
+
+std::string PostGraph::describe() const {
+    std::string s;
+    for (size_t i = 0; i < stages.size(); i++) {
+        s += (i == 0 ? "" : " > ") + stages[i].name;
+    }
+    return s;
+}
+
+void PostGraph::run(const PostImage& color, const glm::vec3* albedo, const glm::vec3* normal, const glm::vec3* position,
+        PostImage& out, std::vector<glm::vec3>* denoised, PostTimings* timings) const {
+    Clock::time_point start = Clock::now();
+    int threads = resolveThreadCount(settings.threads);
+    if (timings) {
+        timings->stages.clear();
+        timings->stageMs.clear();
+    }
+
+    out = color;
+    PostImage scratch;
+    for (size_t i = 0; i < stages.size(); i++) {
+        const Stage& stage = stages[i];
+        Clock::time_point stageStart = Clock::now();
+        int width = out.width;
+
+        if (stage.type == STAGE_POINTWISE) {
+            float maxLuminance = stage.clamp ? settings.fireflyClamp : 0.f;
+            bool display = stage.display;
+            const DisplaySettings& ds = settings.display;
+            glm::vec3* pixels = out.pixels.data();
+            parallelRows(out.height, threads, [=](int y0, int y1) {
+                for (size_t p = (size_t)y0 * width; p < (size_t)y1 * width; p++) {
+                    glm::vec3 c = pixels[p];
+                    if (maxLuminance > 0.f) {
+                        float l = luminance(c);
+                        c = l > maxLuminance ? c * (maxLuminance / l) : c;
+                    }
+                    pixels[p] = display ? displayTransform(c, ds) : c;
+                }
+            });
+        }
+        else if (stage.type == STAGE_DENOISE) {
+            // runs before the downsample, so the image still matches the AOVs
+            if (albedo == NULL || normal == NULL || position == NULL) {
+                continue;
+            }
+            scratch.width = out.width;
+            scratch.height = out.height;
+            scratch.pixels.resize(out.pixels.size());
+            DenoiseSettings ds = settings.denoiseSettings;
+            ds.threads = settings.threads;
+            denoiseATrous(ds, out.width, out.height, out.pixels.data(), albedo, normal, position,
+                scratch.pixels.data(), timings ? &timings->denoise : NULL);
+            std::swap(out, scratch);
+            if (denoised) {
+                *denoised = out.pixels;
+            }
+        }
+        else if (stage.type == STAGE_DOWNSAMPLE) {
+            int f = settings.downsample;
+            scratch.width = std::max(out.width / f, 1);
+            scratch.height = std::max(out.height / f, 1);
+            scratch.pixels.resize((size_t)scratch.width * scratch.height);
+            const PostImage& src = out;
+            PostImage& dst = scratch;
+            parallelRows(dst.height, threads, [&](int y0, int y1) {
+                for (int y = y0; y < y1; y++) {
+                    for (int x = 0; x < dst.width; x++) {
+                        // box filter, the last row/column absorb any remainder
+                        int sx1 = x == dst.width - 1 ? src.width : (x + 1) * f;
+                        int sy1 = y == dst.height - 1 ? src.height : (y + 1) * f;
+                        glm::vec3 sum(0.f);
+                        for (int sy = y * f; sy < sy1; sy++) {
+                            for (int sx = x * f; sx < sx1; sx++) {
+                                sum += src.pixels[sx + (size_t)sy * src.width];
+                            }
+                        }
+                        dst.pixels[x + (size_t)y * dst.width] = sum / (float)((sx1 - x * f) * (sy1 - y * f));
+                    }
+                }
+            });
+            std::swap(out, scratch);
+        }
+
+        if (timings) {
+            timings->stages.push_back(stage.name);
+            timings->stageMs.push_back(msSince(stageStart));
+        }
+    }
+    if (timings) {
+        timings->totalMs = msSince(start);
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "denoise.h"
+
+enum ToneMapOperator {
+    TONEMAP_CLAMP = 0,  // plain clamp to [0, 1], what the project always did
+    TONEMAP_REINHARD,
+    TONEMAP_ACES
+};
+
+// Per-pixel linear radiance -> display transform. Shared by the preview
+// kernel and the saved PNGs so both look the same.
+struct DisplaySettings {
+    float exposure = 0.f;  // stops
+    int toneMap = TONEMAP_CLAMP;
+    bool srgb = false;  // off keeps writing linear values, as before
+};
+
+__host__ __device__ inline float linearToSRGB(float c) {
+    return c <= 0.0031308f ? 12.92f * c : 1.055f * powf(c, 1.f / 2.4f) - 0.055f;
+}
+
+// returns a colour in [0, 1]
+__host__ __device__ inline glm::vec3 displayTransform(glm::vec3 c, const DisplaySettings& display) {
+    c *= exp2f(display.exposure);
+    if (display.toneMap == TONEMAP_REINHARD) {
+        c = c / (glm::vec3(1.f) + c);
+    }
+    else if (display.toneMap == TONEMAP_ACES) {
+        // Narkowicz's fit of the ACES filmic curve
+        c = (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+    }
+    c = glm::clamp(c, glm::vec3(0.f), glm::vec3(1.f));
+    if (display.srgb) {
+        c = glm::vec3(linearToSRGB(c.x), linearToSRGB(c.y), linearToSRGB(c.z));
+    }
+    return c;
+}
+
+struct PostSettings {
+    float fireflyClamp = 0.f;  // max pixel luminance, 0 disables
+    bool denoise = false;  // needs the AOVs
+    DenoiseSettings denoiseSettings;
+    int downsample = 1;  // box filter the saved image by this factor
+    DisplaySettings display;
+    int threads = 0;  // 0 uses every hardware thread
+};
+
+struct PostTimings {
+    std::vector<std::string> stages;
+    std::vector<double> stageMs;
+    DenoiseTimings denoise;
+    double totalMs;
+};
+
+struct PostImage {
+    int width;
+    int height;
+    std::vector<glm::vec3> pixels;
+};
+
+// The chain applied to saved frames:
+//   firefly clamp -> denoise -> downsample -> exposure -> tone map -> sRGB
+// Disabled stages are left out, and neighbouring per-pixel stages are fused
+// into a single pass over the image. Each stage is timed separately.
+class PostGraph {
+public:
+    explicit PostGraph(const PostSettings& settings);
+
+    // color and the AOVs are width * height, already divided by the sample count.
+    // The AOVs may be NULL, the denoise stage is skipped then. If denoised is not
+    // NULL it receives the full resolution linear output of the denoiser.
+    void run(const PostImage& color, const glm::vec3* albedo, const glm::vec3* normal, const glm::vec3* position,
+        PostImage& out, std::vector<glm::vec3>* denoised, PostTimings* timings = NULL) const;
+
+    // e.g. "firefly > denoise > exposure+tonemap"
+    std::string describe() const;
+
+private:
+    enum StageType {
+        STAGE_POINTWISE,
+        STAGE_DENOISE,
+        STAGE_DOWNSAMPLE
+    };
+
+    struct Stage {
+        StageType type;
+        std::string name;
+        bool clamp;    // pointwise: firefly clamp
+        bool display;  // pointwise: exposure, tone map, sRGB
+    };
+
+    void addPointwise(const std::string& name, bool clamp, bool display);
+
+    PostSettings settings;
+    std::vector<Stage> stages;
+};
@@ -188,6 +188,14 @@ void InitImguiData(GuiDataContainer* guiData)
 }
 
 
+// scrolling plot labelled with its latest value
+static void plotHistory(const char* label, const PlotHistory& history, const char* format)
+{
+	char overlay[64];
+	snprintf(overlay, sizeof(overlay), format, history.latest());
+	ImGui::PlotLines(label, history.values, GUI_HISTORY, history.offset, overlay, 0.f, FLT_MAX, ImVec2(0, 48));
+}
+
 // LOOK: Un-Comment to check ImGui Usage
 void RenderImGui()
 {
@@ -221,6 +229,63 @@ void RenderImGui()
 	//ImGui::Text("counter = %d", counter);
 	ImGui::Text("Traced Depth %d", imguiData->TracedDepth);
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+
+	if (ImGui::CollapsingHeader("Settings", ImGuiTreeNodeFlags_DefaultOpen))
+	{
+		// read by pathtrace() at the start of every iteration
+		ImGui::Checkbox("Material queues", &imguiData->SortMaterial);
+		ImGui::Checkbox("Stream compaction", &imguiData->Compaction);
+		ImGui::Checkbox("Cache first bounce", &imguiData->CacheFirstBounce);
+		ImGui::Checkbox("Path regeneration", &imguiData->RegeneratePaths);
+		ImGui::Combo("Ray sort", &imguiData->RaySort, "None\0Material\0Material + direction\0");
+		ImGui::Checkbox("GPU stage timings", &imguiData->StageTimings);
+	}
+
+	if (ImGui::CollapsingHeader("Performance", ImGuiTreeNodeFlags_DefaultOpen))
+	{
+		plotHistory("ms / iteration", imguiData->IterationMs, "%.2f ms");
+		plotHistory("Mrays / s", imguiData->RaysPerSecond, "%.1f");
+		if (imguiData->StageTimings)
+		{
+			for (size_t i = 0; i < imguiData->StageMs.size(); i++)
+			{
+				plotHistory(imguiData->StageMs[i].first.c_str(), imguiData->StageMs[i].second, "%.3f ms");
+			}
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Paths"))
+	{
+		std::vector<float> active(imguiData->ActivePaths.begin(), imguiData->ActivePaths.end());
+		if (!active.empty())
+		{
+			ImGui::PlotHistogram("active / bounce", active.data(), (int)active.size(), 0, NULL, 0.f, active[0], ImVec2(0, 64));
+		}
+		for (size_t i = 0; i < imguiData->ActivePaths.size(); i++)
+		{
+			ImGui::Text("bounce %d: %d", (int)i, imguiData->ActivePaths[i]);
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Memory"))
+	{
+		plotHistory("device MB", imguiData->MemoryMB, "%.0f MB");
+		for (size_t i = 0; i < imguiData->DeviceMemory.size(); i++)
+		{
+			ImGui::Text("%-18s %8.2f MB", imguiData->DeviceMemory[i].first.c_str(),
+				imguiData->DeviceMemory[i].second / (1024.0 * 1024.0));
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Convergence"))
+	{
+		// relative standard error of the mean pixel luminance
+		if (imguiData->ConvergenceError < 0.f)
+		{
+			ImGui::Text("No estimate yet (CONVERGENCE_STATS in pathtrace.cu)");
+		}
+		plotHistory("rel. error", imguiData->Convergence, "%.4f");
+	}
 	ImGui::End();
 
 
@@ -241,7 +306,7 @@ void mainLoop() {
 
 		runCuda();
 
-		string title = "CIS565 Path Tracer | " + utilityCore::convertIntToString(iteration) + " Iterations";
+		string title = "CIS565 Path Tracer | " + utilityCore::convertIntToString(viewSamples) + " Iterations";
 		glfwSetWindowTitle(window, title.c_str());
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
 		glBindTexture(GL_TEXTURE_2D, displayImage);
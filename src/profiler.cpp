@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <tuple>
+
+#include "profiler.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+enum Track {
+    TRACK_HOST = 0,
+    TRACK_GPU = 1
+};
+
+const char* trackNames[] = { "host", "gpu" };
+
+struct Span {
+    const char* name;
+    int track;
+    int iteration;  // -1 before the first iteration (scene load, setup)
+    int depth;  // -1 when the stage is not per bounce
+    double startUs;  // since the profiler was enabled
+    double durationUs;
+};
+
+struct PendingGpuSpan {
+    const char* name;
+    int depth;
+    int startEvent;
+    int endEvent;
+};
+
+// the profiler is only used from the render thread, so no locking
+struct State {
+    bool enabled = false;
+    bool live = false;
+    Clock::time_point origin;
+    std::vector<Span> spans;
+    size_t dropped = 0;
+    int iteration = -1;
+
+    bool inIteration = false;
+    double iterationStartUs = 0.0;  // host time at which events[0] was recorded
+    std::vector<cudaEvent_t> events;  // reused every iteration
+    int eventsUsed = 0;
+    std::vector<PendingGpuSpan> pending;
+    std::vector<profiler::StageTime> lastIteration;
+};
+
+State state;
+
+double nowUs() {
+    return std::chrono::duration<double, std::micro>(Clock::now() - state.origin).count();
+}
+
+void addSpan(const char* name, int track, int depth, double startUs, double durationUs) {
+    if (state.spans.size() >= PROFILER_MAX_SPANS) {
+        state.dropped++;
+        return;
+    }
+    Span s = { name, track, state.iteration, depth, startUs, durationUs };
+    state.spans.push_back(s);
+}
+
+int nextEvent() {
+    if (state.eventsUsed == (int)state.events.size()) {
+        cudaEvent_t e;
+        cudaEventCreate(&e);
+        state.events.push_back(e);
+    }
+    return state.eventsUsed++;
+}
+
+bool timingGpu() {
+    return state.enabled || state.live;
+}
+
+}
+
+void profiler::setEnabled(bool enabled) {
+    if (enabled && !timingGpu()) {
+        state.origin = Clock::now();
+    }
+    state.enabled = enabled;
+}
+
+bool profiler::enabled() {
+    return state.enabled;
+}
+
+void profiler::setLive(bool live) {
+    if (live && !timingGpu()) {
+        state.origin = Clock::now();
+    }
+    state.live = live;
+    if (!live) {
+        state.lastIteration.clear();
+    }
+}
+
+const std::vector<profiler::StageTime>& profiler::lastIteration() {
+    return state.lastIteration;
+}
+
+profiler::HostScope::HostScope(const char* name, int depth)
+    : name(state.enabled ? name : NULL), depth(depth), startUs(state.enabled ? nowUs() : 0.0) {
+}
+
+profiler::HostScope::~HostScope() {
+    if (name != NULL) {
+        addSpan(name, TRACK_HOST, depth, startUs, nowUs() - startUs);
+    }
+}
+
+profiler::GpuScope::GpuScope(const char* name, int depth) : span(-1) {
+    if (timingGpu() && state.inIteration) {
+        PendingGpuSpan p = { name, depth, nextEvent(), -1 };
+        cudaEventRecord(state.events[p.startEvent]);
+        span = (int)state.pending.size();
+        state.pending.push_back(p);
+    }
+}
+
+profiler::GpuScope::~GpuScope() {
+    if (span >= 0) {
+        int e = nextEvent();
+        cudaEventRecord(state.events[e]);
+        state.pending[span].endEvent = e;
+    }
+}
+
+void profiler::beginIteration(int iteration) {
+    if (!timingGpu()) {
+        return;
+    }
+    state.iteration = iteration;
+    state.inIteration = true;
+    state.eventsUsed = 0;
+    state.pending.clear();
+    cudaEventRecord(state.events[nextEvent()]);
+    state.iterationStartUs = nowUs();
+}
+
+void profiler::endIteration() {
+    if (!state.inIteration) {
+        return;
+    }
+    state.inIteration = false;
+    state.lastIteration.clear();
+    // events complete in stream order, waiting for the last one covers all of them
+    cudaEventSynchronize(state.events[state.eventsUsed - 1]);
+    for (size_t i = 0; i < state.pending.size(); i++) {
+        const PendingGpuSpan& p = state.pending[i];
+        float startMs, endMs;
+        if (p.endEvent < 0 ||
+            cudaEventElapsedTime(&startMs, state.events[0], state.events[p.startEvent]) != cudaSuccess ||
+            cudaEventElapsedTime(&endMs, state.events[0], state.events[p.endEvent]) != cudaSuccess) {
+            continue;
+        }
+        size_t k = 0;
+        while (k < state.lastIteration.size() && strcmp(state.lastIteration[k].name, p.name) != 0) {
+            k++;
+        }
+        if (k == state.lastIteration.size()) {
+            profiler::StageTime fresh = { p.name, 0.0 };
+            state.lastIteration.push_back(fresh);
+        }
+        state.lastIteration[k].ms += endMs - startMs;
+        if (state.enabled) {
+            addSpan(p.name, TRACK_GPU, p.depth, state.iterationStartUs + startMs * 1000.0, (endMs - startMs) * 1000.0);
+        }
+    }
+    state.pending.clear();
+}
+
+bool profiler::writeChromeTrace(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (fp == NULL) {
+        printf("Could not write %s\n", path.c_str());
+        return false;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int t = 0; t < 2; t++) {
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+            t, trackNames[t]);
+    }
+    for (size_t i = 0; i < state.spans.size(); i++) {
+        const Span& s = state.spans[i];
+        fprintf(fp, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,"
+            "\"args\":{\"iteration\":%d,\"depth\":%d}}%s\n",
+            s.name, trackNames[s.track], s.startUs, s.durationUs, s.track, s.iteration, s.depth,
+            i + 1 < state.spans.size() ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    bool ok = fclose(fp) == 0;
+    printf("Saved %s (%d spans", path.c_str(), (int)state.spans.size());
+    if (state.dropped > 0) {
+        printf(", %d dropped", (int)state.dropped);
+    }
+    printf(")\n");
+    return ok;
+}
+
+// one row per (track, stage, depth) in order of first appearance
+bool profiler::writeSummaryCSV(const std::string& path) {
+    struct Stats {
+        int calls;
+        double totalUs;
+        double minUs;
+        double maxUs;
+        bool rendering;  // seen during an iteration, not just at setup
+    };
+    typedef std::tuple<int, std::string, int> Key;
+    std::map<Key, size_t> index;
+    std::vector<Key> keys;
+    std::vector<Stats> stats;
+    std::set<int> iterations;
+
+    for (size_t i = 0; i < state.spans.size(); i++) {
+        const Span& s = state.spans[i];
+        Key key(s.track, s.name, s.depth);
+        std::map<Key, size_t>::iterator it = index.find(key);
+        if (it == index.end()) {
+            it = index.insert(std::make_pair(key, keys.size())).first;
+            keys.push_back(key);
+            Stats fresh = { 0, 0.0, s.durationUs, s.durationUs, false };
+            stats.push_back(fresh);
+        }
+        Stats& st = stats[it->second];
+        st.calls++;
+        st.totalUs += s.durationUs;
+        st.minUs = std::min(st.minUs, s.durationUs);
+        st.maxUs = std::max(st.maxUs, s.durationUs);
+        if (s.iteration >= 0) {
+            st.rendering = true;
+            iterations.insert(s.iteration);
+        }
+    }
+
+    FILE* fp = fopen(path.c_str(), "w");
+    if (fp == NULL) {
+        printf("Could not write %s\n", path.c_str());
+        return false;
+    }
+    int n = std::max((int)iterations.size(), 1);
+    fprintf(fp, "track,stage,depth,calls,total_ms,mean_ms,min_ms,max_ms,ms_per_iteration\n");
+    for (size_t i = 0; i < keys.size(); i++) {
+        const Stats& st = stats[i];
+        fprintf(fp, "%s,%s,%d,%d,%.4f,%.4f,%.4f,%.4f,",
+            trackNames[std::get<0>(keys[i])], std::get<1>(keys[i]).c_str(), std::get<2>(keys[i]),
+            st.calls, st.totalUs / 1000.0, st.totalUs / 1000.0 / st.calls, st.minUs / 1000.0, st.maxUs / 1000.0);
+        if (st.rendering) {
+            fprintf(fp, "%.4f", st.totalUs / 1000.0 / n);
+        }
+        fprintf(fp, "\n");
+    }
+    bool ok = fclose(fp) == 0;
+    printf("Saved %s (%d iterations)\n", path.c_str(), (int)iterations.size());
+    return ok;
+}
+
+void profiler::shutdown() {
+    for (size_t i = 0; i < state.events.size(); i++) {
+        cudaEventDestroy(state.events[i]);
+    }
+    state.events.clear();
+    state.eventsUsed = 0;
+    state.pending.clear();
+}
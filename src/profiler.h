@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+
+#define PROFILER_MAX_SPANS (1 << 21)  // ~100 MB of spans, later ones are dropped
+
+// Scoped stage timers, exported as Chrome trace_event JSON (chrome://tracing,
+// ui.perfetto.dev) and a CSV summary per stage and depth.
+//
+// Host spans use std::chrono. GPU spans are bracketed with CUDA events on the
+// default stream, so timing them adds no synchronization inside the bounce
+// loop; they are resolved once per iteration in endIteration.
+// Everything is a no-op until setEnabled(true), or setLive(true) for the
+// GPU stage totals alone.
+namespace profiler {
+    struct StageTime {
+        const char* name;
+        double ms;
+    };
+
+    // records every span for the trace and CSV files
+    void setEnabled(bool enabled);
+    bool enabled();
+    // times the GPU stages without recording spans, for the analytics window
+    void setLive(bool live);
+    // GPU stage totals of the last iteration, summed over depths, in pipeline order
+    const std::vector<StageTime>& lastIteration();
+
+    class HostScope {
+    public:
+        // name must outlive the profiler, string literals in practice
+        explicit HostScope(const char* name, int depth = -1);
+        ~HostScope();
+    private:
+        const char* name;
+        int depth;
+        double startUs;
+    };
+
+    class GpuScope {
+    public:
+        explicit GpuScope(const char* name, int depth = -1);
+        ~GpuScope();
+    private:
+        int span;
+    };
+
+    // brackets the GPU spans of one iteration
+    void beginIteration(int iteration);
+    void endIteration();
+
+    bool writeChromeTrace(const std::string& path);
+    bool writeSummaryCSV(const std::string& path);
+    // destroys the CUDA events, call before cudaDeviceReset
+    void shutdown();
+}
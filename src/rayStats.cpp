@@ -0,0 +1,40 @@
+#include <cstdio>
+
+#include "rayStats.h"
+
+namespace {
+
+void printHistogram(const char* label, const unsigned int* bins, unsigned long long rays) {
+    printf("  %-14s", label);
+    for (int b = 0; b < RAY_STATS_BINS; b++) {
+        if (bins[b] > 0) {
+            printf(" %d+:%.1f%%", (1 << b) - 1, 100.0 * bins[b] / rays);
+        }
+    }
+    printf("\n");
+}
+
+}
+
+void printRayStats(const RayStats& stats, int iteration, double milliseconds) {
+    unsigned long long rays = 0, hits = 0;
+    for (int d = 0; d < RAY_STATS_MAX_DEPTH; d++) {
+        rays += stats.rays[d];
+        hits += stats.hits[d];
+    }
+    if (rays == 0) {
+        return;
+    }
+    double perRay = 1.0 / rays;
+    printf("iter %d: %.3f Mrays in %.2f ms, %.1f Mrays/s, %.1f nodes/ray, %.2f tris/ray, %.2f prims/ray, %.1f%% hit\n",
+        iteration, rays * 1e-6, milliseconds, rays * 1e-3 / milliseconds,
+        stats.nodesVisited * perRay, stats.triangleTests * perRay, stats.primitiveTests * perRay, 100.0 * hits * perRay);
+
+    printf("  %-14s", "rays/live:");
+    for (int d = 0; d < RAY_STATS_MAX_DEPTH && stats.rays[d] > 0; d++) {
+        printf(" %llu/%llu", stats.rays[d], stats.livePaths[d]);
+    }
+    printf("\n");
+    printHistogram("nodes/ray:", stats.nodeHistogram, rays);
+    printHistogram("tris/ray:", stats.triangleHistogram, rays);
+}
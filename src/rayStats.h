@@ -0,0 +1,21 @@
+#pragma once
+
+#define RAY_STATS_MAX_DEPTH 16  // deeper bounces are counted in the last slot
+#define RAY_STATS_BINS      16  // histogram bin b holds rays with [2^b - 1, 2^(b+1) - 1) visits
+
+// Per-iteration traversal counters, filled when pathtrace.cu is built with
+// RAY_STATS. The per-depth counts are paths, the totals and histograms cover
+// every ray traced in the iteration.
+struct RayStats {
+    unsigned long long rays[RAY_STATS_MAX_DEPTH];  // traced at each depth
+    unsigned long long hits[RAY_STATS_MAX_DEPTH];
+    unsigned long long livePaths[RAY_STATS_MAX_DEPTH];  // left after compaction
+    unsigned long long nodesVisited;  // BVH nodes fetched
+    unsigned long long triangleTests;
+    unsigned long long primitiveTests;  // analytic spheres and boxes
+    unsigned int nodeHistogram[RAY_STATS_BINS];
+    unsigned int triangleHistogram[RAY_STATS_BINS];
+};
+
+// one line of means and rates, followed by the two histograms
+void printRayStats(const RayStats& stats, int iteration, double milliseconds);
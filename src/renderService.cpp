@@ -0,0 +1,759 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <sys/stat.h>
+
+#include "renderService.h"
+#include "net.h"
+
+#define RENDER_SERVICE_MAX_BODY (1 << 20)
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const Clock::time_point origin = Clock::now();
+
+// since the service started
+double now() {
+    return std::chrono::duration<double>(Clock::now() - origin).count();
+}
+
+enum JobState {
+    JOB_QUEUED,
+    JOB_LOADING,  // waiting for its scene
+    JOB_RENDERING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+};
+
+const char* jobStateNames[] = { "queued", "loading", "rendering", "done", "failed", "cancelled" };
+
+struct Job {
+    int id;
+    std::string scenePath;
+    std::string output;  // base filename, the writer adds the extensions
+    int priority;
+    double deadline;  // service time, -1 for none
+    renderService::JobSettings settings;
+
+    JobState state;
+    int samples;  // 0 until known, the scene's iteration count unless overridden
+    int done;
+    double submitted;
+    double started;  // when rendering began
+    double finished;
+    bool cancel;
+    std::string error;
+};
+
+enum SceneState {
+    SCENE_LOADING,
+    SCENE_READY,
+    SCENE_FAILED
+};
+
+// a parsed scene with its BVH, shared by every job that names the same file
+struct CachedScene {
+    Scene* scene;
+    RenderState baseline;  // as loaded, every job starts from it
+    SceneState state;
+    time_t modified;  // of the file when it was loaded
+    double lastUsed;
+    double secondsPerSample;  // of the last job, -1 until measured
+};
+
+struct Service {
+    renderService::Options options;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::shared_ptr<Job> > jobs;  // in submission order, finished ones stay for GET
+    std::map<std::string, std::shared_ptr<CachedScene> > scenes;
+    int nextId = 1;
+    bool stopping = false;
+};
+
+time_t modifiedTime(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+
+// higher priority first, then the earlier deadline (none is last), then submission
+bool runsBefore(const Job& a, const Job& b) {
+    if (a.priority != b.priority) {
+        return a.priority > b.priority;
+    }
+    if (a.deadline != b.deadline) {
+        if (a.deadline < 0.0 || b.deadline < 0.0) {
+            return a.deadline >= 0.0;
+        }
+        return a.deadline < b.deadline;
+    }
+    return a.id < b.id;
+}
+
+// queued jobs in the order they will run
+std::vector<std::shared_ptr<Job> > schedule(const Service& svc) {
+    std::vector<std::shared_ptr<Job> > queued;
+    for (size_t i = 0; i < svc.jobs.size(); i++) {
+        if (svc.jobs[i]->state == JOB_QUEUED) {
+            queued.push_back(svc.jobs[i]);
+        }
+    }
+    std::sort(queued.begin(), queued.end(),
+        [](const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) { return runsBefore(*a, *b); });
+    return queued;
+}
+
+// what loadScene parsed, published into the cache entry under the lock
+struct LoadedScene {
+    Scene* scene;
+    RenderState baseline;
+    time_t modified;
+};
+
+// Runs without the lock, scene stays NULL when the file cannot be read. A
+// bad file only fails the jobs that name it, not the service.
+LoadedScene loadScene(const std::string& path) {
+    LoadedScene loaded;
+    loaded.scene = NULL;
+    loaded.modified = modifiedTime(path);
+    try {
+        loaded.scene = new Scene(path);
+        loaded.baseline = loaded.scene->state;
+    }
+    catch (const std::exception& e) {
+        printf("Scene %s: %s\n", path.c_str(), e.what());
+    }
+    return loaded;
+}
+
+// with the lock held, wakes whoever waits for the scene
+void publishScene(Service& svc, CachedScene& entry, const LoadedScene& loaded) {
+    entry.scene = loaded.scene;
+    entry.baseline = loaded.baseline;
+    entry.modified = loaded.modified;
+    entry.state = loaded.scene != NULL ? SCENE_READY : SCENE_FAILED;
+    svc.changed.notify_all();
+}
+
+std::shared_ptr<CachedScene> newEntry() {
+    std::shared_ptr<CachedScene> entry(new CachedScene());
+    entry->scene = NULL;
+    entry->state = SCENE_LOADING;
+    entry->modified = 0;
+    entry->lastUsed = now();
+    entry->secondsPerSample = -1.0;
+    return entry;
+}
+
+void freeEntry(CachedScene& entry) {
+    delete entry.scene;
+    entry.scene = NULL;
+}
+
+// Parses the scenes of queued jobs before their turn, in schedule order. Only
+// the render thread frees scenes, so the loaders read ahead no further than
+// the first sceneCache scenes of the queue and only while the cache has room.
+void loaderLoop(Service& svc) {
+    std::unique_lock<std::mutex> lock(svc.mutex);
+    while (!svc.stopping) {
+        std::string path;
+        if ((int)svc.scenes.size() < svc.options.sceneCache) {
+            std::vector<std::shared_ptr<Job> > queued = schedule(svc);
+            std::vector<std::string> ahead;
+            for (size_t i = 0; i < queued.size() && path.empty(); i++) {
+                const std::string& scenePath = queued[i]->scenePath;
+                if (std::find(ahead.begin(), ahead.end(), scenePath) != ahead.end()) {
+                    continue;
+                }
+                if ((int)ahead.size() == svc.options.sceneCache) {
+                    break;
+                }
+                ahead.push_back(scenePath);
+                if (svc.scenes.find(scenePath) == svc.scenes.end()) {
+                    path = scenePath;
+                }
+            }
+        }
+        if (path.empty()) {
+            svc.changed.wait(lock);
+            continue;
+        }
+        std::shared_ptr<CachedScene> entry = newEntry();
+        svc.scenes[path] = entry;
+        lock.unlock();
+        LoadedScene loaded = loadScene(path);
+        lock.lock();
+        publishScene(svc, *entry, loaded);
+    }
+}
+
+// The job's scene, loaded here if no loader got to it. Stale entries, whose
+// file changed since, are replaced; only this thread ever frees a scene.
+std::shared_ptr<CachedScene> sceneFor(Service& svc, const std::string& path, std::unique_lock<std::mutex>& lock) {
+    std::map<std::string, std::shared_ptr<CachedScene> >::iterator it = svc.scenes.find(path);
+    if (it != svc.scenes.end() && it->second->state != SCENE_LOADING &&
+        it->second->modified != modifiedTime(path)) {
+        freeEntry(*it->second);
+        svc.scenes.erase(it);
+        it = svc.scenes.end();
+    }
+    if (it == svc.scenes.end()) {
+        std::shared_ptr<CachedScene> entry = newEntry();
+        svc.scenes[path] = entry;
+        lock.unlock();
+        LoadedScene loaded = loadScene(path);
+        lock.lock();
+        publishScene(svc, *entry, loaded);
+        return entry;
+    }
+    std::shared_ptr<CachedScene> entry = it->second;
+    while (entry->state == SCENE_LOADING) {
+        svc.changed.wait(lock);
+    }
+    return entry;
+}
+
+// drops the least recently used scenes no queued job needs, down to the cache size
+void evictScenes(Service& svc) {
+    std::vector<std::shared_ptr<Job> > queued = schedule(svc);
+    while ((int)svc.scenes.size() > svc.options.sceneCache) {
+        std::map<std::string, std::shared_ptr<CachedScene> >::iterator victim = svc.scenes.end();
+        for (std::map<std::string, std::shared_ptr<CachedScene> >::iterator it = svc.scenes.begin();
+                it != svc.scenes.end(); ++it) {
+            bool needed = it->second->state == SCENE_LOADING;
+            for (size_t i = 0; i < queued.size() && !needed; i++) {
+                needed = queued[i]->scenePath == it->first;
+            }
+            if (!needed && (victim == svc.scenes.end() || it->second->lastUsed < victim->second->lastUsed)) {
+                victim = it;
+            }
+        }
+        if (victim == svc.scenes.end()) {
+            return;
+        }
+        freeEntry(*victim->second);
+        svc.scenes.erase(victim);
+    }
+}
+
+void applySettings(const renderService::JobSettings& settings, RenderState& state) {
+    if (settings.iterations > 0) {
+        state.iterations = settings.iterations;
+    }
+    for (size_t i = 0; i < settings.features.size(); i++) {
+        setRenderFeature(state.settings, settings.features[i].first, settings.features[i].second);
+    }
+    if (settings.samplesPerCall > 0) {
+        state.settings.samplesPerCall = settings.samplesPerCall;
+    }
+    if (settings.raySort >= 0) {
+        state.settings.raySort = settings.raySort;
+    }
+    Camera& cam = state.camera;
+    if (settings.hasEye || settings.hasLookAt) {
+        if (settings.hasEye) {
+            cam.position = settings.eye;
+        }
+        if (settings.hasLookAt) {
+            cam.lookAt = settings.lookAt;
+        }
+        cam.view = glm::normalize(cam.lookAt - cam.position);
+        cam.right = glm::normalize(glm::cross(cam.view, cam.up));
+    }
+}
+
+void renderLoop(Service& svc, const renderService::RenderFunction& render, ImageWriter& writer) {
+    std::unique_lock<std::mutex> lock(svc.mutex);
+    while (true) {
+        std::vector<std::shared_ptr<Job> > queued = schedule(svc);
+        if (queued.empty()) {
+            if (svc.stopping) {
+                return;
+            }
+            svc.changed.wait(lock);
+            continue;
+        }
+        std::shared_ptr<Job> job = queued[0];
+        job->state = JOB_LOADING;
+        std::shared_ptr<CachedScene> entry = sceneFor(svc, job->scenePath, lock);
+        if (entry->state == SCENE_FAILED) {
+            job->state = JOB_FAILED;
+            job->error = "could not read " + job->scenePath;
+            job->finished = now();
+            printf("Job %d: %s\n", job->id, job->error.c_str());
+            svc.scenes.erase(job->scenePath);  // read again should the file appear
+            svc.changed.notify_all();  // room for the loaders
+            continue;
+        }
+        if (job->cancel) {
+            job->state = JOB_CANCELLED;
+            job->finished = now();
+            continue;
+        }
+
+        Scene& scene = *entry->scene;
+        scene.state = entry->baseline;
+        applySettings(job->settings, scene.state);
+        job->samples = scene.state.iterations;
+        if (job->output.empty()) {
+            std::ostringstream name;
+            name << scene.state.imageName << ".job" << job->id;
+            job->output = name.str();
+        }
+        job->state = JOB_RENDERING;
+        job->started = now();
+        entry->lastUsed = now();
+        printf("Job %d: rendering %s, %d samples\n", job->id, job->scenePath.c_str(), job->samples);
+        lock.unlock();
+
+        Frame frame;
+        bool ok = render(scene, frame, [&](int done) {
+            std::lock_guard<std::mutex> guard(svc.mutex);
+            job->done = done;
+            return !job->cancel;
+        });
+        bool write = ok && !job->cancel;
+        if (write) {
+            frame.baseFilename = job->output;
+            writer.submit(std::move(frame));
+        }
+
+        lock.lock();
+        job->finished = now();
+        if (!ok) {
+            job->state = JOB_FAILED;
+            job->error = "render failed";
+        }
+        else if (!write) {
+            job->state = JOB_CANCELLED;
+        }
+        else {
+            job->state = JOB_DONE;
+            if (job->done > 0) {
+                entry->secondsPerSample = (job->finished - job->started) / job->done;
+            }
+        }
+        printf("Job %d: %s\n", job->id, jobStateNames[job->state]);
+        entry->lastUsed = now();
+        scene.state = entry->baseline;
+        evictScenes(svc);
+        svc.changed.notify_all();  // room for the loaders
+    }
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        const char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+std::string jsonNumber(double v, bool known) {
+    if (!known) {
+        return "null";
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", v);
+    return buf;
+}
+
+// Seconds until each job finishes, -1 when unknown. The running job
+// extrapolates its own progress; queued jobs use the last measured speed of
+// their scene and wait for everything scheduled before them.
+std::map<int, double> estimates(const Service& svc) {
+    std::map<int, double> eta;
+    const double t = now();
+    double ahead = 0.0;
+    for (size_t i = 0; i < svc.jobs.size(); i++) {
+        const Job& job = *svc.jobs[i];
+        if (job.state == JOB_LOADING) {
+            ahead = -1.0;
+            eta[job.id] = -1.0;
+        }
+        else if (job.state == JOB_RENDERING) {
+            double left = -1.0;
+            if (job.done > 0) {
+                left = (t - job.started) / job.done * (job.samples - job.done);
+            }
+            eta[job.id] = left;
+            ahead = left;
+        }
+    }
+    std::vector<std::shared_ptr<Job> > queued = schedule(svc);
+    for (size_t i = 0; i < queued.size(); i++) {
+        const Job& job = *queued[i];
+        double own = -1.0;
+        std::map<std::string, std::shared_ptr<CachedScene> >::const_iterator it = svc.scenes.find(job.scenePath);
+        if (it != svc.scenes.end() && it->second->state == SCENE_READY && it->second->secondsPerSample >= 0.0) {
+            const int samples = job.settings.iterations > 0 ? job.settings.iterations : (int)it->second->baseline.iterations;
+            own = it->second->secondsPerSample * samples;
+        }
+        ahead = ahead >= 0.0 && own >= 0.0 ? ahead + own : -1.0;
+        eta[job.id] = ahead;
+    }
+    return eta;
+}
+
+std::string jobJson(const Job& job, double eta) {
+    const double t = now();
+    const bool active = job.state == JOB_RENDERING;
+    const bool finished = job.state == JOB_DONE || job.state == JOB_FAILED || job.state == JOB_CANCELLED;
+    const double end = finished ? job.finished : t + eta;
+    const bool late = job.deadline >= 0.0 && (finished || eta >= 0.0) && end > job.deadline;
+    std::ostringstream out;
+    out << "{\"id\":" << job.id
+        << ",\"scene\":" << jsonString(job.scenePath)
+        << ",\"output\":" << jsonString(job.output)
+        << ",\"state\":\"" << jobStateNames[job.state] << "\""
+        << ",\"priority\":" << job.priority
+        << ",\"deadline_s\":" << jsonNumber(job.deadline - t, job.deadline >= 0.0)
+        << ",\"late\":" << (late ? "true" : "false")
+        << ",\"samples\":" << job.samples
+        << ",\"done\":" << job.done
+        << ",\"progress\":" << jsonNumber(job.samples > 0 ? (double)job.done / job.samples : 0.0, true)
+        << ",\"elapsed_s\":" << jsonNumber((finished ? job.finished : t) - job.started, active || job.state == JOB_DONE)
+        << ",\"eta_s\":" << jsonNumber(eta, !finished && eta >= 0.0);
+    if (!job.error.empty()) {
+        out << ",\"error\":" << jsonString(job.error);
+    }
+    out << "}";
+    return out.str();
+}
+
+struct Request {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> params;
+};
+
+std::string urlDecode(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '+') {
+            out += ' ';
+        }
+        else if (s[i] == '%' && i + 2 < s.size()) {
+            out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+void parseParams(const std::string& query, std::map<std::string, std::string>& params) {
+    std::stringstream in(query);
+    std::string pair;
+    while (std::getline(in, pair, '&')) {
+        size_t eq = pair.find('=');
+        if (eq != std::string::npos) {
+            params[urlDecode(pair.substr(0, eq))] = urlDecode(pair.substr(eq + 1));
+        }
+    }
+}
+
+bool readRequest(net::Socket s, Request& request) {
+    std::string line;
+    if (!net::recvLine(s, line, 8192)) {
+        return false;
+    }
+    std::istringstream requestLine(line);
+    std::string target;
+    requestLine >> request.method >> target;
+    size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    if (question != std::string::npos) {
+        parseParams(target.substr(question + 1), request.params);
+    }
+    size_t contentLength = 0;
+    while (net::recvLine(s, line, 8192)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty()) {
+            break;
+        }
+        size_t colon = line.find(':');
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "content-length" && colon != std::string::npos) {
+            contentLength = (size_t)atol(line.c_str() + colon + 1);
+        }
+    }
+    if (contentLength > RENDER_SERVICE_MAX_BODY) {
+        return false;
+    }
+    std::string body(contentLength, '\0');
+    if (contentLength > 0 && !net::recvAll(s, &body[0], contentLength)) {
+        return false;
+    }
+    parseParams(body, request.params);
+    return true;
+}
+
+void respond(net::Socket s, int status, const std::string& json) {
+    const char* reason = status == 200 ? "OK" : status == 201 ? "Created" : status == 404 ? "Not Found" : "Bad Request";
+    std::ostringstream out;
+    out << "HTTP/1.1 " << status << " " << reason << "\r\n"
+        << "Content-Type: application/json\r\n"
+        << "Content-Length: " << json.size() + 1 << "\r\n"
+        << "Connection: close\r\n\r\n"
+        << json << "\n";
+    const std::string text = out.str();
+    net::sendAll(s, text.data(), text.size());
+}
+
+std::string errorJson(const std::string& message) {
+    return "{\"error\":" + jsonString(message) + "}";
+}
+
+bool parseVec3(const std::string& s, glm::vec3& v) {
+    return sscanf(s.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+// fills job from the POST /jobs parameters, false with a message for bad ones
+bool parseJob(const std::map<std::string, std::string>& params, Job& job, std::string& message) {
+    for (std::map<std::string, std::string>::const_iterator it = params.begin(); it != params.end(); ++it) {
+        const std::string& key = it->first;
+        const std::string& value = it->second;
+        if (key == "scene") {
+            job.scenePath = value;
+        }
+        else if (key == "output") {
+            job.output = value;
+        }
+        else if (key == "iterations") {
+            job.settings.iterations = atoi(value.c_str());
+        }
+        else if (key == "priority") {
+            job.priority = atoi(value.c_str());
+        }
+        else if (key == "deadline") {
+            job.deadline = job.submitted + atof(value.c_str());
+        }
+        else if (key == "eye") {
+            job.settings.hasEye = parseVec3(value, job.settings.eye);
+            if (!job.settings.hasEye) {
+                message = "eye takes X,Y,Z";
+                return false;
+            }
+        }
+        else if (key == "lookat") {
+            job.settings.hasLookAt = parseVec3(value, job.settings.lookAt);
+            if (!job.settings.hasLookAt) {
+                message = "lookat takes X,Y,Z";
+                return false;
+            }
+        }
+        else if (key == "enable" || key == "disable") {
+            std::stringstream list(value);
+            std::string name;
+            while (std::getline(list, name, ',')) {
+                RenderSettings probe;
+                if (!setRenderFeature(probe, name, true)) {
+                    message = "unknown feature " + name;
+                    return false;
+                }
+                job.settings.features.push_back(std::make_pair(name, key == "enable"));
+            }
+        }
+        else if (key == "spp_per_call") {
+            job.settings.samplesPerCall = std::max(atoi(value.c_str()), 1);
+        }
+        else if (key == "ray_sort") {
+            job.settings.raySort = parseRaySort(value);
+            if (job.settings.raySort < 0) {
+                message = "unknown ray sort " + value;
+                return false;
+            }
+        }
+        else {
+            message = "unknown parameter " + key;
+            return false;
+        }
+    }
+    if (job.scenePath.empty()) {
+        message = "scene is required";
+        return false;
+    }
+    return true;
+}
+
+// the HTTP status of a request and its JSON body, with the lock held
+int answer(Service& svc, const Request& request, std::string& json) {
+    if (request.path == "/jobs" && request.method == "POST") {
+        std::shared_ptr<Job> job(new Job());
+        job->id = svc.nextId;
+        job->priority = 0;
+        job->deadline = -1.0;
+        job->state = JOB_QUEUED;
+        job->samples = 0;
+        job->done = 0;
+        job->submitted = now();
+        job->started = 0.0;
+        job->finished = 0.0;
+        job->cancel = false;
+        std::string message;
+        if (!parseJob(request.params, *job, message)) {
+            json = errorJson(message);
+            return 400;
+        }
+        job->samples = job->settings.iterations;
+        svc.nextId++;
+        svc.jobs.push_back(job);
+        svc.changed.notify_all();
+        printf("Job %d: queued %s, priority %d\n", job->id, job->scenePath.c_str(), job->priority);
+        std::ostringstream out;
+        out << "{\"id\":" << job->id << "}";
+        json = out.str();
+        return 201;
+    }
+    else if (request.path == "/jobs" && request.method == "GET") {
+        std::map<int, double> eta = estimates(svc);
+        json = "[";
+        for (size_t i = 0; i < svc.jobs.size(); i++) {
+            json += (i > 0 ? ",\n" : "") + jobJson(*svc.jobs[i], eta.count(svc.jobs[i]->id) ? eta[svc.jobs[i]->id] : -1.0);
+        }
+        json += "]";
+        return 200;
+    }
+    else if (request.path.compare(0, 6, "/jobs/") == 0 && (request.method == "GET" || request.method == "DELETE")) {
+        const int id = atoi(request.path.c_str() + 6);
+        if (id < 1 || id >= svc.nextId) {
+            json = errorJson("no such job");
+            return 404;
+        }
+        Job& job = *svc.jobs[id - 1];
+        if (request.method == "DELETE") {
+            job.cancel = true;
+            if (job.state == JOB_QUEUED) {
+                job.state = JOB_CANCELLED;
+                job.finished = now();
+            }
+            svc.changed.notify_all();
+        }
+        std::map<int, double> eta = estimates(svc);
+        json = jobJson(job, eta.count(id) ? eta[id] : -1.0);
+        return 200;
+    }
+    else if (request.path == "/shutdown" && request.method == "POST") {
+        svc.stopping = true;
+        svc.changed.notify_all();
+        json = "{\"stopping\":true}";
+        return 200;
+    }
+    json = errorJson("unknown endpoint");
+    return 404;
+}
+
+// The answer is put together under the lock and sent after it is released,
+// a slow client only holds up the accept loop.
+void handle(Service& svc, net::Socket s) {
+    Request request;
+    if (!readRequest(s, request)) {
+        respond(s, 400, errorJson("malformed request"));
+        return;
+    }
+    int status;
+    std::string json;
+    {
+        std::lock_guard<std::mutex> guard(svc.mutex);
+        status = answer(svc, request, json);
+    }
+    respond(s, status, json);
+}
+
+}
+
+int renderService::run(const Options& options, const RenderFunction& render) {
+    net::start();
+    net::Socket listener = net::listenOn(options.port, true);
+    if (listener == net::invalidSocket) {
+        printf("Could not listen on port %d\n", options.port);
+        return 1;
+    }
+    printf("Render service on http://127.0.0.1:%d, %d loader threads, %d cached scenes\n",
+        options.port, options.loaderThreads, options.sceneCache);
+
+    Service svc;
+    svc.options = options;
+    ImageWriter writer(2);
+    std::thread renderer(renderLoop, std::ref(svc), std::cref(render), std::ref(writer));
+    std::vector<std::thread> loaders;
+    for (int i = 0; i < options.loaderThreads; i++) {
+        loaders.push_back(std::thread(loaderLoop, std::ref(svc)));
+    }
+
+    // one request per connection, they are all quick
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(svc.mutex);
+            if (svc.stopping) {
+                break;
+            }
+        }
+        std::vector<bool> ready;
+        if (!net::waitReadable(std::vector<net::Socket>(1, listener), 500, ready)) {
+            break;
+        }
+        if (!ready[0]) {
+            continue;
+        }
+        net::Socket s = net::acceptFrom(listener);
+        if (s == net::invalidSocket) {
+            continue;
+        }
+        net::setReceiveTimeout(s, 5);
+        handle(svc, s);
+        net::closeSocket(s);
+    }
+    net::closeSocket(listener);
+
+    {
+        // queued jobs are dropped, the running one finishes
+        std::lock_guard<std::mutex> guard(svc.mutex);
+        svc.stopping = true;
+        for (size_t i = 0; i < svc.jobs.size(); i++) {
+            if (svc.jobs[i]->state == JOB_QUEUED) {
+                svc.jobs[i]->state = JOB_CANCELLED;
+            }
+        }
+        svc.changed.notify_all();
+    }
+    renderer.join();
+    for (size_t i = 0; i < loaders.size(); i++) {
+        loaders[i].join();
+    }
+    writer.flush();
+    for (std::map<std::string, std::shared_ptr<CachedScene> >::iterator it = svc.scenes.begin();
+            it != svc.scenes.end(); ++it) {
+        freeEntry(*it->second);
+    }
+    return 0;
+}
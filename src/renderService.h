@@ -0,0 +1,53 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "imageWriter.h"
+#include "scene.h"
+
+#define RENDER_SERVICE_DEFAULT_PORT 7566
+
+// Long-running render queue on localhost. Jobs come in over HTTP, the scenes
+// they load stay parsed (with their BVH) for later jobs, and one render thread
+// works through the queue by priority, then deadline, then submission order.
+//
+//   POST   /jobs       scene=PATH [output=BASENAME] [iterations=N] [priority=P]
+//                      [deadline=SECONDS] [eye=X,Y,Z] [lookat=X,Y,Z]
+//                      [enable=FEATURE,...] [disable=FEATURE,...]
+//                      [spp_per_call=N] [ray_sort=none|material|direction]
+//   GET    /jobs       every job with its state, progress and ETA
+//   GET    /jobs/ID
+//   DELETE /jobs/ID    cancels a queued job, a running one stops after its current call
+//   POST   /shutdown   finishes the running job and exits
+// Parameters go in the query string or a form-encoded body; answers are JSON.
+// Deadlines are seconds after submission and only order the queue, a late
+// job still renders. The GPU state is a singleton, so jobs render one at a
+// time; the loader threads parse the scenes of queued jobs ahead of them.
+namespace renderService {
+    // what a job changes on its cached scene, which is reset between jobs
+    struct JobSettings {
+        int iterations = 0;  // 0 keeps the scene's
+        std::vector<std::pair<std::string, bool> > features;
+        int samplesPerCall = 0;  // 0 keeps the scene's
+        int raySort = -1;  // -1 keeps the scene's
+        bool hasEye = false;
+        glm::vec3 eye;
+        bool hasLookAt = false;
+        glm::vec3 lookAt;
+    };
+
+    // renders the scene, whose state already has the job's settings applied,
+    // into frame; progress(samplesDone) returns false once the job is cancelled
+    typedef std::function<bool(Scene& scene, Frame& frame, const std::function<bool(int)>& progress)> RenderFunction;
+
+    struct Options {
+        int port = RENDER_SERVICE_DEFAULT_PORT;
+        int loaderThreads = 2;
+        int sceneCache = 4;  // parsed scenes kept while no queued job needs them, and how far the loaders read ahead
+    };
+
+    // serves until POST /shutdown, returns the exit code
+    int run(const Options& options, const RenderFunction& render);
+}
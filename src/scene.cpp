@@ -1,6 +1,10 @@
 #include <iostream>
 #include "scene.h"
+#include "sceneBundle.h"
+#include "textureCache.h"
+#include "profiler.h"
 #include <cstring>
+#include <stdexcept>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
 
@@ -18,13 +22,24 @@ glm::vec3 multiplyMV(glm::mat4 m, glm::vec3 v) {
 Scene::Scene(string filename) {
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
+    if (sceneBundle::isBundlePath(filename)) {
+        profiler::HostScope scope("read bundle");
+        if (!sceneBundle::read(*this, filename)) {
+            cout << "Error reading scene bundle - aborting!" << endl;
+            throw std::runtime_error("could not read scene bundle " + filename);
+        }
+        return;
+    }
     char* fname = (char*)filename.c_str();
     fp_in.open(fname);
     if (!fp_in.is_open()) {
         cout << "Error reading from file - aborting!" << endl;
-        throw;
+        throw std::runtime_error("could not read " + filename);
     }
 
+    profiler::HostScope parseScope("parse scene");
+    // textures come in through their tiled sidecars, only new or edited images are decoded
+    textures.cache.reset(new TextureCache(textures.budget));
     while (fp_in.good()) {
         string line;
         utilityCore::safeGetline(fp_in, line);
@@ -39,9 +54,13 @@ Scene::Scene(string filename) {
             } else if (strcmp(tokens[0].c_str(), "CAMERA") == 0) {
                 loadCamera();
                 cout << " " << endl;
+            } else if (strcmp(tokens[0].c_str(), "RENDER") == 0) {
+                loadRenderSettings();
+                cout << " " << endl;
             }
             //loading OBJ files
             else if (strcmp(tokens[0].c_str(), "OBJECT_obj") == 0) {
+                profiler::HostScope scope("load obj");
                 loadObj(tokens[1].c_str());
                 //loadMesh(tokens[1].c_str());
                 cout << " " << endl;
@@ -49,15 +68,29 @@ Scene::Scene(string filename) {
         }
     }
 
-    if (mesh_tris.size() > 0) {
-        root_node = buildBVH(0, mesh_tris.size());
+    {
+        profiler::HostScope scope("resolve textures");
+        textures.resolve();
+    }
 
-        reformatBVHToGPU();
+    if (mesh_tris.size() > 0) {
+        {
+            profiler::HostScope scope("build bvh");
+            root_node = buildBVH(0, mesh_tris.size());
+        }
+        {
+            profiler::HostScope scope("flatten bvh");
+            reformatBVHToGPU();
+        }
 
         std::cout << "num nodes: " << num_nodes << std::endl;
     }
 }
 
+// the pointer BVH is only kept until flattened, and not at all for bundles
+Scene::~Scene() {
+}
+
 int Scene::loadGeom(string objectid) {
     int id = atoi(objectid.c_str());
     if (id != geoms.size()) {
@@ -185,6 +218,112 @@ int Scene::loadCamera() {
     return 1;
 }
 
+// scene file names, the same as the #defines they replaced
+struct RenderFeature {
+    const char* name;
+    bool RenderSettings::* field;
+};
+
+static const RenderFeature renderFeatures[] = {
+    { "ANTI_ALIASING", &RenderSettings::antiAliasing },
+    { "DEPTH_OF_FIELD", &RenderSettings::depthOfField },
+    { "DIRECT", &RenderSettings::directLighting },
+    { "SORT_MATERIAL", &RenderSettings::sortMaterial },
+    { "COMPACTION", &RenderSettings::compaction },
+    { "CACHE_FIRST_BOUNCE", &RenderSettings::cacheFirstBounce },
+    { "REGENERATE_PATHS", &RenderSettings::regeneratePaths },
+};
+
+bool setRenderFeature(RenderSettings& settings, const std::string& name, bool enabled) {
+    std::string upper = name;
+    for (size_t i = 0; i < upper.size(); i++) {
+        upper[i] = (char)toupper((unsigned char)upper[i]);
+    }
+    for (size_t i = 0; i < sizeof(renderFeatures) / sizeof(renderFeatures[0]); i++) {
+        if (upper == renderFeatures[i].name) {
+            settings.*renderFeatures[i].field = enabled;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string describeRenderSettings(const RenderSettings& settings) {
+    std::string s;
+    for (size_t i = 0; i < sizeof(renderFeatures) / sizeof(renderFeatures[0]); i++) {
+        if (settings.*renderFeatures[i].field) {
+            std::string name = renderFeatures[i].name;
+            for (size_t k = 0; k < name.size(); k++) {
+                name[k] = (char)tolower((unsigned char)name[k]);
+            }
+            s += (s.empty() ? "" : " ") + name;
+        }
+    }
+    if (settings.raySort != RAY_SORT_NONE) {
+        s += (s.empty() ? "" : ", ") + std::string("ray sort ") + raySortName(settings.raySort);
+    }
+    if (settings.cacheFirstBounce && settings.firstBounceSamples > 1) {
+        s += (s.empty() ? "" : ", ") + std::to_string(settings.firstBounceSamples) + " cached first bounces";
+    }
+    if (settings.samplesPerCall > 1) {
+        s += (s.empty() ? "" : ", ") + std::to_string(settings.samplesPerCall) + " samples per call";
+    }
+    return s.empty() ? "none" : s;
+}
+
+static const char* raySortNames[RAY_SORT_COUNT] = { "none", "material", "direction" };
+
+int parseRaySort(const std::string& name) {
+    std::string lower = name;
+    for (size_t i = 0; i < lower.size(); i++) {
+        lower[i] = (char)tolower((unsigned char)lower[i]);
+    }
+    for (int i = 0; i < RAY_SORT_COUNT; i++) {
+        if (lower == raySortNames[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* raySortName(int raySort) {
+    return raySort >= 0 && raySort < RAY_SORT_COUNT ? raySortNames[raySort] : "unknown";
+}
+
+// RENDER block: one "NAME 0|1" line per feature, SAMPLES_PER_CALL n,
+// CACHE_FIRST_BOUNCE_SAMPLES n or RAY_SORT none|material|direction, until an empty line
+int Scene::loadRenderSettings() {
+    cout << "Loading Render Settings ..." << endl;
+    string line;
+    utilityCore::safeGetline(fp_in, line);
+    while (!line.empty() && fp_in.good()) {
+        vector<string> tokens = utilityCore::tokenizeString(line);
+        if (tokens.size() >= 2 && tokens[0] == "SAMPLES_PER_CALL") {
+            state.settings.samplesPerCall = max(atoi(tokens[1].c_str()), 1);
+        }
+        else if (tokens.size() >= 2 && tokens[0] == "TEXTURE_BUDGET_MB") {
+            textures.budget = (size_t)max(atoi(tokens[1].c_str()), 1) << 20;
+        }
+        else if (tokens.size() >= 2 && tokens[0] == "CACHE_FIRST_BOUNCE_SAMPLES") {
+            state.settings.firstBounceSamples = max(atoi(tokens[1].c_str()), 1);
+        }
+        else if (tokens.size() >= 2 && tokens[0] == "RAY_SORT") {
+            int raySort = parseRaySort(tokens[1]);
+            if (raySort < 0) {
+                cout << "Unknown ray sort: " << tokens[1] << endl;
+            }
+            else {
+                state.settings.raySort = raySort;
+            }
+        }
+        else if (tokens.size() < 2 || !setRenderFeature(state.settings, tokens[0], atoi(tokens[1].c_str()) != 0)) {
+            cout << "Unknown render setting: " << line << endl;
+        }
+        utilityCore::safeGetline(fp_in, line);
+    }
+    return 1;
+}
+
 int Scene::loadMaterial(string materialid) {
     int id = atoi(materialid.c_str());
     if (id != materials.size()) {
@@ -393,24 +532,6 @@ int Scene::loadMaterial(string materialid) {
 //}
 
 
-//refer to https://solarianprogrammer.com/2019/06/10/c-programming-reading-writing-images-stb_image-libraries/
-glm::vec3 Scene::loadTexture(Geom& geo, const char* fileName)
-{
-    int width, height, channels;
-    geo.img = stbi_load(fileName, &width, &height, &channels, 0);
-    geo.texture_width = width;
-    geo.texture_height = height;
-    geo.channels = channels;
-    if (geo.img == NULL) {
-        printf("Error in loading the image\n");
-        exit(1);
-    }
-    printf("Loaded image with a width of %dpx, a height of %dpx and %d channels\n", width, height, channels);
-
-    
-}
-
-
 int Scene::loadMesh(const char* fileName)
 {
     printf("loading OBJ file: %s\n", fileName);
@@ -459,8 +580,9 @@ int Scene::loadMesh(const char* fileName)
             geo.scale = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
         }
         else if (strcmp(tokens[0].c_str(), "TEXTURE") == 0) {
-            geo.textureName = tokens[1].c_str();
-            loadTexture(geo, tokens[1].c_str());
+            // optional second token picks a block-compressed storage format (BC1, BC4, BC7)
+            int format = tokens.size() > 2 ? parseTextureFormat(tokens[2]) : TEX_RGBA8;
+            geo.textureId = textures.load(tokens[1], format);
         }
         else if (strcmp(tokens[0].c_str(), "MATERIAL") == 0) {
             geo.materialid = atoi(tokens[1].c_str());
@@ -615,8 +737,9 @@ int Scene::loadObj(const char* fileName)
             geo.scale = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
         }
         else if (strcmp(tokens[0].c_str(), "TEXTURE") == 0) {
-            geo.textureName = tokens[1].c_str();
-            loadTexture(geo, tokens[1].c_str());
+            // optional second token picks a block-compressed storage format (BC1, BC4, BC7)
+            int format = tokens.size() > 2 ? parseTextureFormat(tokens[2]) : TEX_RGBA8;
+            geo.textureId = textures.load(tokens[1], format);
         }
         else if (strcmp(tokens[0].c_str(), "MATERIAL") == 0) {
             geo.materialid = atoi(tokens[1].c_str());
@@ -693,6 +816,12 @@ int Scene::loadObj(const char* fileName)
             newTri.plane_normal = glm::normalize(glm::cross(newTri.p1 - newTri.p0, newTri.p2 - newTri.p1));
             newTri.S = glm::length(glm::cross(newTri.p1 - newTri.p0, newTri.p2 - newTri.p1));
 
+            // texture footprint per world unit, scaled by the texture size when picking a mip level
+            float uv_area = glm::abs((newTri.t1.x - newTri.t0.x) * (newTri.t2.y - newTri.t0.y)
+                - (newTri.t2.x - newTri.t0.x) * (newTri.t1.y - newTri.t0.y));
+            newTri.tex_ID = geo.textureId;
+            newTri.uv_density = newTri.S > 0.f ? glm::sqrt(uv_area / newTri.S) : 0.f;
+
 
             TriBounds newTriBounds;
 
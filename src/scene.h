@@ -7,19 +7,30 @@
 #include "glm/glm.hpp"
 #include "utilities.h"
 #include "sceneStructs.h"
+#include "texture.h"
 
 using namespace std;
 
+// switches one RenderSettings field by its scene file name, e.g. "DEPTH_OF_FIELD"
+// (case-insensitive), returns false for unknown names
+bool setRenderFeature(RenderSettings& settings, const std::string& name, bool enabled);
+// e.g. "anti_aliasing sort_material compaction"
+std::string describeRenderSettings(const RenderSettings& settings);
+// RaySort by name ("none", "material" or "direction", case-insensitive), -1 if unknown
+int parseRaySort(const std::string& name);
+const char* raySortName(int raySort);
+
 class Scene {
 private:
     ifstream fp_in;
     int loadMaterial(string materialid);
     int loadGeom(string objectid);
     int loadCamera();
+    int loadRenderSettings();
     int loadObj(const char* fileName);
     int loadMesh(const char* fileName);
-    glm::vec3 loadTexture(Geom &geo, const char* fileName);
 public:
+    // throws std::runtime_error when the file or bundle cannot be read
     Scene(string filename);
     ~Scene();
 
@@ -33,6 +44,8 @@ public:
     RenderState state;
 
     std::vector<Geom> Obj_geoms;
+
+    TextureTable textures;
     
     BVHNode* buildBVH(int start_index, int end_index);
     void reformatBVHToGPU();
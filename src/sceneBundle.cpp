@@ -0,0 +1,261 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "sceneBundle.h"
+
+namespace {
+
+// read-only mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile() { close(); }
+
+    // an empty file cannot be mapped and is no bundle either
+    bool open(const std::string& filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 ||
+                (unsigned long long)fileSize.QuadPart > (size_t)-1) {
+            CloseHandle(file);
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            CloseHandle(file);
+            return false;
+        }
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data == NULL) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+        }
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > (size_t)-1) {
+            ::close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        void* ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        data = ptr == MAP_FAILED ? NULL : (const unsigned char*)ptr;
+#endif
+        return data != NULL;
+    }
+
+    void close() {
+        if (data == NULL) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap((void*)data, size);
+#endif
+        data = NULL;
+    }
+
+    const unsigned char* data;
+    size_t size;
+
+private:
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+uint64_t alignUp(uint64_t offset) {
+    return (offset + SCENE_BUNDLE_ALIGNMENT - 1) & ~(uint64_t)(SCENE_BUNDLE_ALIGNMENT - 1);
+}
+
+struct PendingSection {
+    BundleSection desc;
+    const void* data;
+};
+
+template <typename T>
+PendingSection makeSection(BundleSectionId id, const T* data, size_t count) {
+    PendingSection s;
+    s.desc.id = id;
+    s.desc.elemSize = sizeof(T);
+    s.desc.offset = 0;
+    s.desc.count = count;
+    s.data = data;
+    return s;
+}
+
+// copies a section into `out`, failing if it is missing or was written with a different struct layout
+template <typename T>
+bool readSection(const MappedFile& file, const BundleSection* sections, int sectionCount,
+        BundleSectionId id, std::vector<T>& out) {
+    for (int i = 0; i < sectionCount; i++) {
+        const BundleSection& s = sections[i];
+        if (s.id != (uint32_t)id) {
+            continue;
+        }
+        if (s.elemSize != sizeof(T)) {
+            printf("Bundle section %d does not match this build (elemSize %u, expected %u)\n",
+                (int)id, s.elemSize, (unsigned)sizeof(T));
+            return false;
+        }
+        // written so that a crafted count or offset cannot overflow past the check
+        if (s.offset > file.size || s.count > (file.size - s.offset) / sizeof(T)) {
+            printf("Bundle section %d runs past the end of the file\n", (int)id);
+            return false;
+        }
+        const T* begin = (const T*)(file.data + s.offset);
+        out.assign(begin, begin + s.count);
+        return true;
+    }
+    printf("Bundle is missing section %d\n", (int)id);
+    return false;
+}
+
+}
+
+bool sceneBundle::isBundlePath(const std::string& filename) {
+    const std::string ext = SCENE_BUNDLE_EXTENSION;
+    return filename.size() > ext.size() &&
+        filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+bool sceneBundle::write(const Scene& scene, const std::string& filename) {
+    BundleRenderState state;
+    memset(&state, 0, sizeof(state));
+    state.camera = scene.state.camera;
+    state.iterations = scene.state.iterations;
+    state.traceDepth = scene.state.traceDepth;
+    state.settings = scene.state.settings;
+    strncpy(state.imageName, scene.state.imageName.c_str(), sizeof(state.imageName) - 1);
+
+    PendingSection sections[BUNDLE_SECTION_COUNT] = {
+        makeSection(BUNDLE_RENDER_STATE, &state, 1),
+        makeSection(BUNDLE_MATERIALS, scene.materials.data(), scene.materials.size()),
+        makeSection(BUNDLE_GEOMS, scene.geoms.data(), scene.geoms.size()),
+        makeSection(BUNDLE_OBJ_GEOMS, scene.Obj_geoms.data(), scene.Obj_geoms.size()),
+        makeSection(BUNDLE_TRIS, scene.mesh_tris_sorted.data(), scene.mesh_tris_sorted.size()),
+        makeSection(BUNDLE_BVH_NODES, scene.bvh_nodes_gpu.data(), scene.bvh_nodes_gpu.size()),
+        makeSection(BUNDLE_TEXTURE_DESCS, scene.textures.descs.data(), scene.textures.descs.size()),
+        makeSection(BUNDLE_TEXTURE_PIXELS, scene.textures.pixels.data(), scene.textures.pixels.size()),
+    };
+
+    // lay out: header, section table, then each section on its own aligned offset
+    uint64_t offset = alignUp(sizeof(BundleHeader) + sizeof(BundleSection) * BUNDLE_SECTION_COUNT);
+    for (int i = 0; i < BUNDLE_SECTION_COUNT; i++) {
+        sections[i].desc.offset = offset;
+        offset = alignUp(offset + sections[i].desc.count * sections[i].desc.elemSize);
+    }
+
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_BUNDLE_VERSION;
+    header.sectionCount = BUNDLE_SECTION_COUNT;
+    header.fileSize = offset;
+
+    std::vector<unsigned char> bytes(offset, 0);
+    memcpy(bytes.data(), &header, sizeof(header));
+    for (int i = 0; i < BUNDLE_SECTION_COUNT; i++) {
+        memcpy(bytes.data() + sizeof(header) + i * sizeof(BundleSection), &sections[i].desc, sizeof(BundleSection));
+        if (sections[i].desc.count > 0) {
+            memcpy(bytes.data() + sections[i].desc.offset, sections[i].data,
+                sections[i].desc.count * sections[i].desc.elemSize);
+        }
+    }
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (fp == NULL) {
+        printf("Could not open %s for writing\n", filename.c_str());
+        return false;
+    }
+    size_t written = fwrite(bytes.data(), 1, bytes.size(), fp);
+    fclose(fp);
+    if (written != bytes.size()) {
+        printf("Short write to %s\n", filename.c_str());
+        return false;
+    }
+    std::cout << "Saved " << filename << " (" << bytes.size() << " bytes)." << std::endl;
+    return true;
+}
+
+bool sceneBundle::read(Scene& scene, const std::string& filename) {
+    MappedFile file;
+    if (!file.open(filename)) {
+        printf("Could not map %s\n", filename.c_str());
+        return false;
+    }
+
+    if (file.size < sizeof(BundleHeader)) {
+        printf("%s is too small to be a scene bundle\n", filename.c_str());
+        return false;
+    }
+    const BundleHeader* header = (const BundleHeader*)file.data;
+    if (memcmp(header->magic, SCENE_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SCENE_BUNDLE_VERSION || header->fileSize != file.size) {
+        printf("%s is not a version %d scene bundle, recompile it\n", filename.c_str(), SCENE_BUNDLE_VERSION);
+        return false;
+    }
+    if (header->sectionCount > (file.size - sizeof(BundleHeader)) / sizeof(BundleSection)) {
+        printf("%s is truncated, its section table runs past the end\n", filename.c_str());
+        return false;
+    }
+    const BundleSection* sections = (const BundleSection*)(file.data + sizeof(BundleHeader));
+    const int sectionCount = (int)header->sectionCount;
+
+    std::vector<BundleRenderState> state;
+    if (!readSection(file, sections, sectionCount, BUNDLE_RENDER_STATE, state) ||
+        !readSection(file, sections, sectionCount, BUNDLE_MATERIALS, scene.materials) ||
+        !readSection(file, sections, sectionCount, BUNDLE_GEOMS, scene.geoms) ||
+        !readSection(file, sections, sectionCount, BUNDLE_OBJ_GEOMS, scene.Obj_geoms) ||
+        !readSection(file, sections, sectionCount, BUNDLE_TRIS, scene.mesh_tris_sorted) ||
+        !readSection(file, sections, sectionCount, BUNDLE_BVH_NODES, scene.bvh_nodes_gpu) ||
+        !readSection(file, sections, sectionCount, BUNDLE_TEXTURE_DESCS, scene.textures.descs) ||
+        !readSection(file, sections, sectionCount, BUNDLE_TEXTURE_PIXELS, scene.textures.pixels) ||
+        state.size() != 1) {
+        return false;
+    }
+
+    RenderState& rs = scene.state;
+    rs.camera = state[0].camera;
+    rs.iterations = state[0].iterations;
+    rs.traceDepth = state[0].traceDepth;
+    rs.settings = state[0].settings;
+    rs.imageName = state[0].imageName;
+    rs.image.assign(rs.camera.resolution.x * rs.camera.resolution.y, glm::vec3());
+
+    // the pointer-based BVH only exists to be flattened, the bundle stores the flat form
+    scene.root_node = NULL;
+    scene.num_tris = scene.mesh_tris_sorted.size();
+    scene.num_nodes = scene.bvh_nodes_gpu.size();
+    scene.num_geoms = scene.geoms.size();
+
+    printf("Loaded bundle %s: %d materials, %d geoms, %d tris, %d BVH nodes, %d textures\n", filename.c_str(),
+        (int)scene.materials.size(), (int)scene.geoms.size(), scene.num_tris, scene.num_nodes,
+        (int)scene.textures.descs.size());
+    return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "scene.h"
+
+// Compiled scene bundle: a versioned binary snapshot of everything the Scene
+// constructor builds (render state, materials, geoms, triangles, BVH nodes and
+// the decoded, mip-mapped texture table).
+// Every section starts on a 64-byte boundary so the mapped file can be copied
+// straight into the scene vectors without parsing anything.
+
+#define SCENE_BUNDLE_MAGIC     "CISBNDL"
+#define SCENE_BUNDLE_VERSION   8
+#define SCENE_BUNDLE_ALIGNMENT 64
+#define SCENE_BUNDLE_EXTENSION ".bundle"
+
+enum BundleSectionId {
+    BUNDLE_RENDER_STATE = 0,
+    BUNDLE_MATERIALS,
+    BUNDLE_GEOMS,
+    BUNDLE_OBJ_GEOMS,
+    BUNDLE_TRIS,
+    BUNDLE_BVH_NODES,
+    BUNDLE_TEXTURE_DESCS,
+    BUNDLE_TEXTURE_PIXELS,
+    BUNDLE_SECTION_COUNT
+};
+
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+};
+
+struct BundleSection {
+    uint32_t id;
+    uint32_t elemSize;  // sizeof() of the element when written, rejects stale layouts
+    uint64_t offset;    // from the start of the file, multiple of SCENE_BUNDLE_ALIGNMENT
+    uint64_t count;
+};
+
+// POD mirror of RenderState (which owns a std::vector and std::string)
+struct BundleRenderState {
+    Camera camera;
+    uint32_t iterations;
+    int32_t traceDepth;
+    RenderSettings settings;
+    char imageName[256];
+};
+
+namespace sceneBundle {
+    bool isBundlePath(const std::string& filename);
+    bool write(const Scene& scene, const std::string& filename);
+    bool read(Scene& scene, const std::string& filename);
+}
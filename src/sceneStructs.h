@@ -40,7 +40,7 @@ struct AABB {
 
     }
 
-    bool IntersectP(const Ray& ray) const
+    __host__ __device__ bool IntersectP(const Ray& ray) const
     {
 
         //auto temp1 = glm::vec3(pMax.x - ray.origin.x, pMax.y - ray.origin.y, pMax.z - ray.origin.z);
@@ -55,11 +55,12 @@ struct AABB {
         glm::vec3 ttop = temp1 * invDir;
         glm::vec3 tbot = temp2 * invDir;
 
-        auto tmin = glm::vec3(std::min(ttop.x, tbot.x), std::min(ttop.y, tbot.y), std::min(ttop.z, tbot.z));
-        auto tmax = glm::vec3(std::max(ttop.x, tbot.x), std::max(ttop.y, tbot.y), std::max(ttop.z, tbot.z));
+        // fminf/fmaxf rather than std::min/max so this also runs on the device
+        auto tmin = glm::vec3(fminf(ttop.x, tbot.x), fminf(ttop.y, tbot.y), fminf(ttop.z, tbot.z));
+        auto tmax = glm::vec3(fmaxf(ttop.x, tbot.x), fmaxf(ttop.y, tbot.y), fmaxf(ttop.z, tbot.z));
 
-        float t0 = std::max(tmin.x, (std::max)(tmin.y, tmin.z));
-        float t1 = std::min(tmax.x, (std::min)(tmax.y, tmax.z));
+        float t0 = fmaxf(tmin.x, fmaxf(tmin.y, tmin.z));
+        float t1 = fminf(tmax.x, fminf(tmax.y, tmax.z));
         return t0 <= t1 && t1 >= 0;
     }
 };
@@ -80,11 +81,7 @@ struct Geom {
     glm::vec2 uv[3];
     bool isObj{ false };
 
-    const char* textureName;
-    unsigned char* img;
-    int texture_width;
-    int texture_height;
-    int channels;
+    int textureId{ -1 };
 
     AABB bbox;
     int obj_start_offset;
@@ -106,12 +103,6 @@ struct Material {
     float microfacet{0};
     float roughness{0};
     float metalness{ 0 };
-
-    const char* textureName;
-    unsigned char* img;
-    int texture_width;
-    int texture_height;
-    int channels;
 };
 
 struct Camera {
@@ -127,10 +118,37 @@ struct Camera {
     float focalDistance;
 };
 
+// How the live paths are reordered after every intersection pass, see
+// computeSortKeys. MATERIAL groups the hits by material bin, DIRECTION also
+// orders by ray octant and the Morton code of the hit point.
+enum RaySort {
+    RAY_SORT_NONE,
+    RAY_SORT_MATERIAL,
+    RAY_SORT_DIRECTION,
+    RAY_SORT_COUNT
+};
+
+// Feature switches, set by the scene's RENDER block and --enable/--disable.
+// The ones inside kernels select a template instantiation, so a disabled
+// feature costs nothing in the hot loop. The defaults are the old build.
+struct RenderSettings {
+    bool antiAliasing = false;      // jitter camera rays within the pixel
+    bool depthOfField = false;      // thin lens, needs the camera's LENSE radius
+    bool directLighting = false;    // aim the last bounce at the hard-coded lights
+    bool sortMaterial = true;       // shade from per-material queues; these four can also be changed in the analytics window
+    bool compaction = true;
+    bool cacheFirstBounce = false;  // reuse the camera ray hits, with antiAliasing or depthOfField only if firstBounceSamples > 1
+    int firstBounceSamples = 1;     // jittered camera samples the first bounce cache keeps per pixel, sample s reuses s % this
+    bool regeneratePaths = false;   // refill finished path slots with new camera samples, see pathtrace()
+    int samplesPerCall = 1;         // samples per pixel traced by one pathtrace() call, the path buffers hold pixels x this
+    int raySort = RAY_SORT_NONE;    // a RaySort, also in the analytics window
+};
+
 struct RenderState {
     Camera camera;
     unsigned int iterations;
     int traceDepth;
+    RenderSettings settings;
     std::vector<glm::vec3> image;
     std::string imageName;
 };
@@ -140,6 +158,7 @@ struct PathSegment {
     glm::vec3 color;
     int pixelIndex;
     int remainingBounces;
+    int sample;  // camera sample index, keys the random streams
 };
 
 // Use with a corresponding PathSegment to do:
@@ -150,6 +169,88 @@ struct ShadeableIntersection {
   glm::vec3 surfaceNormal;
   int materialId;
   glm::vec2 uv;
+  int textureId;
+  float texDensity;  // sqrt(uv area / world area) of the hit triangle, for mip selection
+};
+
+// Device path state with one array per PathSegment field, indexed by path
+// slot. Stages that need a field or two read those arrays directly; load and
+// store move a whole record for the shading kernels.
+struct PathBuffers {
+    glm::vec3* origin;
+    glm::vec3* direction;
+    glm::vec3* color;
+    int* pixelIndex;
+    int* remainingBounces;
+    int* sample;
+
+    __host__ __device__ PathSegment load(int i) const {
+        PathSegment ps;
+        ps.ray.origin = origin[i];
+        ps.ray.direction = direction[i];
+        ps.color = color[i];
+        ps.pixelIndex = pixelIndex[i];
+        ps.remainingBounces = remainingBounces[i];
+        ps.sample = sample[i];
+        return ps;
+    }
+
+    __host__ __device__ void store(int i, const PathSegment& ps) const {
+        origin[i] = ps.ray.origin;
+        direction[i] = ps.ray.direction;
+        color[i] = ps.color;
+        pixelIndex[i] = ps.pixelIndex;
+        remainingBounces[i] = ps.remainingBounces;
+        sample[i] = ps.sample;
+    }
+
+    // the buffers from slot n on, e.g. one sample layer of a batch
+    __host__ __device__ PathBuffers shifted(int n) const {
+        PathBuffers b = { origin + n, direction + n, color + n, pixelIndex + n, remainingBounces + n, sample + n };
+        return b;
+    }
+    __host__ __device__ Ray ray(int i) const {
+        Ray r;
+        r.origin = origin[i];
+        r.direction = direction[i];
+        return r;
+    }
+};
+
+// ShadeableIntersection split the same way, indexed by the slot of the path
+// that made the hit. t is always written, the rest only for hits.
+struct HitBuffers {
+    float* t;
+    glm::vec3* surfaceNormal;
+    int* materialId;
+    glm::vec2* uv;
+    int* textureId;
+    float* texDensity;
+
+    __host__ __device__ ShadeableIntersection load(int i) const {
+        ShadeableIntersection isect;
+        isect.t = t[i];
+        isect.surfaceNormal = surfaceNormal[i];
+        isect.materialId = materialId[i];
+        isect.uv = uv[i];
+        isect.textureId = textureId[i];
+        isect.texDensity = texDensity[i];
+        return isect;
+    }
+
+    __host__ __device__ void store(int i, const ShadeableIntersection& isect) const {
+        t[i] = isect.t;
+        surfaceNormal[i] = isect.surfaceNormal;
+        materialId[i] = isect.materialId;
+        uv[i] = isect.uv;
+        textureId[i] = isect.textureId;
+        texDensity[i] = isect.texDensity;
+    }
+
+    __host__ __device__ HitBuffers shifted(int n) const {
+        HitBuffers b = { t + n, surfaceNormal + n, materialId + n, uv + n, textureId + n, texDensity + n };
+        return b;
+    }
 };
 
 struct Triangle {
@@ -221,4 +322,6 @@ struct Tri {
     glm::vec3 plane_normal;
     float S;
     int mat_ID;
+    int tex_ID;
+    float uv_density;
 };
\ No newline at end of file
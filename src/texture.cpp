@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstring>
+#include <stb_image.h>
+
+#include "texture.h"
+#include "textureCache.h"
+
+int parseTextureFormat(const std::string& name) {
+    if (name == "BC1") return TEX_BC1;
+    if (name == "BC4") return TEX_BC4;
+    if (name == "BC7") return TEX_BC7;
+    return TEX_RGBA8;
+}
+
+// packs one RGBA8 level into 4x4 blocks, edge blocks repeat the last row/column
+static void compressLevel(const unsigned char* src, int w, int h, int format, std::vector<unsigned char>& out) {
+    unsigned char block[16 * 4];
+    unsigned char encoded[16];
+    for (int by = 0; by < (h + 3) / 4; by++) {
+        for (int bx = 0; bx < (w + 3) / 4; bx++) {
+            for (int y = 0; y < 4; y++) {
+                int sy = glm::min(by * 4 + y, h - 1);
+                for (int x = 0; x < 4; x++) {
+                    int sx = glm::min(bx * 4 + x, w - 1);
+                    memcpy(&block[(y * 4 + x) * 4], &src[((size_t)sy * w + sx) * 4], 4);
+                }
+            }
+            if (format == TEX_BC1) {
+                encodeBC1Block(block, encoded);
+            } else if (format == TEX_BC4) {
+                encodeBC4Block(block, encoded);
+            } else {
+                encodeBC7Block(block, encoded);
+            }
+            out.insert(out.end(), encoded, encoded + blockBytes(format));
+        }
+    }
+}
+
+int mipLevelCount(int width, int height) {
+    int levels = 1;
+    while (levels < MAX_MIP_LEVELS && (width >> levels || height >> levels)) {
+        levels++;
+    }
+    return levels;
+}
+
+void appendMipChain(std::vector<unsigned char>& pixels, int width, int height, int mipLevels,
+        long long* mipOffset) {
+    for (int level = 1; level < mipLevels; level++) {
+        int srcW = mipDimension(width, level - 1);
+        int srcH = mipDimension(height, level - 1);
+        int dstW = mipDimension(width, level);
+        int dstH = mipDimension(height, level);
+        mipOffset[level] = pixels.size() / 4;
+        pixels.resize(pixels.size() + (size_t)dstW * dstH * 4);
+
+        const unsigned char* src = &pixels[mipOffset[level - 1] * 4];
+        unsigned char* dst = &pixels[mipOffset[level] * 4];
+        for (int y = 0; y < dstH; y++) {
+            int y0 = glm::min(2 * y, srcH - 1);
+            int y1 = glm::min(2 * y + 1, srcH - 1);
+            for (int x = 0; x < dstW; x++) {
+                int x0 = glm::min(2 * x, srcW - 1);
+                int x1 = glm::min(2 * x + 1, srcW - 1);
+                for (int c = 0; c < 4; c++) {
+                    int sum = src[(y0 * srcW + x0) * 4 + c] + src[(y0 * srcW + x1) * 4 + c]
+                        + src[(y1 * srcW + x0) * 4 + c] + src[(y1 * srcW + x1) * 4 + c];
+                    dst[(y * dstW + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+// bytes of one level in the pool
+static size_t levelBytes(int w, int h, int format) {
+    if (format == TEX_RGBA8) {
+        return (size_t)w * h * 4;
+    }
+    return (size_t)((w + 3) / 4) * ((h + 3) / 4) * blockBytes(format);
+}
+
+TextureTable::TextureTable() {
+}
+
+TextureTable::~TextureTable() {
+}
+
+int TextureTable::load(const std::string& path, int format) {
+    // the same image may be stored once per format it is asked for in
+    std::map<std::pair<std::string, int>, int>::iterator found = ids.find(std::make_pair(path, format));
+    if (found != ids.end()) {
+        return found->second;
+    }
+
+    Pending texture;
+    texture.path = path;
+    texture.format = format;
+    texture.cacheId = cache ? cache->registerTexture(path) : -1;
+    if (texture.cacheId >= 0) {
+        cache->textureSize(texture.cacheId, texture.width, texture.height, texture.mipLevels);
+        printf("Found tiles for texture %s (%dx%d)\n", path.c_str(), texture.width, texture.height);
+    } else {
+        int channels;
+        unsigned char* img = stbi_load(path.c_str(), &texture.width, &texture.height, &channels, 4);
+        if (img == NULL) {
+            printf("Error loading texture %s: %s\n", path.c_str(), stbi_failure_reason());
+            return -1;
+        }
+        printf("Loaded texture %s (%dx%d, %d channels)\n", path.c_str(), texture.width, texture.height, channels);
+        texture.mipLevels = mipLevelCount(texture.width, texture.height);
+        texture.chain.assign(img, img + (size_t)texture.width * texture.height * 4);
+        stbi_image_free(img);
+        long long chainOffset[MAX_MIP_LEVELS];
+        chainOffset[0] = 0;
+        appendMipChain(texture.chain, texture.width, texture.height, texture.mipLevels, chainOffset);
+        if (cache) {
+            texture.cacheId = cache->tileTexture(path, texture.width, texture.height, texture.mipLevels, texture.chain);
+        }
+        // without tiles the chain stays in memory; a freshly tiled one saves
+        // reading it back while the held chains fit in the budget
+        if (texture.cacheId < 0 || chainBytes + texture.chain.size() <= budget) {
+            chainBytes += texture.chain.size();
+        } else {
+            std::vector<unsigned char>().swap(texture.chain);
+        }
+    }
+
+    // resolve() appends the pending textures to descs in order
+    int id = descs.size() + pending.size();
+    pending.push_back(std::move(texture));
+    ids[std::make_pair(path, format)] = id;
+    return id;
+}
+
+void TextureTable::resolve() {
+    if (cache) {
+        cache->setBudget(budget);  // the scene may set the budget after its first texture
+    }
+    std::vector<int> first(pending.size(), 0);  // finest resident level of each texture
+    size_t total = 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+        const Pending& p = pending[i];
+        for (int level = 0; level < p.mipLevels; level++) {
+            total += levelBytes(mipDimension(p.width, level), mipDimension(p.height, level), p.format);
+        }
+    }
+    while (total > budget) {
+        int largest = -1;
+        size_t largestBytes = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            const Pending& p = pending[i];
+            size_t bytes = levelBytes(mipDimension(p.width, first[i]), mipDimension(p.height, first[i]), p.format);
+            if (first[i] + 1 < p.mipLevels && bytes > largestBytes) {
+                largest = i;
+                largestBytes = bytes;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        first[largest]++;
+        total -= largestBytes;
+    }
+
+    pixels.reserve(pixels.size() + total);
+    std::vector<unsigned char> level;
+    for (size_t i = 0; i < pending.size(); i++) {
+        Pending& p = pending[i];
+        // the desc describes the resident part as a texture of its own, the
+        // shaders pick mip levels from its size so they need no offset
+        TextureDesc desc;
+        desc.width = mipDimension(p.width, first[i]);
+        desc.height = mipDimension(p.height, first[i]);
+        desc.mipLevels = p.mipLevels - first[i];
+        desc.format = p.format;
+        size_t chainOffset = 0;
+        for (int l = 0; l < p.mipLevels; l++) {
+            int w = mipDimension(p.width, l);
+            int h = mipDimension(p.height, l);
+            const unsigned char* src = p.chain.empty() ? NULL : &p.chain[chainOffset];
+            chainOffset += (size_t)w * h * 4;
+            if (l < first[i]) {
+                continue;
+            }
+            if (src == NULL) {
+                level.resize((size_t)w * h * 4);
+                cache->readLevel(p.cacheId, l, level.data());
+                src = level.data();
+            }
+            desc.mipOffset[l - first[i]] = pixels.size();
+            if (p.format == TEX_RGBA8) {
+                pixels.insert(pixels.end(), src, src + (size_t)w * h * 4);
+            } else {
+                compressLevel(src, w, h, p.format, pixels);
+            }
+        }
+        if (first[i] > 0) {
+            printf("Texture %s: %dx%d resident to fit the texture budget\n", p.path.c_str(), desc.width, desc.height);
+        }
+        descs.push_back(desc);
+        std::vector<unsigned char>().swap(p.chain);
+    }
+    if (!pending.empty()) {
+        printf("Textures: %d, %.1f MB resident of a %.1f MB budget\n", (int)pending.size(),
+            pixels.size() / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+    }
+    pending.clear();
+    chainBytes = 0;
+}
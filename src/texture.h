@@ -0,0 +1,160 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "blockCompression.h"
+
+#define MAX_MIP_LEVELS 16
+#define TEXTURE_DEFAULT_BUDGET (1024ull << 20)
+
+class TextureCache;
+
+// One texture in the shared table. Every mip level lives in the same pooled
+// byte buffer, `mipOffset` is the byte offset of the level in it. Levels are
+// either plain RGBA8 texels or rows of 4x4 blocks in a TextureFormat.
+struct TextureDesc {
+    int width;
+    int height;
+    int mipLevels;
+    int format;
+    long long mipOffset[MAX_MIP_LEVELS];
+};
+
+// Scene-wide texture table, deduplicated by path and format. All textures and their mip
+// chains are packed into `pixels` so the whole table uploads in two copies.
+// load() only registers a texture; resolve() then keeps the finest levels
+// that fit in `budget` bytes, dropping the top level of the largest texture
+// until they do. With a cache set, those levels are read from its tiled
+// sidecars, and only images without an up-to-date sidecar are decoded.
+class TextureTable {
+public:
+    TextureTable();
+    ~TextureTable();
+
+    // returns the texture id for `path`, stored compressed to `format` by resolve(), -1 on failure
+    int load(const std::string& path, int format = TEX_RGBA8);
+    // fills descs and pixels, once after the last load
+    void resolve();
+
+    std::vector<TextureDesc> descs;
+    std::vector<unsigned char> pixels;
+    std::unique_ptr<TextureCache> cache;
+    size_t budget = TEXTURE_DEFAULT_BUDGET;  // bytes of pixels
+
+private:
+    // a loaded texture until resolve() picks its resident levels
+    struct Pending {
+        std::string path;
+        int width;
+        int height;
+        int mipLevels;
+        int format;
+        int cacheId;  // -1 without tiles
+        std::vector<unsigned char> chain;  // RGBA8 levels one after another, empty to read them from the tiles
+    };
+
+    std::vector<Pending> pending;
+    size_t chainBytes = 0;  // held in pending
+    std::map<std::pair<std::string, int>, int> ids;
+};
+
+// "RGBA8", "BC1", "BC4" or "BC7", anything else is RGBA8
+int parseTextureFormat(const std::string& name);
+
+// number of levels in a full mip chain down to 1x1 (capped at MAX_MIP_LEVELS)
+int mipLevelCount(int width, int height);
+
+// appends levels 1..mipLevels-1 of an RGBA8 image to `pixels`, each a 2x2 box filter of the previous
+// level, and records their offsets (in texels) in `mipOffset`; level 0 must already be in `pixels`
+void appendMipChain(std::vector<unsigned char>& pixels, int width, int height, int mipLevels,
+    long long* mipOffset);
+
+__host__ __device__ inline int mipDimension(int size, int level) {
+    return glm::max(size >> level, 1);
+}
+
+/**
+ * Reads one texel of a mip level with repeat wrapping, returned in [0, 1].
+ * Compressed formats decode only the block holding the texel.
+ */
+__host__ __device__ inline glm::vec4 fetchTexel(const TextureDesc& tex, const unsigned char* pixels,
+        int level, int x, int y) {
+    int w = mipDimension(tex.width, level);
+    int h = mipDimension(tex.height, level);
+    x %= w;
+    y %= h;
+    if (x < 0) x += w;
+    if (y < 0) y += h;
+    const unsigned char* base = pixels + tex.mipOffset[level];
+    if (tex.format == TEX_RGBA8) {
+        const unsigned char* p = base + ((long long)y * w + x) * 4;
+        return glm::vec4(p[0], p[1], p[2], p[3]) / 255.f;
+    }
+
+    int blocksX = (w + 3) / 4;
+    const unsigned char* block = base + ((long long)(y >> 2) * blocksX + (x >> 2)) * blockBytes(tex.format);
+    switch (tex.format) {
+    case TEX_BC1:
+        return decodeBC1Texel(block, x & 3, y & 3);
+    case TEX_BC4:
+        return decodeBC4Texel(block, x & 3, y & 3);
+    default:
+        return decodeBC7Texel(block, x & 3, y & 3);
+    }
+}
+
+// texel source for the filters below when the whole mip chain is resident in the pool
+struct PooledTexels {
+    const TextureDesc& tex;
+    const unsigned char* pixels;
+
+    __host__ __device__ PooledTexels(const TextureDesc& tex, const unsigned char* pixels) : tex(tex), pixels(pixels) {}
+
+    __host__ __device__ glm::vec4 operator()(int level, int x, int y) const {
+        return fetchTexel(tex, pixels, level, x, y);
+    }
+};
+
+/**
+ * Bilinear filter over any texel source callable as fetch(level, x, y).
+ */
+template <typename Fetch>
+__host__ __device__ inline glm::vec4 filterBilinear(const Fetch& fetch, int width, int height,
+        int level, glm::vec2 uv) {
+    float fx = uv.x * mipDimension(width, level) - 0.5f;
+    float fy = uv.y * mipDimension(height, level) - 0.5f;
+    int x0 = (int)floorf(fx);
+    int y0 = (int)floorf(fy);
+    float ax = fx - x0;
+    float ay = fy - y0;
+    glm::vec4 top = glm::mix(fetch(level, x0, y0), fetch(level, x0 + 1, y0), ax);
+    glm::vec4 bottom = glm::mix(fetch(level, x0, y0 + 1), fetch(level, x0 + 1, y0 + 1), ax);
+    return glm::mix(top, bottom, ay);
+}
+
+/**
+ * Trilinear filter: bilinear in the two mip levels around `lod`, blended.
+ * lod 0 is the full resolution image.
+ */
+template <typename Fetch>
+__host__ __device__ inline glm::vec4 filterTrilinear(const Fetch& fetch, int width, int height,
+        int mipLevels, glm::vec2 uv, float lod) {
+    lod = glm::clamp(lod, 0.f, (float)(mipLevels - 1));
+    int level0 = (int)lod;
+    int level1 = glm::min(level0 + 1, mipLevels - 1);
+    float blend = lod - level0;
+    glm::vec4 c0 = filterBilinear(fetch, width, height, level0, uv);
+    if (blend <= 0.f || level0 == level1) {
+        return c0;
+    }
+    return glm::mix(c0, filterBilinear(fetch, width, height, level1, uv), blend);
+}
+
+__host__ __device__ inline glm::vec4 sampleTexture(const TextureDesc& tex, const unsigned char* pixels,
+        glm::vec2 uv, float lod) {
+    return filterTrilinear(PooledTexels(tex, pixels), tex.width, tex.height, tex.mipLevels, uv, lod);
+}
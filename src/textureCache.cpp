@@ -0,0 +1,298 @@
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "textureCache.h"
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define getpid _getpid
+#else
+#define fseek64 fseeko
+#endif
+
+namespace {
+
+struct TileFileHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t mipLevels;
+    int32_t tileSize;
+    int64_t sourceModified;  // of the image the tiles came from
+    int64_t sourceSize;
+};
+
+bool sourceStamp(const std::string& path, int64_t& modified, int64_t& size) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    modified = (int64_t)st.st_mtime;
+    size = (int64_t)st.st_size;
+    return true;
+}
+
+int tilesAcross(int size, int level) {
+    return (mipDimension(size, level) + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+}
+
+// one per writer, the render service's loader threads (or other processes)
+// may tile the same image at the same time
+std::string tempPath(const std::string& tilePath) {
+    std::ostringstream name;
+    name << tilePath << "." << getpid() << "." << std::this_thread::get_id() << ".tmp";
+    return name.str();
+}
+
+uint64_t tileKey(int texId, int level, int tileX, int tileY) {
+    return ((uint64_t)texId << 48) | ((uint64_t)level << 40) | ((uint64_t)tileY << 20) | (uint64_t)tileX;
+}
+
+}
+
+TextureCache::TextureCache(size_t budgetBytes)
+    : shardBudget(budgetBytes / TEXTURE_CACHE_SHARDS), hits(0), misses(0), evictions(0) {
+    for (int i = 0; i < TEXTURE_CACHE_SHARDS; i++) {
+        shards[i].bytes = 0;
+    }
+}
+
+TextureCache::~TextureCache() {
+    for (size_t i = 0; i < textures.size(); i++) {
+        if (textures[i].file) {
+            fclose(textures[i].file);
+        }
+    }
+}
+
+void TextureCache::setBudget(size_t budgetBytes) {
+    shardBudget = budgetBytes / TEXTURE_CACHE_SHARDS;
+}
+
+// writes all mip levels of the chain as padded 64x64 tiles
+bool TextureCache::writeSidecar(const std::string& path, const std::string& tilePath, int width, int height,
+        int mipLevels, const std::vector<unsigned char>& chain) {
+    std::string tmpPath = tempPath(tilePath);
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (fp == NULL) {
+        printf("Could not write texture tiles to %s\n", tmpPath.c_str());
+        return false;
+    }
+    TileFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXTURE_TILE_MAGIC, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    header.mipLevels = mipLevels;
+    header.tileSize = TEXTURE_TILE_SIZE;
+    sourceStamp(path, header.sourceModified, header.sourceSize);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    Tile tile(TEXTURE_TILE_BYTES);
+    size_t levelOffset = 0;
+    for (int level = 0; level < mipLevels; level++) {
+        int w = mipDimension(width, level);
+        int h = mipDimension(height, level);
+        const unsigned char* src = &chain[levelOffset];
+        levelOffset += (size_t)w * h * 4;
+        for (int ty = 0; ty < tilesAcross(height, level); ty++) {
+            for (int tx = 0; tx < tilesAcross(width, level); tx++) {
+                // edge tiles repeat the last row/column so every tile has the same size on disk
+                for (int y = 0; y < TEXTURE_TILE_SIZE; y++) {
+                    int sy = glm::min(ty * TEXTURE_TILE_SIZE + y, h - 1);
+                    for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+                        int sx = glm::min(tx * TEXTURE_TILE_SIZE + x, w - 1);
+                        memcpy(&tile[(y * TEXTURE_TILE_SIZE + x) * 4], &src[((size_t)sy * w + sx) * 4], 4);
+                    }
+                }
+                fwrite(tile.data(), 1, tile.size(), fp);
+            }
+        }
+    }
+    bool ok = ferror(fp) == 0;
+    fclose(fp);
+
+#ifdef _WIN32
+    remove(tilePath.c_str());  // rename does not replace there, elsewhere it does so atomically
+#endif
+    if (!ok || rename(tmpPath.c_str(), tilePath.c_str()) != 0) {
+        printf("Could not write texture tiles to %s\n", tilePath.c_str());
+        remove(tmpPath.c_str());
+        return false;
+    }
+    printf("Tiled texture %s into %s\n", path.c_str(), tilePath.c_str());
+    return true;
+}
+
+int TextureCache::registerTexture(const std::string& path) {
+    std::unordered_map<std::string, int>::iterator found = ids.find(path);
+    if (found != ids.end()) {
+        return found->second;
+    }
+
+    std::string tilePath = path + ".tiles";
+    int64_t modified = 0, size = 0;
+    sourceStamp(path, modified, size);
+    TileFileHeader header;
+    FILE* fp = fopen(tilePath.c_str(), "rb");
+    // a stale or corrupt sidecar is ignored, the level count bounds the arrays below
+    bool valid = fp != NULL && fread(&header, sizeof(header), 1, fp) == 1 &&
+        memcmp(header.magic, TEXTURE_TILE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.tileSize == TEXTURE_TILE_SIZE &&
+        header.sourceModified == modified && header.sourceSize == size &&
+        header.width > 0 && header.height > 0 &&
+        header.mipLevels >= 1 && header.mipLevels <= MAX_MIP_LEVELS;
+    if (!valid) {
+        if (fp) {
+            fclose(fp);
+        }
+        return -1;
+    }
+
+    TextureInfo info;
+    info.width = header.width;
+    info.height = header.height;
+    info.mipLevels = header.mipLevels;
+    info.tilePath = tilePath;
+    info.file = fp;
+    info.fileMutex.reset(new std::mutex());
+    long long tile = 0;
+    for (int level = 0; level < info.mipLevels; level++) {
+        info.firstTile[level] = tile;
+        tile += (long long)tilesAcross(info.width, level) * tilesAcross(info.height, level);
+    }
+
+    int id = textures.size();
+    textures.push_back(std::move(info));
+    ids[path] = id;
+    return id;
+}
+
+int TextureCache::tileTexture(const std::string& path, int width, int height, int mipLevels,
+        const std::vector<unsigned char>& chain) {
+    // a writer that loses the race to another one uses the winner's sidecar
+    writeSidecar(path, path + ".tiles", width, height, mipLevels, chain);
+    return registerTexture(path);
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::readTile(const TextureInfo& info,
+        int level, int tileX, int tileY) {
+    long long index = info.firstTile[level] + (long long)tileY * tilesAcross(info.width, level) + tileX;
+    std::shared_ptr<Tile> tile = std::make_shared<Tile>(TEXTURE_TILE_BYTES);
+
+    std::lock_guard<std::mutex> lock(*info.fileMutex);
+    fseek64(info.file, sizeof(TileFileHeader) + index * TEXTURE_TILE_BYTES, SEEK_SET);
+    if (fread(tile->data(), 1, TEXTURE_TILE_BYTES, info.file) != TEXTURE_TILE_BYTES) {
+        printf("Short read from %s (tile %lld)\n", info.tilePath.c_str(), index);
+    }
+    return tile;
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::getTile(int texId, int level, int tileX, int tileY) {
+    uint64_t key = tileKey(texId, level, tileX, tileY);
+    Shard& shard = shards[((key * 0x9E3779B97F4A7C15ull) >> 32) % TEXTURE_CACHE_SHARDS];
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.tiles.find(key);
+        if (found != shard.tiles.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, found->second.second);
+            hits++;
+            return found->second.first;
+        }
+    }
+
+    // the read happens outside the shard lock, two threads missing the same tile both read it
+    misses++;
+    std::shared_ptr<const Tile> tile = readTile(textures[texId], level, tileX, tileY);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.tiles.find(key);
+    if (found != shard.tiles.end()) {
+        return found->second.first;
+    }
+    shard.lru.push_front(key);
+    shard.tiles[key] = std::make_pair(tile, shard.lru.begin());
+    shard.bytes += TEXTURE_TILE_BYTES;
+    while (shard.bytes > shardBudget && shard.lru.size() > 1) {
+        shard.tiles.erase(shard.lru.back());
+        shard.lru.pop_back();
+        shard.bytes -= TEXTURE_TILE_BYTES;
+        evictions++;
+    }
+    return tile;
+}
+
+void TextureCache::textureSize(int texId, int& width, int& height, int& mipLevels) const {
+    const TextureInfo& info = textures[texId];
+    width = info.width;
+    height = info.height;
+    mipLevels = info.mipLevels;
+}
+
+void TextureCache::readLevel(int texId, int level, unsigned char* out) {
+    const TextureInfo& info = textures[texId];
+    int w = mipDimension(info.width, level);
+    int h = mipDimension(info.height, level);
+    for (int ty = 0; ty < tilesAcross(info.height, level); ty++) {
+        for (int tx = 0; tx < tilesAcross(info.width, level); tx++) {
+            std::shared_ptr<const Tile> tile = readTile(info, level, tx, ty);
+            int rows = glm::min(TEXTURE_TILE_SIZE, h - ty * TEXTURE_TILE_SIZE);
+            int cols = glm::min(TEXTURE_TILE_SIZE, w - tx * TEXTURE_TILE_SIZE);
+            for (int y = 0; y < rows; y++) {
+                memcpy(out + ((size_t)(ty * TEXTURE_TILE_SIZE + y) * w + tx * TEXTURE_TILE_SIZE) * 4,
+                    &(*tile)[y * TEXTURE_TILE_SIZE * 4], cols * 4);
+            }
+        }
+    }
+}
+
+glm::vec4 TextureCache::fetchTexel(int texId, int level, int x, int y) {
+    const TextureInfo& info = textures[texId];
+    int w = mipDimension(info.width, level);
+    int h = mipDimension(info.height, level);
+    x %= w;
+    y %= h;
+    if (x < 0) x += w;
+    if (y < 0) y += h;
+
+    std::shared_ptr<const Tile> tile = getTile(texId, level, x / TEXTURE_TILE_SIZE, y / TEXTURE_TILE_SIZE);
+    const unsigned char* p = &(*tile)[((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + (x % TEXTURE_TILE_SIZE)) * 4];
+    return glm::vec4(p[0], p[1], p[2], p[3]) / 255.f;
+}
+
+glm::vec4 TextureCache::sample(int texId, glm::vec2 uv, float lod) {
+    const TextureInfo& info = textures[texId];
+    auto fetch = [this, texId](int level, int x, int y) { return fetchTexel(texId, level, x, y); };
+    return filterTrilinear(fetch, info.width, info.height, info.mipLevels, uv, lod);
+}
+
+TextureCache::Stats TextureCache::stats() const {
+    Stats s;
+    s.hits = hits;
+    s.misses = misses;
+    s.evictions = evictions;
+    s.bytesResident = 0;
+    for (int i = 0; i < TEXTURE_CACHE_SHARDS; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        s.bytesResident += shards[i].bytes;
+    }
+    return s;
+}
+
+void TextureCache::printStats() const {
+    Stats s = stats();
+    uint64_t lookups = s.hits + s.misses;
+    printf("Texture cache: %llu lookups, %.1f%% hits, %llu evictions, %.1f MB resident\n",
+        (unsigned long long)lookups, lookups ? 100.0 * s.hits / lookups : 0.0,
+        (unsigned long long)s.evictions, s.bytesResident / (1024.0 * 1024.0));
+}
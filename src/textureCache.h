@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "texture.h"
+
+#define TEXTURE_TILE_SIZE   64
+#define TEXTURE_TILE_BYTES  (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 4)
+#define TEXTURE_TILE_MAGIC  "CISTILE"
+#define TEXTURE_CACHE_SHARDS 16
+
+// On-demand texture storage. Each texture gets a tiled sidecar file
+// (<path>.tiles) holding every mip level as 64x64 RGBA8 tiles, written the
+// first time the texture is seen, so later loads never decode the source
+// image. The texture table reads only the levels it keeps resident from it;
+// host-side lookups read only the tiles they touch and keep them in memory
+// under a byte budget with LRU eviction.
+//
+// Tiles are spread over independently locked shards so concurrent render
+// threads only contend when they hit the same shard at the same time.
+// Textures are registered during scene load, before any fetch. A sidecar
+// older than its source image, or with a different size, is not used.
+class TextureCache {
+public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t bytesResident;
+    };
+
+    explicit TextureCache(size_t budgetBytes);
+    ~TextureCache();
+
+    // bounds the tiles kept for lookups, takes effect with the next miss
+    void setBudget(size_t budgetBytes);
+
+    // returns the cache texture id of path's up-to-date sidecar, -1 if it has none
+    int registerTexture(const std::string& path);
+    // tiles a decoded RGBA8 mip chain (levels one after another) into path's
+    // sidecar and registers it, or the sidecar a concurrent writer renamed into
+    // place first; -1 if there is none
+    int tileTexture(const std::string& path, int width, int height, int mipLevels,
+        const std::vector<unsigned char>& chain);
+
+    void textureSize(int texId, int& width, int& height, int& mipLevels) const;
+    // copies one whole mip level into `out` as tightly packed RGBA8 rows, tile
+    // by tile straight from the sidecar, the tiles are not kept
+    void readLevel(int texId, int level, unsigned char* out);
+
+    glm::vec4 fetchTexel(int texId, int level, int x, int y);
+    glm::vec4 sample(int texId, glm::vec2 uv, float lod);
+
+    Stats stats() const;
+    void printStats() const;
+
+private:
+    typedef std::vector<unsigned char> Tile;
+
+    struct TextureInfo {
+        int width;
+        int height;
+        int mipLevels;
+        long long firstTile[MAX_MIP_LEVELS];  // index of each level's first tile in the sidecar
+        std::string tilePath;
+        FILE* file;
+        std::unique_ptr<std::mutex> fileMutex;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // most recently used at the front
+        std::list<uint64_t> lru;
+        std::unordered_map<uint64_t, std::pair<std::shared_ptr<const Tile>, std::list<uint64_t>::iterator> > tiles;
+        size_t bytes;
+    };
+
+    std::shared_ptr<const Tile> getTile(int texId, int level, int tileX, int tileY);
+    std::shared_ptr<const Tile> readTile(const TextureInfo& info, int level, int tileX, int tileY);
+    bool writeSidecar(const std::string& path, const std::string& tilePath, int width, int height,
+        int mipLevels, const std::vector<unsigned char>& chain);
+
+    std::vector<TextureInfo> textures;
+    std::unordered_map<std::string, int> ids;
+    Shard shards[TEXTURE_CACHE_SHARDS];
+    size_t shardBudget;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+};
@@ -14,11 +14,55 @@
 #define SQRT_OF_ONE_THIRD 0.5773502691896257645091487805019574556476f
 #define EPSILON           0.00001f
 
+#define GUI_HISTORY 240  // samples kept by the scrolling plots
+
+// ring buffer laid out for ImGui::PlotLines(values, GUI_HISTORY, offset)
+struct PlotHistory {
+    float values[GUI_HISTORY];
+    int offset;
+
+    PlotHistory() : offset(0) {
+        std::fill(values, values + GUI_HISTORY, 0.f);
+    }
+    void push(float v) {
+        values[offset] = v;
+        offset = (offset + 1) % GUI_HISTORY;
+    }
+    float latest() const {
+        return values[(offset + GUI_HISTORY - 1) % GUI_HISTORY];
+    }
+};
+
 class GuiDataContainer
 {
 public:
-    GuiDataContainer() : TracedDepth(0) {}
+    GuiDataContainer()
+        : TracedDepth(0), SortMaterial(true), Compaction(true), CacheFirstBounce(false), RegeneratePaths(false),
+          RaySort(0), StageTimings(false),
+          RaysTraced(0), ConvergenceError(-1.f) {}
     int TracedDepth;
+
+    // runtime switches for what used to be compile-time features, the defaults
+    // come from the scene's RenderSettings (InitDataContainer)
+    bool SortMaterial;
+    bool Compaction;
+    bool CacheFirstBounce;
+    bool RegeneratePaths;
+    int RaySort;  // a RaySort
+    bool StageTimings;  // GPU stage timers, off by default since they cost one sync per iteration
+
+    // written by pathtrace() every iteration
+    unsigned long long RaysTraced;
+    std::vector<int> ActivePaths;  // per bounce, before intersection
+    float ConvergenceError;  // mean relative standard error of the pixels, -1 until known
+    std::vector<std::pair<std::string, size_t> > DeviceMemory;  // bytes per subsystem
+
+    // scrolling plots, pushed once per iteration by runCuda
+    PlotHistory IterationMs;
+    PlotHistory RaysPerSecond;  // millions
+    PlotHistory Convergence;
+    PlotHistory MemoryMB;  // whole device, from cudaMemGetInfo
+    std::vector<std::pair<std::string, PlotHistory> > StageMs;
 };
 
 namespace utilityCore {